@@ -294,6 +294,15 @@ Catalog::Catalog(const string &stationFile,
           std::stod(row.at("ddObs_finalResidualMedian"));
       ev.relocInfo.ddObs.finalResidualMAD =
           std::stod(row.at("ddObs_finalResidualMAD"));
+      ev.relocInfo.solver.iterations = 0;
+      ev.relocInfo.solver.converged  = false;
+      if (row.count("solver_iterations") != 0 &&
+          row.count("solver_converged") != 0)
+      {
+        ev.relocInfo.solver.iterations =
+            std::stoul(row.at("solver_iterations"));
+        ev.relocInfo.solver.converged  = strToBool(row.at("solver_converged"));
+      }
     }
     _events[ev.id] = ev;
   }
@@ -751,7 +760,8 @@ void Catalog::writeToFile(string eventFile,
          "ph_stationDistMin,ph_stationDistMedian,ph_stationDistMax,"
          "ddObs_numTTp,ddObs_numTTs,ddObs_numCCp,ddObs_numCCs,"
          "ddObs_startResidualMedian,ddObs_startResidualMAD,"
-         "ddObs_finalResidualMedian,ddObs_finalResidualMAD"
+         "ddObs_finalResidualMedian,ddObs_finalResidualMAD,"
+         "solver_iterations,solver_converged"
       << endl;
   evStreamNoReloc << endl;
 
@@ -770,14 +780,14 @@ void Catalog::writeToFile(string eventFile,
 
     if (!ev.relocInfo.isRelocated)
     {
-      evStreamReloc << ",false,,,,,,,,,,,,,,,,,,,,,,";
+      evStreamReloc << ",false,,,,,,,,,,,,,,,,,,,,,,,,";
     }
     else
     {
       relocInfo = true;
       evStreamReloc << stringify(
           ",true,%.3f,%.3f,%.3f,%.3f,%u,%.3f,%.3f,%.3f,%.3f,"
-          "%u,%u,%.3f,%.3f,%.3f,%u,%u,%u,%u,%.4f,%.4f,%.4f,%.4f",
+          "%u,%u,%.3f,%.3f,%.3f,%u,%u,%u,%u,%.4f,%.4f,%.4f,%.4f,%u,%s",
           ev.relocInfo.startRms, ev.relocInfo.locChange,
           ev.relocInfo.depthChange, ev.relocInfo.timeChange,
           ev.relocInfo.neighbours.amount,
@@ -793,7 +803,8 @@ void Catalog::writeToFile(string eventFile,
           ev.relocInfo.ddObs.numCCs, ev.relocInfo.ddObs.startResidualMedian,
           ev.relocInfo.ddObs.startResidualMAD,
           ev.relocInfo.ddObs.finalResidualMedian,
-          ev.relocInfo.ddObs.finalResidualMAD);
+          ev.relocInfo.ddObs.finalResidualMAD, ev.relocInfo.solver.iterations,
+          ev.relocInfo.solver.converged ? "true" : "false");
     }
     evStreamReloc << endl;
   }
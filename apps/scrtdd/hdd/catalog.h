@@ -111,6 +111,12 @@ public:
         double finalResidualMAD;
       } ddObs;
 
+      struct
+      {
+        unsigned iterations; // performed by the solver
+        bool converged;      // stopped by the convergence criteria
+      } solver;
+
     } relocInfo;
 
     // search by value when the Id is not known (works between multiple catalogs
@@ -19,7 +19,10 @@
 #include "ellipsoid.ipp"
 #include "utils.h"
 
+#include <algorithm>
+#include <cmath>
 #include <seiscomp3/core/strings.h>
+#include <seiscomp3/math/geo.h>
 
 #define SEISCOMP_COMPONENT RTDD
 #include <seiscomp3/logging/log.h>
@@ -31,9 +34,111 @@ using Event   = HDD::Catalog::Event;
 using Phase   = HDD::Catalog::Phase;
 using Station = HDD::Catalog::Station;
 
+namespace {
+
+// longitude in [0, 360)
+double normalizeLon(double lon)
+{
+  double normLon = std::fmod(lon + 180, 360.);
+  return normLon < 0 ? normLon + 360 : normLon;
+}
+
+} // namespace
+
 namespace Seiscomp {
 namespace HDD {
 
+EventSpatialIndex::EventSpatialIndex(const CatalogCPtr &catalog,
+                                     double cellSize)
+    : _catalog(catalog.get())
+{
+  if (cellSize <= 0)
+    throw runtime_error("EventSpatialIndex: cell size must be positive");
+
+  _latCellDeg  = Math::Geo::km2deg(cellSize);
+  _numLatCells = std::ceil(180. / _latCellDeg);
+  _numLonCells = std::ceil(360. / _latCellDeg);
+  _lonCellDeg  = 360. / _numLonCells;
+  _depthCellKm = cellSize;
+
+  for (const auto &kv : catalog->getEvents())
+  {
+    const Event &event = kv.second;
+
+    long latCell   = std::floor((event.latitude + 90) / _latCellDeg);
+    long lonCell   = std::floor(normalizeLon(event.longitude) / _lonCellDeg);
+    long depthCell = std::floor(event.depth / _depthCellKm);
+    latCell        = std::min(std::max(latCell, 0L), _numLatCells - 1);
+    lonCell        = std::min(lonCell, _numLonCells - 1);
+    _cells[cellKey(latCell, lonCell, depthCell)].push_back(event.id);
+  }
+}
+
+uint64_t EventSpatialIndex::cellKey(long latCell, long lonCell, long depthCell)
+{
+  // 21 bits for latitude, 22 for longitude and 21 for depth (signed)
+  return (static_cast<uint64_t>(latCell) << 43) |
+         (static_cast<uint64_t>(lonCell) << 21) |
+         (static_cast<uint64_t>(depthCell + (1L << 20)) & ((1UL << 21) - 1));
+}
+
+std::vector<unsigned>
+EventSpatialIndex::candidates(double lat,
+                              double lon,
+                              double depth,
+                              double horizontalDistance,
+                              double verticalDistance) const
+{
+  // Bounding box in degrees. The geodesic distances are computed on the
+  // ellipsoid, where a degree of latitude can be shorter than km2deg
+  // assumes, hence the margin
+  const double dLat      = Math::Geo::km2deg(horizontalDistance) * 1.05;
+  const double maxAbsLat = std::abs(lat) + dLat;
+
+  long latStart = std::floor((lat - dLat + 90) / _latCellDeg);
+  long latEnd   = std::floor((lat + dLat + 90) / _latCellDeg);
+  latStart      = std::max(latStart, 0L);
+  latEnd        = std::min(latEnd, _numLatCells - 1);
+
+  long lonStart = 0, lonEnd = _numLonCells - 1; // close to the poles
+  if (maxAbsLat < 89)
+  {
+    const double dLon = dLat / std::cos(deg2rad(maxAbsLat));
+    const double x    = normalizeLon(lon);
+    lonStart          = std::floor((x - dLon) / _lonCellDeg);
+    lonEnd            = std::floor((x + dLon) / _lonCellDeg);
+    if (lonEnd - lonStart + 1 >= _numLonCells)
+    {
+      lonStart = 0;
+      lonEnd   = _numLonCells - 1;
+    }
+  }
+
+  const long depthStart = std::floor((depth - verticalDistance) / _depthCellKm);
+  const long depthEnd   = std::floor((depth + verticalDistance) / _depthCellKm);
+
+  std::vector<unsigned> eventIds;
+  for (long latCell = latStart; latCell <= latEnd; latCell++)
+  {
+    for (long lonIdx = lonStart; lonIdx <= lonEnd; lonIdx++)
+    {
+      // wrap around the antimeridian
+      const long lonCell =
+          ((lonIdx % _numLonCells) + _numLonCells) % _numLonCells;
+      for (long depthCell = depthStart; depthCell <= depthEnd; depthCell++)
+      {
+        const auto it = _cells.find(cellKey(latCell, lonCell, depthCell));
+        if (it != _cells.end())
+        {
+          eventIds.insert(eventIds.end(), it->second.begin(),
+                          it->second.end());
+        }
+      }
+    }
+  }
+  return eventIds;
+}
+
 NeighboursPtr selectNeighbouringEvents(const CatalogCPtr &catalog,
                                        const Event &refEv,
                                        const CatalogCPtr &refEvCatalog,
@@ -47,7 +152,8 @@ NeighboursPtr selectNeighbouringEvents(const CatalogCPtr &catalog,
                                        unsigned maxNumNeigh,
                                        unsigned numEllipsoids,
                                        double maxEllipsoidSize,
-                                       bool keepUnmatched)
+                                       bool keepUnmatched,
+                                       const EventSpatialIndex *index)
 {
   SEISCOMP_INFO(
       "Selecting Neighbouring Events for event %s lat %.6f lon %.6f depth %.4f",
@@ -87,17 +193,14 @@ NeighboursPtr selectNeighbouringEvents(const CatalogCPtr &catalog,
   unordered_map<unsigned, double> distanceByEvent; // eventid, distance
   unordered_map<unsigned, double> azimuthByEvent;  // eventid, azimuth
 
-  for (const auto &kv : catalog->getEvents())
-  {
-    const Event &event = kv.second;
+  const Ellipsoid &outmostEllip = ellipsoids[0]->getOuterEllipsoid();
 
-    if (event == refEv) continue;
+  auto considerEvent = [&](const Event &event) {
+    if (event == refEv) return;
 
     // drop event if outside the outmost ellipsod boundaries
-    HddEllipsoidPtr outmostEllip = ellipsoids[0];
-    if (!outmostEllip->getOuterEllipsoid().isInside(
-            event.latitude, event.longitude, event.depth))
-      continue;
+    if (!outmostEllip.isInside(event.latitude, event.longitude, event.depth))
+      return;
 
     // compute distance between current event and reference origin
     double azimuth;
@@ -106,6 +209,23 @@ NeighboursPtr selectNeighbouringEvents(const CatalogCPtr &catalog,
     // keep a list of added events
     distanceByEvent[event.id] = distance;
     azimuthByEvent[event.id]  = azimuth;
+  };
+
+  if (index && index->isIndexOf(catalog))
+  {
+    // check only the events in the outmost ellipsoid bounding box
+    for (unsigned evId : index->candidates(
+             refEv.latitude, refEv.longitude, refEv.depth,
+             std::max(outmostEllip.axis_a, outmostEllip.axis_b),
+             outmostEllip.axis_c))
+    {
+      const auto &it = catalog->getEvents().find(evId);
+      if (it != catalog->getEvents().end()) considerEvent(it->second);
+    }
+  }
+  else
+  {
+    for (const auto &kv : catalog->getEvents()) considerEvent(kv.second);
   }
 
   //
@@ -380,6 +500,8 @@ selectNeighbouringEventsCatalog(const CatalogCPtr &catalog,
 
   // for each event find the neighbours
   CatalogPtr validCatalog = new Catalog(*catalog);
+  // events are only removed from validCatalog, so it can be indexed once
+  EventSpatialIndex index(validCatalog);
   list<unsigned> todoEvents;
   for (const auto &kv : validCatalog->getEvents())
     todoEvents.push_back(kv.first);
@@ -400,7 +522,8 @@ selectNeighbouringEventsCatalog(const CatalogCPtr &catalog,
         neighbours = selectNeighbouringEvents(
             validCatalog, event, validCatalog, minPhaseWeight, minESdist,
             maxESdist, minEStoIEratio, minDTperEvt, maxDTperEvt, minNumNeigh,
-            maxNumNeigh, numEllipsoids, maxEllipsoidSize, keepUnmatched);
+            maxNumNeigh, numEllipsoids, maxEllipsoidSize, keepUnmatched,
+            &index);
       }
       catch (...)
       {}
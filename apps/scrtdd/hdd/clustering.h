@@ -19,12 +19,14 @@
 #define __HDD_CLUSTERING_H__
 
 #include "catalog.h"
+#include <cstdint>
 #include <deque>
 #include <list>
 #include <seiscomp3/core/baseobject.h>
 #include <set>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 namespace Seiscomp {
 namespace HDD {
@@ -97,21 +99,62 @@ struct Neighbours : public Core::BaseObject
   }
 };
 
+DEFINE_SMARTPOINTER(EventSpatialIndex);
+
+/*
+ * Uniform grid of the catalog events over latitude, longitude and depth, so
+ * that the events around a point can be found without scanning the whole
+ * catalog. The index refers to the catalog it was built from: events removed
+ * from that catalog afterwards are skipped by the caller, events added
+ * afterwards are not indexed.
+ */
+class EventSpatialIndex : public Core::BaseObject
+{
+public:
+  EventSpatialIndex(const CatalogCPtr &catalog, double cellSize = 5); // km
+
+  bool isIndexOf(const CatalogCPtr &catalog) const
+  {
+    return catalog.get() == _catalog;
+  }
+
+  // Ids of the events that might be within horizontalDistance and
+  // verticalDistance (km) of the given point: a superset, that contains at
+  // least all the events within those distances
+  std::vector<unsigned> candidates(double lat,
+                                   double lon,
+                                   double depth,
+                                   double horizontalDistance,
+                                   double verticalDistance) const;
+
+private:
+  static uint64_t cellKey(long latCell, long lonCell, long depthCell);
+
+  const Catalog *_catalog;
+  double _latCellDeg;  // latitude cell size (degrees)
+  double _lonCellDeg;  // longitude cell size (degrees), 360 is a multiple
+  double _depthCellKm; // depth cell size (km)
+  long _numLatCells;
+  long _numLonCells;
+  std::unordered_map<uint64_t, std::vector<unsigned>> _cells;
+};
+
 NeighboursPtr
 selectNeighbouringEvents(const CatalogCPtr &catalog,
                          const Catalog::Event &refEv,
                          const CatalogCPtr &refEvCatalog,
-                         double minPhaseWeight   = 0,
-                         double minESdis         = 0,
-                         double maxESdis         = -1,
-                         double minEStoIEratio   = 0,
-                         unsigned minDTperEvt    = 1,
-                         unsigned maxDTperEvt    = 0, // 0 = no limits
-                         unsigned minNumNeigh    = 1,
-                         unsigned maxNumNeigh    = 0, // 0 = no limits
-                         unsigned numEllipsoids  = 5,
-                         double maxEllipsoidSize = 10,
-                         bool keepUnmatched      = false);
+                         double minPhaseWeight          = 0,
+                         double minESdis                = 0,
+                         double maxESdis                = -1,
+                         double minEStoIEratio          = 0,
+                         unsigned minDTperEvt           = 1,
+                         unsigned maxDTperEvt           = 0, // 0 = no limits
+                         unsigned minNumNeigh           = 1,
+                         unsigned maxNumNeigh           = 0, // 0 = no limits
+                         unsigned numEllipsoids         = 5,
+                         double maxEllipsoidSize        = 10,
+                         bool keepUnmatched             = false,
+                         const EventSpatialIndex *index = nullptr);
 
 std::deque<std::list<NeighboursPtr>>
 selectNeighbouringEventsCatalog(const CatalogCPtr &catalog,
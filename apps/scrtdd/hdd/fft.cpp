@@ -0,0 +1,172 @@
+/***************************************************************************
+ *   Copyright (C) by ETHZ/SED                                             *
+ *                                                                         *
+ * This program is free software: you can redistribute it and/or modify    *
+ * it under the terms of the GNU Affero General Public License as published*
+ * by the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                     *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ * GNU Affero General Public License for more details.                     *
+ *                                                                         *
+ *                                                                         *
+ *   Developed by Luca Scarabello <luca.scarabello@sed.ethz.ch>            *
+ ***************************************************************************/
+
+#include "fft.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+namespace Seiscomp {
+namespace HDD {
+namespace FFT {
+
+void transform(std::vector<Complex> &data, bool inverse)
+{
+  const unsigned N = data.size();
+  if (N <= 1) return;
+  if ((N & (N - 1)) != 0) throw runtime_error("FFT size must be a power of 2");
+
+  // bit reversal permutation
+  for (unsigned i = 1, j = 0; i < N; i++)
+  {
+    unsigned bit = N >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) std::swap(data[i], data[j]);
+  }
+
+  // twiddle factors are computed once per transform and not accumulated
+  // stage by stage, which keeps the rounding errors at the level of a
+  // single sin/cos evaluation
+  const double sign = inverse ? 1. : -1.;
+  vector<Complex> twiddles(N / 2);
+  for (unsigned k = 0; k < N / 2; k++)
+  {
+    const double angle = sign * 2 * M_PI * k / N;
+    twiddles[k]        = Complex(std::cos(angle), std::sin(angle));
+  }
+
+  for (unsigned len = 2; len <= N; len <<= 1)
+  {
+    const unsigned half   = len >> 1;
+    const unsigned stride = N / len;
+    for (unsigned i = 0; i < N; i += len)
+    {
+      for (unsigned k = 0; k < half; k++)
+      {
+        const Complex u = data[i + k];
+        const Complex v = data[i + k + half] * twiddles[k * stride];
+        data[i + k]        = u + v;
+        data[i + k + half] = u - v;
+      }
+    }
+  }
+
+  if (inverse)
+  {
+    for (Complex &c : data) c /= N;
+  }
+}
+
+void xcorr(const double *a,
+           unsigned aSize,
+           const double *b,
+           unsigned bSize,
+           double *out,
+           unsigned outSize,
+           unsigned fftSize)
+{
+  const unsigned N = nextPowerOf2(std::max({aSize, bSize, outSize, fftSize}));
+
+  // pack the two real sequences in a single complex one: z = a + i*b
+  vector<Complex> z(N, Complex(0, 0));
+  for (unsigned i = 0; i < aSize; i++) z[i].real(a[i]);
+  for (unsigned i = 0; i < bSize; i++) z[i].imag(b[i]);
+
+  transform(z, false);
+
+  // unpack the two spectra (A and B) and compute conj(A)*B, which is the
+  // spectrum of the cross-correlation sum_i a[i]*b[i+t]
+  vector<Complex> spectrum(N);
+  for (unsigned k = 0; k < N; k++)
+  {
+    const Complex zk  = z[k];
+    const Complex znk = std::conj(z[(N - k) % N]);
+    const Complex A   = (zk + znk) * 0.5;
+    const Complex B   = (zk - znk) * Complex(0, -0.5);
+    spectrum[k]       = std::conj(A) * B;
+  }
+
+  transform(spectrum, true);
+
+  for (unsigned t = 0; t < outSize; t++) out[t] = spectrum[t].real();
+}
+
+Correlator::Correlator(const double *fixed,
+                       unsigned fixedSize,
+                       unsigned fftSize,
+                       bool fixedFirst)
+    : _spectrum(nextPowerOf2(std::max(fixedSize, fftSize)), Complex(0, 0)),
+      _fixedFirst(fixedFirst)
+{
+  for (unsigned i = 0; i < fixedSize; i++) _spectrum[i].real(fixed[i]);
+  transform(_spectrum, false);
+}
+
+void Correlator::xcorr(const double *other1,
+                       unsigned other1Size,
+                       double *out1,
+                       const double *other2,
+                       unsigned other2Size,
+                       double *out2,
+                       unsigned outSize) const
+{
+  const unsigned N = _spectrum.size();
+  if (other1Size > N || (other2 && other2Size > N) || outSize > N)
+    throw runtime_error("Correlator: sequence longer than the FFT size");
+
+  // pack the two real sequences in a single complex one: z = o1 + i*o2
+  vector<Complex> z(N, Complex(0, 0));
+  for (unsigned i = 0; i < other1Size; i++) z[i].real(other1[i]);
+  if (other2)
+    for (unsigned i = 0; i < other2Size; i++) z[i].imag(other2[i]);
+
+  transform(z, false);
+
+  // unpack the two spectra and multiply them by the fixed one. Both products
+  // are spectra of real sequences, so they can be packed again (P1 + i*P2)
+  // and the two correlation series are the real and imaginary parts of the
+  // inverse transform
+  vector<Complex> spectrum(N);
+  for (unsigned k = 0; k < N; k++)
+  {
+    const Complex zk  = z[k];
+    const Complex znk = std::conj(z[(N - k) % N]);
+    const Complex X1  = (zk + znk) * 0.5;
+    const Complex X2  = (zk - znk) * Complex(0, -0.5);
+    const Complex F   = _spectrum[k];
+    const Complex P1  = _fixedFirst ? std::conj(F) * X1 : std::conj(X1) * F;
+    const Complex P2  = _fixedFirst ? std::conj(F) * X2 : std::conj(X2) * F;
+    spectrum[k]       = P1 + Complex(0, 1) * P2;
+  }
+
+  transform(spectrum, true);
+
+  for (unsigned t = 0; t < outSize; t++)
+  {
+    out1[t] = spectrum[t].real();
+    if (other2) out2[t] = spectrum[t].imag();
+  }
+}
+
+} // namespace FFT
+} // namespace HDD
+} // namespace Seiscomp
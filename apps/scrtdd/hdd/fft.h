@@ -0,0 +1,93 @@
+/***************************************************************************
+ *   Copyright (C) by ETHZ/SED                                             *
+ *                                                                         *
+ * This program is free software: you can redistribute it and/or modify    *
+ * it under the terms of the GNU Affero General Public License as published*
+ * by the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                     *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ * GNU Affero General Public License for more details.                     *
+ *                                                                         *
+ *                                                                         *
+ *   Developed by Luca Scarabello <luca.scarabello@sed.ethz.ch>            *
+ ***************************************************************************/
+
+#ifndef __HDD_FFT_H__
+#define __HDD_FFT_H__
+
+#include <complex>
+#include <vector>
+
+namespace Seiscomp {
+namespace HDD {
+namespace FFT {
+
+typedef std::complex<double> Complex;
+
+/*
+ * In-place iterative radix-2 Cooley-Tukey transform. data.size() must be
+ * a power of 2. The inverse transform is scaled by 1/N
+ */
+void transform(std::vector<Complex> &data, bool inverse);
+
+/*
+ * Circular cross-correlation of two real sequences via a single complex FFT
+ * (the two sequences are packed in the real and imaginary parts):
+ *
+ *   out[t] = sum_i a[i] * b[(i+t) % N]    for t in [0, outSize)
+ *
+ * a and b are zero padded to N = nextPowerOf2(max(aSize,bSize)) unless a
+ * bigger fftSize is given. To obtain a linear (non-circular) correlation for
+ * all the requested lags the caller has to make sure that
+ * aSize - 1 + outSize - 1 < N
+ */
+void xcorr(const double *a,
+           unsigned aSize,
+           const double *b,
+           unsigned bSize,
+           double *out,
+           unsigned outSize,
+           unsigned fftSize = 0);
+
+/*
+ * Cross-correlation of a fixed real sequence against many others. The
+ * spectrum of the fixed sequence is computed only once, the other sequences
+ * are transformed two at a time (packed in the real and imaginary parts of a
+ * complex sequence) and their two correlation series are recovered from a
+ * single inverse transform
+ *
+ *   fixedFirst == true:   out[t] = sum_i fixed[i] * other[(i+t) % N]
+ *   fixedFirst == false:  out[t] = sum_i other[i] * fixed[(i+t) % N]
+ */
+class Correlator
+{
+public:
+  Correlator(const double *fixed,
+             unsigned fixedSize,
+             unsigned fftSize,
+             bool fixedFirst);
+
+  unsigned fftSize() const { return _spectrum.size(); }
+
+  // other2 can be nullptr, in which case only out1 is computed
+  void xcorr(const double *other1,
+             unsigned other1Size,
+             double *out1,
+             const double *other2,
+             unsigned other2Size,
+             double *out2,
+             unsigned outSize) const;
+
+private:
+  std::vector<Complex> _spectrum;
+  bool _fixedFirst;
+};
+
+} // namespace FFT
+} // namespace HDD
+} // namespace Seiscomp
+
+#endif
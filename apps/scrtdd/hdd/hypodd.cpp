@@ -18,9 +18,11 @@
 #include "hypodd.h"
 #include "utils.h"
 
+#include <algorithm>
 #include <boost/filesystem.hpp>
 #include <boost/range/iterator_range_core.hpp>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -30,6 +32,7 @@
 #include <seiscomp3/core/typedarray.h>
 #include <seiscomp3/io/recordinput.h>
 #include <seiscomp3/utils/files.h>
+#include <set>
 #include <stdexcept>
 
 #define SEISCOMP_COMPONENT RTDD
@@ -73,6 +76,13 @@ HypoDD::HypoDD(const CatalogCPtr &catalog,
     }
   }
 
+  if (Waveform::hasTraceFiles(_cacheDir))
+  {
+    SEISCOMP_WARNING("%s contains waveforms in the old cache format, which "
+                     "are ignored: convert them with --import-wf-cache %s",
+                     _cacheDir.c_str(), _cacheDir.c_str());
+  }
+
   _tmpCacheDir = (boost::filesystem::path(_workingDir) / "tmpcache").string();
   if (!Util::pathExists(_tmpCacheDir))
   {
@@ -84,12 +94,46 @@ HypoDD::HypoDD(const CatalogCPtr &catalog,
   }
 
   _wfDebugDir = (boost::filesystem::path(_workingDir) / "wfdebug").string();
+  _tttGridDir = (boost::filesystem::path(_workingDir) / "tttgrids").string();
 
   setUseCatalogWaveformDiskCache(true);
   setWaveformCacheAll(false);
   setWaveformDebug(false);
 
-  _ttt = new TravelTimeTable(_cfg.ttt.type, _cfg.ttt.model);
+  TravelTimeTable::GridSpec tttGridSpec;
+  if (_cfg.ttt.useGrids)
+  {
+    tttGridSpec.depthStep    = _cfg.ttt.gridDepthStep;
+    tttGridSpec.maxDepth     = _cfg.ttt.gridMaxDepth;
+    tttGridSpec.distanceStep = _cfg.ttt.gridDistanceStep;
+    tttGridSpec.maxDistance  = _cfg.ttt.gridMaxDistance;
+  }
+  _ttt = new TravelTimeTable(_cfg.ttt.type, _cfg.ttt.model, tttGridSpec,
+                             _tttGridDir);
+
+  _threadPool.reset(new ThreadPool(_cfg.workerThreads));
+
+  // The travel time grids are built on first use. Optionally, prepare the
+  // grids of the catalog stations/phases now, so that they are not computed
+  // while relocating
+  if (_ttt->gridsEnabled() && _cfg.ttt.precomputeGrids)
+  {
+    set<pair<string, char>> stationPhaseSet;
+    for (const auto &kv : _bgCat->getPhases())
+    {
+      const Phase &phase = kv.second;
+      stationPhaseSet.emplace(phase.stationId,
+                              static_cast<char>(phase.procInfo.type));
+    }
+    const vector<pair<string, char>> stationPhases(stationPhaseSet.begin(),
+                                                   stationPhaseSet.end());
+    _threadPool->parallelFor(stationPhases.size(), [&](size_t i) {
+      const Station &station = _bgCat->getStations().at(stationPhases[i].first);
+      _ttt->precomputeGrid(station, string(1, stationPhases[i].second));
+    });
+    SEISCOMP_INFO("Travel time grids ready for %lu station phases",
+                  stationPhases.size());
+  }
 }
 
 HypoDD::~HypoDD()
@@ -104,6 +148,7 @@ HypoDD::~HypoDD()
     {
       if (!boost::filesystem::equivalent(entry, _cacheDir) &&
           !boost::filesystem::equivalent(entry, _tmpCacheDir) &&
+          !boost::filesystem::equivalent(entry, _tttGridDir) &&
           !boost::filesystem::equivalent(entry, _wfDebugDir))
       {
         SEISCOMP_INFO("Deleting %s", entry.path().string().c_str());
@@ -123,6 +168,7 @@ void HypoDD::setCatalog(const CatalogCPtr &catalog)
   _srcCat = catalog;
   _bgCat  = Catalog::filterPhasesAndSetWeights(
       _srcCat, Phase::Source::CATALOG, _cfg.validPphases, _cfg.validSphases);
+  _bgCatIndex = new EventSpatialIndex(_bgCat);
 }
 
 void HypoDD::setUseCatalogWaveformDiskCache(bool cache)
@@ -133,14 +179,33 @@ void HypoDD::setUseCatalogWaveformDiskCache(bool cache)
 
 void HypoDD::createWaveformCache()
 {
-  _wfDiskCache = nullptr;
-  _wfSnrFilter = nullptr;
-  _wfMemCache  = nullptr;
+  _wfDiskCache  = nullptr;
+  _wfSnrFilter  = nullptr;
+  _wfMemCache   = nullptr;
+  _xcorrArchive = nullptr;
 
   if (_useCatalogWaveformDiskCache)
   {
     _wfDiskCache = new Waveform::DiskCachedLoader(
         _cfg.ddObservations2.recordStreamURL, false, _cacheDir);
+    if (_cfg.wfCache.storeProcessed)
+    {
+      _wfDiskCache->enableProcessedCache(
+          (boost::filesystem::path(_cacheDir) / "processed").string());
+    }
+    if (_cfg.wfCache.unavailableTTL > 0)
+    {
+      _wfDiskCache->enableUnavailableCache(
+          (boost::filesystem::path(_cacheDir) / "unavailable").string(),
+          _cfg.wfCache.unavailableTTL);
+    }
+    if (_cfg.wfCache.storeCatalogXCorr)
+    {
+      _xcorrArchive = PackedArchive::open(
+          (boost::filesystem::path(_cacheDir) / "xcorr").string());
+      SEISCOMP_INFO("Catalog cross-correlation store: %zu results",
+                    _xcorrArchive->size());
+    }
     Waveform::ExtraLenLoaderPtr extLen =
         new Waveform::ExtraLenLoader(_wfDiskCache, DISK_TRACE_MIN_LEN);
 
@@ -149,11 +214,13 @@ void HypoDD::createWaveformCache()
       _wfSnrFilter = new Waveform::SnrFilteredLoader(
           extLen, _cfg.snr.minSnr, _cfg.snr.noiseStart, _cfg.snr.noiseEnd,
           _cfg.snr.signalStart, _cfg.snr.signalEnd);
-      _wfMemCache = new Waveform::MemCachedLoader(_wfSnrFilter, true);
+      _wfMemCache = new Waveform::MemCachedLoader(
+          _wfSnrFilter, true, _cfg.wfCache.memoryBudget);
     }
     else
     {
-      _wfMemCache = new Waveform::MemCachedLoader(extLen, true);
+      _wfMemCache = new Waveform::MemCachedLoader(
+          extLen, true, _cfg.wfCache.memoryBudget);
     }
   }
   else
@@ -164,12 +231,14 @@ void HypoDD::createWaveformCache()
           _cfg.ddObservations2.recordStreamURL, _cfg.snr.minSnr,
           _cfg.snr.noiseStart, _cfg.snr.noiseEnd, _cfg.snr.signalStart,
           _cfg.snr.signalEnd);
-      _wfMemCache = new Waveform::MemCachedLoader(_wfSnrFilter, true);
+      _wfMemCache = new Waveform::MemCachedLoader(
+          _wfSnrFilter, true, _cfg.wfCache.memoryBudget);
     }
     else
     {
       _wfMemCache = new Waveform::MemCachedLoader(
-          _cfg.ddObservations2.recordStreamURL, true);
+          _cfg.ddObservations2.recordStreamURL, true,
+          _cfg.wfCache.memoryBudget);
     }
   }
 }
@@ -221,6 +290,7 @@ void HypoDD::preloadData()
   //
   // Preload waveforms on disk and cache them in memory (pre-processed)
   //
+  vector<std::pair<const Event *, Phase>> componentPhases;
   for (const auto &kv : _bgCat->getEvents())
   {
     const Event &event = kv.second;
@@ -228,7 +298,6 @@ void HypoDD::preloadData()
     for (auto it = eqlrng.first; it != eqlrng.second; ++it)
     {
       const Phase &phase  = it->second;
-      Core::TimeWindow tw = xcorrTimeWindowLong(phase);
       const auto xcorrCfg = _cfg.xcorr.at(phase.procInfo.type);
 
       for (string component : xcorrCfg.components)
@@ -236,7 +305,7 @@ void HypoDD::preloadData()
         Phase tmpPh = phase;
         tmpPh.channelCode =
             getBandAndInstrumentCodes(tmpPh.channelCode) + component;
-        getWaveform(tw, event, tmpPh, _wfMemCache);
+        componentPhases.emplace_back(&event, tmpPh);
       }
 
       numPhases++;
@@ -244,6 +313,73 @@ void HypoDD::preloadData()
     }
   }
 
+  // Request the waveforms of the same station together, so that the record
+  // stream sessions access as few stations as possible
+  std::sort(componentPhases.begin(), componentPhases.end(),
+            [](const std::pair<const Event *, Phase> &a,
+               const std::pair<const Event *, Phase> &b) {
+              if (a.second.stationId != b.second.stationId)
+                return a.second.stationId < b.second.stationId;
+              return a.second.time < b.second.time;
+            });
+
+  //
+  // Load the batches concurrently, with at most wfPrefetchRequests batches in
+  // flight: the waveforms of a batch are processed (filtered, SNR checked)
+  // while the other batches are still downloading
+  //
+  const size_t numWfs = componentPhases.size();
+  const size_t numBatches =
+      (numWfs + PRELOAD_BATCH_SIZE - 1) / PRELOAD_BATCH_SIZE;
+  ThreadPool prefetchPool(std::max(1u, _cfg.wfPrefetchRequests));
+
+  std::mutex progressMutex;
+  size_t doneWfs = 0, availableWfs = 0;
+  double loadedBytes         = 0;
+  const Core::Time startTime = Core::Time::GMT();
+  Core::Time lastReport      = startTime;
+
+  prefetchPool.parallelFor(numBatches, [&](size_t batch) {
+    const size_t start = batch * PRELOAD_BATCH_SIZE;
+    const size_t end   = std::min<size_t>(start + PRELOAD_BATCH_SIZE, numWfs);
+    vector<Waveform::Loader::Request> requests;
+    for (size_t i = start; i < end; i++)
+    {
+      const Phase &phase = componentPhases[i].second;
+      requests.push_back(
+          {xcorrTimeWindowLong(phase), &phase, componentPhases[i].first});
+    }
+
+    const vector<GenericRecordCPtr> traces =
+        getWaveforms(requests, _wfMemCache);
+
+    size_t batchAvailable = 0;
+    double batchBytes     = 0;
+    for (const GenericRecordCPtr &trace : traces)
+    {
+      if (!trace) continue;
+      batchAvailable++;
+      batchBytes += trace->data()->size() * trace->data()->bytes();
+    }
+
+    std::lock_guard<std::mutex> lock(progressMutex);
+    doneWfs += requests.size();
+    availableWfs += batchAvailable;
+    loadedBytes += batchBytes;
+
+    const Core::Time now = Core::Time::GMT();
+    if ((now - lastReport).length() >= PRELOAD_PROGRESS_INTERVAL ||
+        doneWfs == numWfs)
+    {
+      lastReport           = now;
+      const double elapsed = std::max((now - startTime).length(), 1e-3);
+      SEISCOMP_INFO("Preloading catalog waveforms: %zu/%zu (%.f%%) done, "
+                    "%zu available, %.1f waveforms/sec, %.2f MB/sec",
+                    doneWfs, numWfs, doneWfs * 100. / numWfs, availableWfs,
+                    doneWfs / elapsed, loadedBytes / 1048576. / elapsed);
+    }
+  });
+
   updateCounters();
   SEISCOMP_INFO(
       "Finished preloading catalog waveform data: total phases %u (P %.f%%, S "
@@ -251,10 +387,11 @@ void HypoDD::preloadData()
       "phases data not available %u (%.f%%), "
       "(waveforms downloaded %u, waveforms loaded from disk cache %u)",
       numPhases, ((numPhases - numSPhases) * 100. / numPhases),
-      (numSPhases * 100. / numPhases), _counters.wf_snr_low,
-      (_counters.wf_snr_low * 100. / numPhases), _counters.wf_no_avail,
-      (_counters.wf_no_avail * 100. / numPhases), _counters.wf_downloaded,
-      _counters.wf_disk_cached);
+      (numSPhases * 100. / numPhases), _counters.wf_snr_low.load(),
+      (_counters.wf_snr_low * 100. / numPhases), _counters.wf_no_avail.load(),
+      (_counters.wf_no_avail * 100. / numPhases),
+      _counters.wf_downloaded.load(), _counters.wf_disk_cached.load());
+  printMemCacheCounters();
 }
 
 CatalogPtr HypoDD::relocateCatalog()
@@ -314,14 +451,40 @@ CatalogPtr HypoDD::relocateCatalog()
   }
 
   //
-  // Relocate one cluster a time
+  // Relocate the clusters in parallel: they don't share any reference event,
+  // so each of them works on its own copy of the events it needs, built when
+  // the cluster starts. The largest clusters are scheduled first to balance
+  // the load. The relocated clusters are merged in cluster order, so the
+  // output ordering doesn't depend on the number of threads. Note that the
+  // theoretical phases detected by buildXCorrCache are added to the cluster
+  // copy only, so a cluster never sees the ones detected by other clusters
   //
-  CatalogPtr relocatedCatalog(new Catalog());
+  vector<size_t> schedule(clusters.size());
+  for (size_t i = 0; i < schedule.size(); i++) schedule[i] = i;
+  std::stable_sort(schedule.begin(), schedule.end(),
+                   [&clusters](size_t a, size_t b) {
+                     return clusters[a].size() > clusters[b].size();
+                   });
 
-  for (unsigned clusterId = 0; clusterId < clusters.size(); clusterId++)
-  {
+  vector<CatalogPtr> relocatedClusters(clusters.size());
+
+  resetCounters();
+
+  _threadPool->parallelFor(schedule.size(), [&](size_t scheduleIdx) {
+    const unsigned clusterId                = schedule[scheduleIdx];
     const list<NeighboursPtr> &neighCluster = clusters[clusterId];
 
+    // copy of the cluster events, since buildXCorrCache updates the catalog
+    set<unsigned> clusterEvIds;
+    for (const NeighboursPtr &n : neighCluster)
+    {
+      clusterEvIds.insert(n->refEvId);
+      clusterEvIds.insert(n->ids.begin(), n->ids.end());
+    }
+    CatalogPtr clusterCat(new Catalog());
+    for (unsigned evId : clusterEvIds)
+      clusterCat->add(evId, *catToReloc, true);
+
     SEISCOMP_INFO("Relocating cluster %u (%lu events)", clusterId + 1,
                   neighCluster.size());
 
@@ -329,7 +492,7 @@ CatalogPtr HypoDD::relocateCatalog()
     {
       CatalogPtr catToDump(new Catalog());
       for (const NeighboursPtr &n : neighCluster)
-        catToDump->add(n->refEvId, *catToReloc, true);
+        catToDump->add(n->refEvId, *clusterCat, true);
       string prefix = "cluster-" + to_string(clusterId + 1);
       catToDump->writeToFile(
           (boost::filesystem::path(catalogWorkingDir) / (prefix + "-event.csv"))
@@ -344,13 +507,11 @@ CatalogPtr HypoDD::relocateCatalog()
     // Perform cross correlation, which also detects picks around theoretical
     // arrival times. The catalog will be updated with those theoretical phases
     const XCorrCache xcorr =
-        buildXCorrCache(catToReloc, neighCluster, _useArtificialPhases);
+        buildXCorrCache(clusterCat, neighCluster, _useArtificialPhases);
 
     // The actual relocation
     CatalogPtr relocatedCluster =
-        relocate(catToReloc, neighCluster, false, xcorr);
-
-    relocatedCatalog->add(*relocatedCluster, true);
+        relocate(clusterCat, neighCluster, false, xcorr);
 
     if (!_workingDirCleanup)
     {
@@ -364,7 +525,15 @@ CatalogPtr HypoDD::relocateCatalog()
            (prefix + "-station.csv"))
               .string());
     }
-  }
+
+    relocatedClusters[clusterId] = relocatedCluster;
+  });
+
+  printCounters();
+
+  CatalogPtr relocatedCatalog(new Catalog());
+  for (const CatalogPtr &relocatedCluster : relocatedClusters)
+    relocatedCatalog->add(*relocatedCluster, true);
 
   // write catalog for debugging purpose
   if (!_workingDirCleanup)
@@ -385,7 +554,8 @@ CatalogPtr HypoDD::relocateCatalog()
 
 CatalogPtr HypoDD::relocateSingleEvent(const CatalogCPtr &singleEvent)
 {
-  const CatalogCPtr bgCat = _bgCat;
+  const CatalogCPtr bgCat                = _bgCat;
+  const EventSpatialIndexCPtr bgCatIndex = _bgCatIndex;
 
   // there must be only one event in the catalog, the origin to relocate
   const Event &evToRelocate = singleEvent->getEvents().begin()->second;
@@ -441,7 +611,7 @@ CatalogPtr HypoDD::relocateSingleEvent(const CatalogCPtr &singleEvent)
                                          _cfg.validPphases, _cfg.validSphases);
 
   CatalogPtr relocatedEvCat = relocateEventSingleStep(
-      bgCat, evToRelocateCat, eventWorkingDir, false, false,
+      bgCat, bgCatIndex.get(), evToRelocateCat, eventWorkingDir, false, false,
       _cfg.ddObservations1.minWeight, _cfg.ddObservations1.minESdist,
       _cfg.ddObservations1.maxESdist, _cfg.ddObservations1.minEStoIEratio,
       _cfg.ddObservations1.minDTperEvt, _cfg.ddObservations1.maxDTperEvt,
@@ -473,7 +643,8 @@ CatalogPtr HypoDD::relocateSingleEvent(const CatalogCPtr &singleEvent)
   eventWorkingDir = (boost::filesystem::path(subFolder) / "step2").string();
 
   CatalogPtr relocatedEvWithXcorr = relocateEventSingleStep(
-      bgCat, evToRelocateCat, eventWorkingDir, true, _useArtificialPhases,
+      bgCat, bgCatIndex.get(), evToRelocateCat, eventWorkingDir, true,
+      _useArtificialPhases,
       _cfg.ddObservations2.minWeight, _cfg.ddObservations2.minESdist,
       _cfg.ddObservations2.maxESdist, _cfg.ddObservations2.minEStoIEratio,
       _cfg.ddObservations2.minDTperEvt, _cfg.ddObservations2.maxDTperEvt,
@@ -523,6 +694,7 @@ CatalogPtr HypoDD::relocateSingleEvent(const CatalogCPtr &singleEvent)
 }
 
 CatalogPtr HypoDD::relocateEventSingleStep(const CatalogCPtr bgCat,
+                                           const EventSpatialIndex *bgCatIndex,
                                            const CatalogCPtr &evToRelocateCat,
                                            const string &workingDir,
                                            bool doXcorr,
@@ -569,7 +741,8 @@ CatalogPtr HypoDD::relocateEventSingleStep(const CatalogCPtr bgCat,
     NeighboursPtr neighbours = selectNeighbouringEvents(
         bgCat, evToRelocate, evToRelocateCat, minPhaseWeight, minESdist,
         maxESdist, minEStoIEratio, minDTperEvt, maxDTperEvt, minNumNeigh,
-        maxNumNeigh, numEllipsoids, maxEllipsoidSize, keepUnmatchedPhases);
+        maxNumNeigh, numEllipsoids, maxEllipsoidSize, keepUnmatchedPhases,
+        bgCatIndex);
 
     //
     // Prepare catalog to relocate
@@ -595,7 +768,9 @@ CatalogPtr HypoDD::relocateEventSingleStep(const CatalogCPtr bgCat,
       // Perform cross correlation, which also detects picks around theoretical
       // arrival times. The catalog will be updated with those theoretical
       // phases
+      resetCounters();
       xcorr = buildXCorrCache(catalog, {neighbours}, computeTheoreticalPhases);
+      printCounters();
     }
 
     // The actual relocation
@@ -633,14 +808,25 @@ CatalogPtr HypoDD::relocate(const CatalogCPtr &catalog,
   //
   CatalogCPtr currCatalog = catalog;
   ObservationParams obsparams;
+  const ObservationGraph graph =
+      buildObservationGraph(catalog, neighCluster, xcorr);
+  unsigned iterations = 0;
+  bool converged      = false;
+  // when the changes become negligible before the end of the schedule, one
+  // last iteration is performed with the final parameter values
+  bool atScheduleEnd = false;
   for (unsigned iteration = 0; iteration < _cfg.solver.algoIterations;
        iteration++)
   {
+    const bool lastIteration =
+        atScheduleEnd || iteration + 1 == _cfg.solver.algoIterations;
+
     //
     // compute parameters for this loop iteration
     //
     auto interpolate = [&](double start, double end) -> double {
       if (_cfg.solver.algoIterations < 2) return (start + end) / 2;
+      if (lastIteration) return end;
       return start +
              (end - start) * iteration / (_cfg.solver.algoIterations - 1);
     };
@@ -676,17 +862,15 @@ CatalogPtr HypoDD::relocate(const CatalogCPtr &catalog,
                   meanDepthShiftConstraint, meanTTShiftConstraint);
 
     // Create a solver and then add observations
-    Solver solver(_cfg.solver.type);
+    Solver solver(_cfg.solver.type,
+                  _cfg.solver.multiThreaded ? _threadPool.get() : nullptr);
 
     //
     // Add absolute travel time/xcorr differences to the solver (the
     // observations)
     //
-    for (const NeighboursPtr &neighbours : neighCluster)
-    {
-      addObservations(solver, absTTDiffObsWeight, xcorrObsWeight, currCatalog,
-                      neighbours, keepNeighboursFixed, xcorr, obsparams);
-    }
+    addObservations(solver, absTTDiffObsWeight, xcorrObsWeight, currCatalog,
+                    graph, keepNeighboursFixed, obsparams);
     obsparams.addToSolver(solver);
 
     //
@@ -697,7 +881,8 @@ CatalogPtr HypoDD::relocate(const CatalogCPtr &catalog,
       solver.solve(_cfg.solver.solverIterations, dampingFactor,
                    downWeightingByResidual, meanLonShiftConstraint,
                    meanLatShiftConstraint, meanDepthShiftConstraint,
-                   meanTTShiftConstraint, _cfg.solver.L2normalization);
+                   meanTTShiftConstraint, _cfg.solver.L2normalization,
+                   _cfg.solver.blockJacobi);
     }
     catch (exception &e)
     {
@@ -710,13 +895,30 @@ CatalogPtr HypoDD::relocate(const CatalogCPtr &catalog,
     obsparams = ObservationParams();
 
     // update event parameters
+    CatalogCPtr prevCatalog = currCatalog;
     currCatalog =
         updateRelocatedEvents(solver, currCatalog, neighCluster, obsparams);
+    iterations++;
+
+    // the solver computes the changes to the current locations, so each
+    // iteration already starts from the previous solution: stop when those
+    // changes become negligible. The rms of the first iteration is compared
+    // with the catalog one, which is not computed in the same way. The
+    // relocation is converged only if that happens with the final parameter
+    // values of the schedule
+    const bool negligibleChanges =
+        hasConverged(prevCatalog, currCatalog, neighCluster, iteration > 0);
+    if (lastIteration)
+    {
+      converged = negligibleChanges;
+      break;
+    }
+    atScheduleEnd = negligibleChanges;
   }
 
   // compute last bit of statistics for the relocated events
-  CatalogPtr relocatedCatalog =
-      updateRelocatedEventsFinalStats(catalog, currCatalog, neighCluster);
+  CatalogPtr relocatedCatalog = updateRelocatedEventsFinalStats(
+      catalog, currCatalog, neighCluster, iterations, converged);
 
   return relocatedCatalog;
 }
@@ -734,7 +936,8 @@ string HypoDD::relocationReport(const CatalogCPtr &relocatedEv)
       "Neighbours mean distace to centroid [km]: location=%.2f depth=%.2f\n"
       "Origin distace to neighbours centroid [km]: location=%.2f depth=%.2f\n"
       "DD observations: %u (CC P/S %u/%u TT P/S %u/%u)\n"
-      "DD observations residuals [msec]: before %.f+/-%.1f after %.f+/-%.1f",
+      "DD observations residuals [msec]: before %.f+/-%.1f after %.f+/-%.1f\n"
+      "Solver iterations: %u%s",
       event.relocInfo.locChange, event.relocInfo.depthChange,
       event.relocInfo.timeChange, (event.rms - event.relocInfo.startRms),
       event.relocInfo.startRms, event.rms, event.relocInfo.neighbours.amount,
@@ -753,116 +956,191 @@ string HypoDD::relocationReport(const CatalogCPtr &relocatedEv)
       event.relocInfo.ddObs.startResidualMedian * 1000,
       event.relocInfo.ddObs.startResidualMAD * 1000,
       event.relocInfo.ddObs.finalResidualMedian * 1000,
-      event.relocInfo.ddObs.finalResidualMAD * 1000);
+      event.relocInfo.ddObs.finalResidualMAD * 1000,
+      event.relocInfo.solver.iterations,
+      event.relocInfo.solver.converged ? " (converged)" : "");
 }
 
 /*
- * Add to the Solver the absolute travel times differences and the
- * differential travel times from cross correlation for pairs of
- * earthquakes
+ * Collect the pairs of phases of the reference events and their neighbours
+ * that become double-difference observations, with the cross-correlation
+ * results to use. Those don't change while iterating the solver, so they are
+ * looked up once per relocation
  */
-void HypoDD::addObservations(Solver &solver,
-                             double absTTDiffObsWeight,
-                             double xcorrObsWeight,
-                             const CatalogCPtr &catalog,
-                             const NeighboursPtr &neighbours,
-                             bool keepNeighboursFixed,
-                             const XCorrCache &xcorr,
-                             ObservationParams &obsparams) const
+HypoDD::ObservationGraph
+HypoDD::buildObservationGraph(const CatalogCPtr &catalog,
+                              const std::list<NeighboursPtr> &neighCluster,
+                              const XCorrCache &xcorr) const
 {
-  // copy event because we'll update it
-  const Event &refEv = catalog->getEvents().at(neighbours->refEvId);
+  ObservationGraph graph;
+  unordered_map<unsigned, unsigned> eventIdxs;
+  unordered_map<const Phase *, unsigned> phaseIdxs;
 
-  //
-  // loop through reference event phases
-  //
-  auto eqlrng = catalog->getPhases().equal_range(refEv.id);
-  for (auto it = eqlrng.first; it != eqlrng.second; ++it)
+  auto phaseIdx = [&](const Phase &phase) -> unsigned {
+    auto it = phaseIdxs.find(&phase);
+    if (it != phaseIdxs.end()) return it->second;
+
+    auto evIt = eventIdxs.find(phase.eventId);
+    if (evIt == eventIdxs.end())
+    {
+      evIt = eventIdxs.emplace(phase.eventId, graph.eventIds.size()).first;
+      graph.eventIds.push_back(phase.eventId);
+    }
+    const Station &station = catalog->getStations().at(phase.stationId);
+    graph.phases.push_back({evIt->second, &phase, &station});
+    return phaseIdxs.emplace(&phase, graph.phases.size() - 1).first->second;
+  };
+
+  for (const NeighboursPtr &neighbours : neighCluster)
   {
-    const Phase &refPhase  = it->second;
-    const Station &station = catalog->getStations().at(refPhase.stationId);
-    char phaseTypeAsChar   = static_cast<char>(refPhase.procInfo.type);
+    const Event &refEv = catalog->getEvents().at(neighbours->refEvId);
 
     //
-    // loop through neighbouring events and look for the matching phase
+    // loop through reference event phases
     //
-    for (unsigned neighEvId : neighbours->ids)
+    auto eqlrng = catalog->getPhases().equal_range(refEv.id);
+    for (auto it = eqlrng.first; it != eqlrng.second; ++it)
     {
-      const Event &event = catalog->getEvents().at(neighEvId);
-
-      if (!neighbours->has(neighEvId, refPhase.stationId,
-                           refPhase.procInfo.type))
-        continue;
+      const Phase &refPhase = it->second;
 
-      const Phase &phase = catalog
-                               ->searchPhase(event.id, refPhase.stationId,
-                                             refPhase.procInfo.type)
-                               ->second;
       //
-      // compute travel times for both event and refEvent
+      // loop through neighbouring events and look for the matching phase
       //
-      double ref_travel_time = (refPhase.time - refEv.time).length();
-      if (ref_travel_time < 0)
+      for (unsigned neighEvId : neighbours->ids)
       {
-        SEISCOMP_DEBUG("Ignoring phase %s with negative travel time",
-                       string(refPhase).c_str());
-        continue;
-      }
+        if (!neighbours->has(neighEvId, refPhase.stationId,
+                             refPhase.procInfo.type))
+          continue;
 
-      double travel_time = (phase.time - event.time).length();
-      if (travel_time < 0)
-      {
-        SEISCOMP_DEBUG("Ignoring phase %s with negative travel time",
-                       string(phase).c_str());
-        continue;
+        const Phase &phase = catalog
+                                 ->searchPhase(neighEvId, refPhase.stationId,
+                                               refPhase.procInfo.type)
+                                 ->second;
+
+        ObservationGraph::Observation obs;
+        obs.refPhaseIdx   = phaseIdx(refPhase);
+        obs.phaseIdx      = phaseIdx(phase);
+        obs.aPrioriWeight =
+            _cfg.solver.usePickUncertainty
+                ? (refPhase.procInfo.weight + phase.procInfo.weight) / 2.0
+                : 1.0;
+
+        //
+        // Check if we have xcorr results for current event/refEvent pair at
+        // station/phase and use those instead
+        //
+        obs.isXcorr  = xcorr.has(refEv.id, neighEvId, refPhase.stationId,
+                                 refPhase.procInfo.type);
+        obs.xcorrLag = 0;
+        if (obs.isXcorr)
+        {
+          const auto &xcdata = xcorr.get(refEv.id, neighEvId,
+                                         refPhase.stationId,
+                                         refPhase.procInfo.type);
+          obs.xcorrLag = xcdata.lag;
+        }
+        graph.observations.push_back(obs);
       }
+    }
+  }
+
+  SEISCOMP_DEBUG("Double-difference observations: %zu (%zu events, %zu "
+                 "phases)",
+                 graph.observations.size(), graph.eventIds.size(),
+                 graph.phases.size());
+  return graph;
+}
+
+/*
+ * Add to the Solver the absolute travel times differences and the
+ * differential travel times from cross correlation for pairs of
+ * earthquakes, using the current events locations and times
+ */
+void HypoDD::addObservations(Solver &solver,
+                             double absTTDiffObsWeight,
+                             double xcorrObsWeight,
+                             const CatalogCPtr &catalog,
+                             const ObservationGraph &graph,
+                             bool keepNeighboursFixed,
+                             ObservationParams &obsparams) const
+{
+  vector<const Event *> events(graph.eventIds.size());
+  for (size_t i = 0; i < graph.eventIds.size(); i++)
+    events[i] = &catalog->getEvents().at(graph.eventIds[i]);
+
+  // the travel times are computed once per phase, when first needed
+  enum class TravelTime : char
+  {
+    UNKNOWN,
+    AVAILABLE,
+    UNAVAILABLE
+  };
+  vector<TravelTime> travelTimes(graph.phases.size(), TravelTime::UNKNOWN);
+
+  auto hasTravelTime = [&](unsigned phaseIdx) -> bool {
+    TravelTime &tt = travelTimes[phaseIdx];
+    if (tt == TravelTime::UNKNOWN)
+    {
+      const ObservationGraph::PhaseNode &node = graph.phases[phaseIdx];
 
+      const char phaseType = static_cast<char>(node.phase->procInfo.type);
       try
       {
-        obsparams.add(_ttt, refEv, station, phaseTypeAsChar);
-        obsparams.add(_ttt, event, station, phaseTypeAsChar);
+        obsparams.add(_ttt, *events[node.eventIdx], *node.station, phaseType);
+        tt = TravelTime::AVAILABLE;
       }
       catch (exception &e)
       {
-        SEISCOMP_DEBUG("Skipping observation (ev %u-%u sta %s phase %c): %s",
-                       refEv.id, event.id, station.id.c_str(), phaseTypeAsChar,
-                       e.what());
-        continue;
+        SEISCOMP_DEBUG("Skipping observations of ev %u sta %s phase %c: %s",
+                       node.phase->eventId, node.station->id.c_str(),
+                       phaseType, e.what());
+        tt = TravelTime::UNAVAILABLE;
       }
+    }
+    return tt == TravelTime::AVAILABLE;
+  };
 
-      //
-      // Conpute absolute trave time differences to the solver
-      //
-      double diffTime = ref_travel_time - travel_time;
-      double weight =
-          _cfg.solver.usePickUncertainty
-              ? (refPhase.procInfo.weight + phase.procInfo.weight) / 2.0
-              : 1.0;
-      bool isXcorr = false;
-
-      //
-      // Check if we have xcorr results for current event/refEvent pair at
-      // station/phase and use those instead
-      //
-      if (xcorr.has(refEv.id, event.id, refPhase.stationId,
-                    refPhase.procInfo.type))
-      {
+  for (const ObservationGraph::Observation &obs : graph.observations)
+  {
+    const ObservationGraph::PhaseNode &refNode = graph.phases[obs.refPhaseIdx];
+    const ObservationGraph::PhaseNode &node    = graph.phases[obs.phaseIdx];
+    const Event &refEv                         = *events[refNode.eventIdx];
+    const Event &event                         = *events[node.eventIdx];
+    const Phase &refPhase                      = *refNode.phase;
+    const Phase &phase                         = *node.phase;
 
-        const auto &xcdata = xcorr.get(refEv.id, event.id, refPhase.stationId,
-                                       refPhase.procInfo.type);
-        diffTime -= xcdata.lag;
-        weight *= xcorrObsWeight;
-        isXcorr = true;
-      }
-      else
-      {
-        weight *= absTTDiffObsWeight;
-      }
+    //
+    // compute travel times for both event and refEvent
+    //
+    double ref_travel_time = (refPhase.time - refEv.time).length();
+    if (ref_travel_time < 0)
+    {
+      SEISCOMP_DEBUG("Ignoring phase %s with negative travel time",
+                     string(refPhase).c_str());
+      continue;
+    }
 
-      solver.addObservation(refEv.id, event.id, refPhase.stationId,
-                            phaseTypeAsChar, diffTime, weight, true,
-                            !keepNeighboursFixed, isXcorr);
+    double travel_time = (phase.time - event.time).length();
+    if (travel_time < 0)
+    {
+      SEISCOMP_DEBUG("Ignoring phase %s with negative travel time",
+                     string(phase).c_str());
+      continue;
     }
+
+    if (!hasTravelTime(obs.refPhaseIdx) || !hasTravelTime(obs.phaseIdx))
+      continue;
+
+    //
+    // Conpute absolute trave time differences to the solver
+    //
+    double diffTime = ref_travel_time - travel_time - obs.xcorrLag;
+    double weight   = obs.aPrioriWeight *
+                      (obs.isXcorr ? xcorrObsWeight : absTTDiffObsWeight);
+
+    solver.addObservation(refEv.id, event.id, refPhase.stationId,
+                          static_cast<char>(refPhase.procInfo.type), diffTime,
+                          weight, true, !keepNeighboursFixed, obs.isXcorr);
   }
 }
 
@@ -1061,10 +1339,59 @@ HypoDD::updateRelocatedEvents(const Solver &solver,
   return new Catalog(stations, events, phases);
 }
 
+/*
+ * Check the convergence criteria (see Config::solver) on the changes of the
+ * relocated events between two solver iterations
+ */
+bool HypoDD::hasConverged(const CatalogCPtr &prevCatalog,
+                          const CatalogCPtr &currCatalog,
+                          const std::list<NeighboursPtr> &neighCluster,
+                          bool compareRms) const
+{
+  const double maxLocChange  = _cfg.solver.convergenceLocChange;
+  const double maxTimeChange = _cfg.solver.convergenceTimeChange;
+  const double maxRmsChange  = _cfg.solver.convergenceRmsChange;
+
+  if (maxLocChange <= 0 && maxTimeChange <= 0 && maxRmsChange <= 0)
+    return false;
+
+  double locChange = 0, timeChange = 0, rmsChange = 0;
+  for (const NeighboursPtr &neighbours : neighCluster)
+  {
+    const Event &prev = prevCatalog->getEvents().at(neighbours->refEvId);
+    const Event &curr = currCatalog->getEvents().at(neighbours->refEvId);
+    if (!curr.relocInfo.isRelocated) continue;
+
+    const double evTimeChange = (curr.time - prev.time).length();
+
+    locChange  = std::max(locChange, computeDistance(prev, curr));
+    timeChange = std::max(timeChange, std::abs(evTimeChange));
+    if (prev.relocInfo.isRelocated)
+      rmsChange = std::max(rmsChange, std::abs(curr.rms - prev.rms));
+    else
+      compareRms = false;
+  }
+
+  const bool converged =
+      (maxLocChange <= 0 || locChange <= maxLocChange) &&
+      (maxTimeChange <= 0 || timeChange <= maxTimeChange) &&
+      (maxRmsChange <= 0 || (compareRms && rmsChange <= maxRmsChange));
+
+  const string rmsStr =
+      compareRms ? stringify("%.4f [sec]", rmsChange) : string("-");
+  SEISCOMP_INFO("Max event changes: location %.3f [km] time %.4f [sec] rms "
+                "%s%s",
+                locChange, timeChange, rmsStr.c_str(),
+                converged ? " (converged)" : "");
+  return converged;
+}
+
 CatalogPtr HypoDD::updateRelocatedEventsFinalStats(
     const CatalogCPtr &startCatalog,
     const CatalogCPtr &finalCatalog,
-    const std::list<NeighboursPtr> &neighCluster) const
+    const std::list<NeighboursPtr> &neighCluster,
+    unsigned iterations,
+    bool converged) const
 {
   CatalogPtr catalogToReturn(new Catalog());
   vector<double> allRms;
@@ -1095,6 +1422,8 @@ CatalogPtr HypoDD::updateRelocatedEventsFinalStats(
     finalEvent.relocInfo.depthChange = finalEvent.depth - startEvent.depth;
     finalEvent.relocInfo.timeChange =
         (finalEvent.time - startEvent.time).length();
+    finalEvent.relocInfo.solver.iterations = iterations;
+    finalEvent.relocInfo.solver.converged  = converged;
 
     //
     // Compute starting event rms considering only the phases in the final
@@ -1417,7 +1746,6 @@ XCorrCache HypoDD::buildXCorrCache(CatalogPtr &catalog,
                                    bool computeTheoreticalPhases)
 {
   XCorrCache xcorr;
-  resetCounters();
 
   for (const NeighboursPtr &neighbours : neighCluster)
   {
@@ -1438,8 +1766,6 @@ XCorrCache HypoDD::buildXCorrCache(CatalogPtr &catalog,
     fixPhases(catalog, refEv, xcorr);
   }
 
-  printCounters();
-
   return xcorr;
 }
 
@@ -1459,19 +1785,35 @@ void HypoDD::buildXcorrDiffTTimePairs(CatalogPtr &catalog,
   //
   // Prepare the waveform loaders for temporary/real-time waveforms
   //
-  Waveform::LoaderPtr actualDiskLdr = new Waveform::DiskCachedLoader(
-      _cfg.ddObservations2.recordStreamURL, false, _tmpCacheDir);
-  Waveform::LoaderPtr diskLdr =
-      new Waveform::ExtraLenLoader(actualDiskLdr, DISK_TRACE_MIN_LEN);
+  const bool useDiskLdr =
+      (_useCatalogWaveformDiskCache && _waveformCacheAll) || _recordBuffer;
+
+  // the temporary disk cache is opened only when used, since opening its
+  // archive loads the whole index and locks it
+  Waveform::LoaderPtr actualDiskLdr, diskLdr;
+  if (_recordBuffer)
+  {
+    // the real-time waveforms are already in memory, there is no need to
+    // store them on disk
+    actualDiskLdr = new Waveform::RecordBufferLoader(
+        _cfg.ddObservations2.recordStreamURL, _recordBuffer);
+    diskLdr = actualDiskLdr;
+  }
+  else if (useDiskLdr)
+  {
+    actualDiskLdr = new Waveform::DiskCachedLoader(
+        _cfg.ddObservations2.recordStreamURL, false, _tmpCacheDir);
+    diskLdr = new Waveform::ExtraLenLoader(actualDiskLdr, DISK_TRACE_MIN_LEN);
+  }
 
   Waveform::LoaderPtr memLdr =
-      (_useCatalogWaveformDiskCache && _waveformCacheAll)
+      useDiskLdr
           ? new Waveform::MemCachedLoader(diskLdr, true)
           : new Waveform::MemCachedLoader(_cfg.ddObservations2.recordStreamURL,
                                           true);
 
   Waveform::SnrFilteredLoaderPtr actualSnrLdr =
-      (_useCatalogWaveformDiskCache && _waveformCacheAll)
+      useDiskLdr
           ? new Waveform::SnrFilteredLoader(
                 diskLdr, _cfg.snr.minSnr, _cfg.snr.noiseStart,
                 _cfg.snr.noiseEnd, _cfg.snr.signalStart, _cfg.snr.signalEnd)
@@ -1486,9 +1828,30 @@ void HypoDD::buildXcorrDiffTTimePairs(CatalogPtr &catalog,
   actualSnrLdr->setDebugDirectory(_waveformDebug ? _wfDebugDir : "");
   snrLdr->setDebugDirectory(_waveformDebug ? _wfDebugDir : "");
 
-  // keep track of refEv distance to stations
-  multimap<double, string> stationByDistance; // <distance, stationid>
-  unordered_set<string> computedStations;
+  //
+  // The reference phases are cross-correlated in parallel. Each task only
+  // reads shared data and stores its results by index; the results are
+  // merged afterward in the reference phases order, so that the outcome is
+  // the same as a sequential run
+  //
+  struct XCorrTask
+  {
+    const Phase *refPhase;
+    double stationDistance;
+    Waveform::LoaderPtr refLdr;
+    Core::TimeWindow snrWin;
+    vector<PhasePeer> peers;
+    struct Result
+    {
+      size_t peerIdx;
+      double coeff;
+      double lag;
+    };
+    vector<Result> results; // good xcorr results, with good SNR
+  };
+  vector<XCorrTask> tasks;
+  // the SNR window length depends on the phase type only
+  map<Phase::Type, Waveform::LoaderPtr> extraLenLdrs;
 
   //
   // loop through reference event phases
@@ -1530,12 +1893,21 @@ void HypoDD::buildXcorrDiffTTimePairs(CatalogPtr &catalog,
                                            Core::TimeSpan(xcorrCfg.maxDelay)) |
                _wfSnrFilter->snrTimeWindow(refPhase.time +
                                            Core::TimeSpan(xcorrCfg.maxDelay));
-      refLdr = new Waveform::ExtraLenLoader(memLdr, snrWin.length());
+      auto it = extraLenLdrs.find(refPhase.procInfo.type);
+      if (it == extraLenLdrs.end())
+      {
+        it = extraLenLdrs
+                 .emplace(refPhase.procInfo.type,
+                          new Waveform::ExtraLenLoader(memLdr, snrWin.length()))
+                 .first;
+      }
+      refLdr = it->second;
     }
 
     //
-    // loop through neighbouring events and cross correlate with refPhase
+    // collect the neighbouring events phases to cross correlate with refPhase
     //
+    vector<PhasePeer> peers;
     for (unsigned neighEvId : neighbours->ids)
     {
       const Event &event = catalog->getEvents().at(neighEvId);
@@ -1563,57 +1935,124 @@ void HypoDD::buildXcorrDiffTTimePairs(CatalogPtr &catalog,
           throw runtime_error(
               "Internal logic error: phase is not from catalog");
 
-        double coeff, lag;
-        if (xcorrPhases(refEv, refPhase, refLdr, event, phase, _wfMemCache,
-                        coeff, lag))
-        {
-          bool goodSNR = true;
+        peers.push_back(PhasePeer(event, phase));
+      }
+    }
 
-          // for phases that have not had their SNR checked already, do it now
-          // using the pick time adjusted by xcorr detected lag
-          if (_cfg.snr.minSnr > 0 && !refPhase.isManual &&
-              refPhase.procInfo.source != Phase::Source::CATALOG)
-          {
-            const auto xcorrCfg = _cfg.xcorr.at(refPhase.procInfo.type);
-            // check that at least one of the components allowed for this
-            // phase type has a good SNR
-            goodSNR = false;
-            for (const string &component : xcorrCfg.components)
-            {
-              Phase tmpPh = refPhase;
-              tmpPh.channelCode =
-                  getBandAndInstrumentCodes(tmpPh.channelCode) + component;
-              GenericRecordCPtr trace = refLdr->get(snrWin, tmpPh, refEv, true,
-                                                    _cfg.wfFilter.filterStr,
-                                                    _cfg.wfFilter.resampleFreq);
-              Core::Time adjustedPickTime = tmpPh.time - Core::TimeSpan(lag);
-              if (trace && _wfSnrFilter->goodSnr(trace, adjustedPickTime))
-              {
-                goodSNR = true;
-                break;
-              }
-            }
-          }
+    XCorrTask task;
+    task.refPhase        = &refPhase;
+    task.stationDistance = stationDistance;
+    task.refLdr          = refLdr;
+    task.snrWin          = snrWin;
+    task.peers           = std::move(peers);
+    tasks.push_back(std::move(task));
+  }
 
-          // Store good xcorr results
-          if (goodSNR)
-          {
-            auto &entry1 = xcorr.getForUpdate(refEv.id, refPhase.stationId,
-                                              refPhase.procInfo.type);
-            entry1.update(event, phase, coeff, lag);
-            auto &entry2 = xcorr.getForUpdate(event.id, phase.stationId,
-                                              phase.procInfo.type);
-            entry2.update(refEv, refPhase, coeff, lag);
-          }
-        }
+  //
+  // Load the waveforms of the real-time phases all together, so that they are
+  // fetched from the record stream with a few requests instead of one
+  // request per component
+  //
+  std::list<Phase> componentPhases;
+  map<Waveform::Loader *, vector<Waveform::Loader::Request>> requestsByLdr;
+  for (const XCorrTask &task : tasks)
+  {
+    const Phase &refPhase = *task.refPhase;
+    if (task.peers.empty() ||
+        refPhase.procInfo.source == Phase::Source::CATALOG)
+      continue;
+
+    const auto xcorrCfg = _cfg.xcorr.at(refPhase.procInfo.type);
+    for (const string &component : xcorrCfg.components)
+    {
+      componentPhases.push_back(refPhase);
+      Phase &tmpPh = componentPhases.back();
+      tmpPh.channelCode =
+          getBandAndInstrumentCodes(tmpPh.channelCode) + component;
+      requestsByLdr[task.refLdr.get()].push_back(
+          {xcorrTimeWindowLong(refPhase), &tmpPh, &refEv});
+    }
+  }
+  for (const auto &kv : requestsByLdr) getWaveforms(kv.second, kv.first);
+
+  _threadPool->parallelFor(tasks.size(), [&](size_t taskIdx) {
+    XCorrTask &task       = tasks[taskIdx];
+    const Phase &refPhase = *task.refPhase;
+
+    //
+    // cross correlate refPhase with all the neighbours at once: refPhase
+    // waveform is loaded and processed only once
+    //
+    vector<double> coeffs, lags;
+    const vector<bool> goodCoeffs = xcorrPhases(
+        refEv, refPhase, task.refLdr, task.peers, _wfMemCache, coeffs, lags);
+
+    for (size_t i = 0; i < task.peers.size(); i++)
+    {
+      if (!goodCoeffs[i]) continue;
+
+      const double lag = lags[i];
+
+      bool goodSNR = true;
 
-        // keep trace of  events/station distance for every xcorr performed
-        if (computedStations.find(refPhase.stationId) == computedStations.end())
+      // for phases that have not had their SNR checked already, do it now
+      // using the pick time adjusted by xcorr detected lag
+      if (_cfg.snr.minSnr > 0 && !refPhase.isManual &&
+          refPhase.procInfo.source != Phase::Source::CATALOG)
+      {
+        const auto xcorrCfg = _cfg.xcorr.at(refPhase.procInfo.type);
+        // check that at least one of the components allowed for this
+        // phase type has a good SNR
+        goodSNR = false;
+        for (const string &component : xcorrCfg.components)
         {
-          stationByDistance.emplace(stationDistance, refPhase.stationId);
-          computedStations.insert(refPhase.stationId);
+          Phase tmpPh = refPhase;
+          tmpPh.channelCode =
+              getBandAndInstrumentCodes(tmpPh.channelCode) + component;
+          GenericRecordCPtr trace = task.refLdr->get(
+              task.snrWin, tmpPh, refEv, true, _cfg.wfFilter.filterStr,
+              _cfg.wfFilter.resampleFreq);
+          Core::Time adjustedPickTime = tmpPh.time - Core::TimeSpan(lag);
+          if (trace && _wfSnrFilter->goodSnr(trace, adjustedPickTime))
+          {
+            goodSNR = true;
+            break;
+          }
         }
       }
+
+      if (goodSNR) task.results.push_back({i, coeffs[i], lag});
+    }
+  });
+
+  // keep track of refEv distance to stations
+  multimap<double, string> stationByDistance; // <distance, stationid>
+  unordered_set<string> computedStations;
+
+  for (const XCorrTask &task : tasks)
+  {
+    const Phase &refPhase = *task.refPhase;
+
+    // keep trace of  events/station distance for every xcorr performed
+    if (!task.peers.empty() &&
+        computedStations.find(refPhase.stationId) == computedStations.end())
+    {
+      stationByDistance.emplace(task.stationDistance, refPhase.stationId);
+      computedStations.insert(refPhase.stationId);
+    }
+
+    // Store good xcorr results
+    for (const XCorrTask::Result &result : task.results)
+    {
+      const Event &event = task.peers[result.peerIdx].first;
+      const Phase &phase = task.peers[result.peerIdx].second;
+
+      auto &entry1 = xcorr.getForUpdate(refEv.id, refPhase.stationId,
+                                        refPhase.procInfo.type);
+      entry1.update(event, phase, result.coeff, result.lag);
+      auto &entry2 =
+          xcorr.getForUpdate(event.id, phase.stationId, phase.procInfo.type);
+      entry2.update(refEv, refPhase, result.coeff, result.lag);
     }
 
     // finalize statistics
@@ -1654,7 +2093,7 @@ void HypoDD::buildXcorrDiffTTimePairs(CatalogPtr &catalog,
                       string(refEv).c_str(), station.networkCode.c_str(),
                       station.stationCode.c_str(), stationDistance,
                       pdata.ccCount, pdata.mean_coeff, pdata.mean_lag,
-                      pdata.peersStr.c_str());
+                      pdata.peersStr().c_str());
       }
       if (goodSXcorr)
       {
@@ -1664,7 +2103,7 @@ void HypoDD::buildXcorrDiffTTimePairs(CatalogPtr &catalog,
                       string(refEv).c_str(), station.networkCode.c_str(),
                       station.stationCode.c_str(), stationDistance,
                       sdata.ccCount, sdata.mean_coeff, sdata.mean_lag,
-                      sdata.peersStr.c_str());
+                      sdata.peersStr().c_str());
       }
     }
   }
@@ -1751,7 +2190,19 @@ void HypoDD::fixPhases(CatalogPtr &catalog,
 
 void HypoDD::resetCounters()
 {
-  _counters = {0};
+  _counters.xcorr_performed        = 0;
+  _counters.xcorr_performed_theo   = 0;
+  _counters.xcorr_performed_s      = 0;
+  _counters.xcorr_performed_s_theo = 0;
+  _counters.xcorr_good_cc          = 0;
+  _counters.xcorr_good_cc_theo     = 0;
+  _counters.xcorr_good_cc_s        = 0;
+  _counters.xcorr_good_cc_s_theo   = 0;
+  _counters.xcorr_stored           = 0;
+  _counters.wf_downloaded          = 0;
+  _counters.wf_no_avail            = 0;
+  _counters.wf_disk_cached         = 0;
+  _counters.wf_snr_low             = 0;
   if (_wfDiskCache)
   {
     _wfDiskCache->_counters_wf_no_avail   = 0;
@@ -1768,6 +2219,9 @@ void HypoDD::resetCounters()
   _wfMemCache->_counters_wf_no_avail   = 0;
   _wfMemCache->_counters_wf_cached     = 0;
   _wfMemCache->_counters_wf_downloaded = 0;
+  _wfMemCache->_counters_mem_hits      = 0;
+  _wfMemCache->_counters_mem_misses    = 0;
+  _wfMemCache->_counters_mem_evictions = 0;
 }
 
 void HypoDD::updateCounters(Waveform::LoaderPtr diskCache,
@@ -1822,6 +2276,13 @@ void HypoDD::printCounters() const
                 performed, wf_snr_low, wf_no_avail, wf_downloaded,
                 wf_disk_cached);
 
+  if (_xcorrArchive)
+  {
+    SEISCOMP_INFO("Cross correlation results reused from the catalog store "
+                  "%u, catalog store size %zu",
+                  _counters.xcorr_stored.load(), _xcorrArchive->size());
+  }
+
   SEISCOMP_INFO("Total xcorr %u (P %.f%%, S %.f%%) success %.f%% (%u/%u). "
                 "Successful P %.f%% (%u/%u). Successful S %.f%% (%u/%u)",
                 performed, (performed_p * 100. / performed),
@@ -1857,6 +2318,62 @@ void HypoDD::printCounters() const
         good_cc_p_theo, perf_theo_p, (good_cc_s_theo * 100. / perf_theo_s),
         good_cc_s_theo, perf_theo_s);
   }
+
+  printMemCacheCounters();
+}
+
+void HypoDD::printMemCacheCounters() const
+{
+  const unsigned hits   = _wfMemCache->_counters_mem_hits;
+  const unsigned misses = _wfMemCache->_counters_mem_misses;
+  const string budget =
+      _wfMemCache->maxBytes() > 0
+          ? to_string(_wfMemCache->maxBytes() / 1048576) + " MB"
+          : "unlimited";
+
+  SEISCOMP_INFO("Waveform memory cache: %zu waveforms, %.1f MB (budget %s), "
+                "hits %u (%.f%%) misses %u evictions %u",
+                _wfMemCache->cachedTraces(),
+                _wfMemCache->cachedBytes() / 1048576.,
+                budget.c_str(),
+                hits, (hits * 100. / std::max(hits + misses, 1u)), misses,
+                _wfMemCache->_counters_mem_evictions.load());
+}
+
+/*
+ * Key of the cross-correlation results of two catalog phases, whose channels
+ * must be already set to the ones to use. The events are identified by their
+ * pick times, which don't change when the catalog is relocated, and the last
+ * part of the key identifies the settings affecting the results: if any of
+ * them changes the stored results are not used anymore
+ */
+string HypoDD::xcorrStoreKey(const Phase &phase1, const Phase &phase2) const
+{
+  const auto xcorrCfg = _cfg.xcorr.at(phase1.procInfo.type);
+  const string procId = Waveform::processingId(
+      true, _cfg.wfFilter.filterStr, _cfg.wfFilter.resampleFreq);
+
+  const string settings = stringify(
+      "v%u|%s|%.9g|%.9g|%.9g|%.9g|%.9g|%.9g|%.9g|%.9g|%.9g",
+      XCORR_STORE_VERSION, procId.c_str(), DISK_TRACE_MIN_LEN,
+      xcorrCfg.startOffset, xcorrCfg.endOffset, xcorrCfg.maxDelay,
+      _cfg.snr.minSnr, _cfg.snr.noiseStart, _cfg.snr.noiseEnd,
+      _cfg.snr.signalStart, _cfg.snr.signalEnd);
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (const char c : settings)
+  {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 16777619u;
+  }
+
+  return stringify("%s.%s.%s.%s.%s.%s.%s.%s.%c.%d%d.%08x",
+                   phase1.networkCode.c_str(), phase1.stationCode.c_str(),
+                   phase1.locationCode.c_str(), phase1.channelCode.c_str(),
+                   phase1.time.iso().c_str(), phase2.locationCode.c_str(),
+                   phase2.channelCode.c_str(), phase2.time.iso().c_str(),
+                   static_cast<char>(phase1.procInfo.type), phase1.isManual,
+                   phase2.isManual, hash);
 }
 
 Core::TimeWindow HypoDD::xcorrTimeWindowLong(const Phase &phase) const
@@ -1876,31 +2393,14 @@ Core::TimeWindow HypoDD::xcorrTimeWindowShort(const Phase &phase) const
   return Core::TimeWindow(phase.time + shortTimeCorrection, shortDuration);
 }
 
-bool HypoDD::xcorrPhases(const Event &event1,
-                         const Phase &phase1,
-                         Waveform::LoaderPtr ph1Cache,
-                         const Event &event2,
-                         const Phase &phase2,
-                         Waveform::LoaderPtr ph2Cache,
-                         double &coeffOut,
-                         double &lagOut)
+/*
+ * Try to use the same channels in cross correlation, in case the two phases
+ * differ but do not change the catalog phase channels. Returns an empty string
+ * if no common channels can be found
+ */
+string HypoDD::commonChannelCodeRoot(const Phase &phase1,
+                                     const Phase &phase2) const
 {
-  if (phase1.procInfo.type != phase2.procInfo.type)
-  {
-    SEISCOMP_ERROR(
-        "Internal logic error: trying to xcorr different phases (%s and %s)",
-        string(phase1).c_str(), string(phase2).c_str());
-    return false;
-  }
-
-  auto xcorrCfg  = _cfg.xcorr.at(phase1.procInfo.type);
-  bool performed = false;
-  bool goodCoeff = false;
-
-  //
-  // Try to use the same channels in cross correlation, in case the two phases
-  // differ but do not change the catalog phase channels
-  //
   const string channelCodeRoot1 = getBandAndInstrumentCodes(phase1.channelCode);
   const string channelCodeRoot2 = getBandAndInstrumentCodes(phase2.channelCode);
 
@@ -1947,68 +2447,176 @@ bool HypoDD::xcorrPhases(const Event &event1,
         string(phase1).c_str(), string(phase2).c_str());
   }
 
+  return commonChRoot;
+}
+
+/*
+ * Cross correlate phase1 against all the peers phases. Returns, for each peer,
+ * whether the cross correlation was performed with a good correlation
+ * coefficient; coeffOut and lagOut contain the results
+ */
+vector<bool> HypoDD::xcorrPhases(const Event &event1,
+                                 const Phase &phase1,
+                                 Waveform::LoaderPtr ph1Cache,
+                                 const vector<PhasePeer> &peers,
+                                 Waveform::LoaderPtr ph2Cache,
+                                 vector<double> &coeffOut,
+                                 vector<double> &lagOut)
+{
+  vector<bool> performed(peers.size(), false);
+  vector<bool> goodCoeff(peers.size(), false);
+  coeffOut.assign(peers.size(), 0);
+  lagOut.assign(peers.size(), 0);
+
+  auto xcorrCfg = _cfg.xcorr.at(phase1.procInfo.type);
+
+  const string channelCodeRoot1 = getBandAndInstrumentCodes(phase1.channelCode);
+
+  // the results between catalog phases are looked up in the store first
+  vector<bool> useStore(peers.size(), false);
+  vector<string> storeKeys(peers.size());
+
+  vector<size_t> pending;
+  vector<string> commonChRoots(peers.size());
+  for (size_t i = 0; i < peers.size(); i++)
+  {
+    const Phase &phase2 = peers[i].second;
+    if (phase1.procInfo.type != phase2.procInfo.type)
+    {
+      SEISCOMP_ERROR(
+          "Internal logic error: trying to xcorr different phases (%s and %s)",
+          string(phase1).c_str(), string(phase2).c_str());
+      continue;
+    }
+    commonChRoots[i] = commonChannelCodeRoot(phase1, phase2);
+    useStore[i]      = _xcorrArchive &&
+                       phase1.procInfo.source == Phase::Source::CATALOG &&
+                       phase2.procInfo.source == Phase::Source::CATALOG;
+    pending.push_back(i);
+  }
+
   //
   // perform xcorr on all registered component until we get a good correlation
   // coefficient
   //
   for (const string &component : xcorrCfg.components)
   {
-    Phase tmpPh1 = phase1;
-    Phase tmpPh2 = phase2;
+    if (pending.empty()) break;
 
-    // overwrite phases' component for the xcorr
-    if (commonChRoot.empty())
+    // overwrite phases' component for the xcorr. Group the peers by the
+    // phase1 channel, so that phase1 waveform is processed once per group
+    map<string, vector<size_t>> peersByChannel1;
+    vector<PhasePeer> tmpPeers(peers.size());
+    for (size_t i : pending)
     {
-      tmpPh1.channelCode = channelCodeRoot1 + component;
-      tmpPh2.channelCode = channelCodeRoot2 + component;
+      tmpPeers[i]          = peers[i];
+      Phase &tmpPh2        = tmpPeers[i].second;
+      const string &common = commonChRoots[i];
+      string channelCode1;
+      if (common.empty())
+      {
+        channelCode1 = channelCodeRoot1 + component;
+        tmpPh2.channelCode =
+            getBandAndInstrumentCodes(tmpPh2.channelCode) + component;
+      }
+      else
+      {
+        channelCode1       = common + component;
+        tmpPh2.channelCode = common + component;
+      }
+
+      if (useStore[i])
+      {
+        Phase tmpPh1       = phase1;
+        tmpPh1.channelCode = channelCode1;
+        storeKeys[i]       = xcorrStoreKey(tmpPh1, tmpPh2);
+        string value;
+        if (_xcorrArchive->read(storeKeys[i], value) &&
+            value.size() == 2 * sizeof(double))
+        {
+          std::memcpy(&coeffOut[i], value.data(), sizeof(double));
+          std::memcpy(&lagOut[i], value.data() + sizeof(double),
+                      sizeof(double));
+          performed[i] = true;
+          goodCoeff[i] = coeffOut[i] >= xcorrCfg.minCoef;
+          _counters.xcorr_stored++;
+          continue;
+        }
+      }
+
+      peersByChannel1[channelCode1].push_back(i);
     }
-    else
+
+    for (const auto &kv : peersByChannel1)
     {
-      tmpPh1.channelCode = commonChRoot + component;
-      tmpPh2.channelCode = commonChRoot + component;
-    }
+      Phase tmpPh1       = phase1;
+      tmpPh1.channelCode = kv.first;
 
-    performed = _xcorrPhases(event1, tmpPh1, ph1Cache, event2, tmpPh2, ph2Cache,
-                             coeffOut, lagOut);
+      vector<PhasePeer> groupPeers;
+      for (size_t i : kv.second) groupPeers.push_back(tmpPeers[i]);
 
-    coeffOut = std::abs(coeffOut);
+      vector<double> coeffs, lags;
+      vector<bool> groupPerformed = _xcorrPhases(
+          event1, tmpPh1, ph1Cache, groupPeers, ph2Cache, coeffs, lags);
 
-    goodCoeff = (performed && coeffOut >= xcorrCfg.minCoef);
+      for (size_t j = 0; j < kv.second.size(); j++)
+      {
+        const size_t i = kv.second[j];
+        performed[i]   = groupPerformed[j];
+        coeffOut[i]    = std::abs(coeffs[j]);
+        lagOut[i]      = lags[j];
+        goodCoeff[i]   = (performed[i] && coeffOut[i] >= xcorrCfg.minCoef);
 
-    // if the xcorr was successfull and the coeffiecnt is good then stop here
-    if (goodCoeff)
-    {
-      break;
+        if (useStore[i] && performed[i])
+        {
+          string value(2 * sizeof(double), '\0');
+          std::memcpy(&value[0], &coeffOut[i], sizeof(double));
+          std::memcpy(&value[sizeof(double)], &lagOut[i], sizeof(double));
+          _xcorrArchive->write(storeKeys[i], value);
+        }
+      }
     }
+
+    // if the xcorr was successfull and the coeffiecnt is good then stop here
+    vector<size_t> stillPending;
+    for (size_t i : pending)
+      if (!goodCoeff[i]) stillPending.push_back(i);
+    pending = stillPending;
   }
 
   //
   // Deal with counters
   //
-  bool isS           = (phase1.procInfo.type == Phase::Type::S);
-  bool isTheoretical = (phase1.procInfo.source == Phase::Source::XCORR ||
-                        phase2.procInfo.source == Phase::Source::XCORR ||
-                        phase1.procInfo.source == Phase::Source::THEORETICAL ||
-                        phase2.procInfo.source == Phase::Source::THEORETICAL);
-
-  if (performed)
+  for (size_t i = 0; i < peers.size(); i++)
   {
-    _counters.xcorr_performed++;
-    if (isTheoretical) _counters.xcorr_performed_theo++;
-    if (isS)
-    {
-      _counters.xcorr_performed_s++;
-      if (isTheoretical) _counters.xcorr_performed_s_theo++;
-    }
+    const Phase &phase2 = peers[i].second;
+
+    bool isS = (phase1.procInfo.type == Phase::Type::S);
+    bool isTheoretical =
+        (phase1.procInfo.source == Phase::Source::XCORR ||
+         phase2.procInfo.source == Phase::Source::XCORR ||
+         phase1.procInfo.source == Phase::Source::THEORETICAL ||
+         phase2.procInfo.source == Phase::Source::THEORETICAL);
 
-    if (goodCoeff)
+    if (performed[i])
     {
-      _counters.xcorr_good_cc++;
-      if (isTheoretical) _counters.xcorr_good_cc_theo++;
+      _counters.xcorr_performed++;
+      if (isTheoretical) _counters.xcorr_performed_theo++;
       if (isS)
       {
-        _counters.xcorr_good_cc_s++;
-        if (isTheoretical) _counters.xcorr_good_cc_s_theo++;
+        _counters.xcorr_performed_s++;
+        if (isTheoretical) _counters.xcorr_performed_s_theo++;
+      }
+
+      if (goodCoeff[i])
+      {
+        _counters.xcorr_good_cc++;
+        if (isTheoretical) _counters.xcorr_good_cc_theo++;
+        if (isS)
+        {
+          _counters.xcorr_good_cc_s++;
+          if (isTheoretical) _counters.xcorr_good_cc_s_theo++;
+        }
       }
     }
   }
@@ -2016,99 +2624,146 @@ bool HypoDD::xcorrPhases(const Event &event1,
   return goodCoeff;
 }
 
-bool HypoDD::_xcorrPhases(const Event &event1,
-                          const Phase &phase1,
-                          Waveform::LoaderPtr ph1Cache,
-                          const Event &event2,
-                          const Phase &phase2,
-                          Waveform::LoaderPtr ph2Cache,
-                          double &coeffOut,
-                          double &lagOut)
+/*
+ * Cross correlate phase1 against all the peers phases, whose channels must
+ * be already set to the ones to use. phase1 waveform is loaded and trimmed
+ * only once and the correlations are computed by the one-vs-many
+ * Waveform::xcorr, which reuses phase1 energy and spectrum.
+ * Returns, for each peer, whether the cross correlation was performed
+ */
+vector<bool> HypoDD::_xcorrPhases(const Event &event1,
+                                  const Phase &phase1,
+                                  Waveform::LoaderPtr ph1Cache,
+                                  const vector<PhasePeer> &peers,
+                                  Waveform::LoaderPtr ph2Cache,
+                                  vector<double> &coeffOut,
+                                  vector<double> &lagOut)
 {
-  coeffOut = lagOut = 0;
+  vector<bool> performed(peers.size(), false);
+  coeffOut.assign(peers.size(), 0);
+  lagOut.assign(peers.size(), 0);
 
   auto xcorrCfg = _cfg.xcorr.at(phase1.procInfo.type);
 
-  Core::TimeWindow tw1 = xcorrTimeWindowLong(phase1);
-  Core::TimeWindow tw2 = xcorrTimeWindowLong(phase2);
-
   // load the long trace 1, because we want to cache the long version. Then
   // we'll trim it.
-  GenericRecordCPtr tr1 = getWaveform(tw1, event1, phase1, ph1Cache);
+  GenericRecordCPtr tr1 =
+      getWaveform(xcorrTimeWindowLong(phase1), event1, phase1, ph1Cache);
   if (!tr1)
   {
-    return false;
+    return performed;
   }
 
-  // load the long trace 2, because we want to cache the long version. Then
-  // we'll trim it
-  GenericRecordCPtr tr2 = getWaveform(tw2, event2, phase2, ph2Cache);
-  if (!tr2)
+  // trust the manual pick on phase 2 (direction A): keep trace2 short and
+  // xcorr it with a larger trace1 window.
+  // trust the manual pick on phase 1 (direction B): keep trace1 short and
+  // xcorr it with a larger trace2 window
+  vector<bool> useA(peers.size()), useB(peers.size());
+  bool anyB = false;
+  for (size_t i = 0; i < peers.size(); i++)
   {
-    return false;
+    const Phase &phase2 = peers[i].second;
+    useA[i] = phase2.isManual || (!phase1.isManual && !phase2.isManual);
+    useB[i] = phase1.isManual || (!phase1.isManual && !phase2.isManual);
+    anyB    = anyB || useB[i];
   }
 
-  // trust the manual pick on phase 2: keet trace2 short and xcorr it with
-  // a larger trace1 window
-  double xcorr_coeff = 0, xcorr_lag = 0;
-
-  if (phase2.isManual || (!phase1.isManual && !phase2.isManual))
+  // trim tr1 to shorter length, we want to cross correlate the short with the
+  // long one. The short windows are views of the long traces, which are kept
+  // alive by tr1 and tr2s
+  Waveform::TraceView tr1Short;
+  if (anyB)
   {
-    // trim tr2 to shorter length, we want to cross correlate the short with the
-    // long one
-    GenericRecordPtr tr2Short = new GenericRecord(*tr2);
-    Core::TimeWindow tw2Short = xcorrTimeWindowShort(phase2);
-    if (!Waveform::trim(*tr2Short, tw2Short))
+    tr1Short = Waveform::TraceView(*tr1);
+    if (!Waveform::trim(tr1Short, xcorrTimeWindowShort(phase1)))
     {
-      SEISCOMP_DEBUG("Cannot trim phase2 waveform, skipping cross correlation "
-                     "for phase pair phase1='%s', phase2='%s'",
-                     string(phase1).c_str(), string(phase2).c_str());
-      return false;
+      SEISCOMP_DEBUG("Cannot trim phase1 waveform, skipping cross correlation "
+                     "for phase1='%s'", string(phase1).c_str());
+      tr1Short = Waveform::TraceView();
     }
+  }
+
+  vector<GenericRecordCPtr> tr2s;
+  vector<Waveform::TraceView> tr2Shorts, tr2Longs;
+  vector<size_t> idxA, idxB;
+  for (size_t i = 0; i < peers.size(); i++)
+  {
+    const Event &event2 = peers[i].first;
+    const Phase &phase2 = peers[i].second;
+
+    if (useB[i] && !tr1Short.trace) continue;
 
-    if (!Waveform::xcorr(tr1, tr2Short, xcorrCfg.maxDelay, true, xcorr_lag,
-                         xcorr_coeff))
+    // load the long trace 2, because we want to cache the long version. Then
+    // we'll trim it
+    GenericRecordCPtr tr2 =
+        getWaveform(xcorrTimeWindowLong(phase2), event2, phase2, ph2Cache);
+    if (!tr2)
     {
-      return false;
+      continue;
     }
-  }
-
-  // trust the manual pick on phase 1: keet trace1 short and xcorr it with
-  // a larger trace2 window
-  double xcorr_coeff2 = 0, xcorr_lag2 = 0;
+    tr2s.push_back(tr2);
 
-  if (phase1.isManual || (!phase1.isManual && !phase2.isManual))
-  {
-    // trim tr1 to shorter length, we want to cross correlate the short with the
-    // long one
-    GenericRecordPtr tr1Short = new GenericRecord(*tr1);
-    Core::TimeWindow tw1Short = xcorrTimeWindowShort(phase1);
-    if (!Waveform::trim(*tr1Short, tw1Short))
+    if (useA[i])
     {
-      SEISCOMP_DEBUG("Cannot trim phase1 waveform, skipping cross correlation "
-                     "for phase pair phase1='%s', phase2='%s'",
-                     string(phase1).c_str(), string(phase2).c_str());
-      return false;
+      // trim tr2 to shorter length, we want to cross correlate the short with
+      // the long one
+      Waveform::TraceView tr2Short(*tr2);
+      if (!Waveform::trim(tr2Short, xcorrTimeWindowShort(phase2)))
+      {
+        SEISCOMP_DEBUG(
+            "Cannot trim phase2 waveform, skipping cross correlation "
+            "for phase pair phase1='%s', phase2='%s'",
+            string(phase1).c_str(), string(phase2).c_str());
+        continue;
+      }
+      tr2Shorts.push_back(tr2Short);
+      idxA.push_back(i);
     }
 
-    if (!Waveform::xcorr(tr1Short, tr2, xcorrCfg.maxDelay, true, xcorr_lag2,
-                         xcorr_coeff2))
+    if (useB[i])
     {
-      return false;
+      tr2Longs.push_back(Waveform::TraceView(*tr2));
+      idxB.push_back(i);
     }
+
+    performed[i] = true;
+  }
+
+  vector<Waveform::XCorrResult> resultsA =
+      Waveform::xcorr(Waveform::TraceView(*tr1), tr2Shorts, xcorrCfg.maxDelay,
+                      true, _cfg.ddObservations2.xcorrEngine);
+  for (size_t j = 0; j < idxA.size(); j++)
+  {
+    const size_t i = idxA[j];
+    performed[i]   = performed[i] && resultsA[j].performed;
+    coeffOut[i]    = resultsA[j].coeff;
+    lagOut[i]      = resultsA[j].delay;
   }
 
-  if (std::abs(xcorr_coeff2) > std::abs(xcorr_coeff))
+  if (tr1Short.trace)
   {
-    // swap
-    xcorr_coeff = xcorr_coeff2;
-    xcorr_lag   = xcorr_lag2;
+    vector<Waveform::XCorrResult> resultsB =
+        Waveform::xcorr(tr1Short, tr2Longs, xcorrCfg.maxDelay, true,
+                        _cfg.ddObservations2.xcorrEngine);
+    for (size_t j = 0; j < idxB.size(); j++)
+    {
+      const size_t i = idxB[j];
+      performed[i]   = performed[i] && resultsB[j].performed;
+      if (std::abs(resultsB[j].coeff) > std::abs(coeffOut[i]))
+      {
+        // swap
+        coeffOut[i] = resultsB[j].coeff;
+        lagOut[i]   = resultsB[j].delay;
+      }
+    }
   }
 
-  coeffOut = xcorr_coeff;
-  lagOut   = xcorr_lag;
+  for (size_t i = 0; i < peers.size(); i++)
+  {
+    if (!performed[i]) coeffOut[i] = lagOut[i] = 0;
+  }
 
-  return true;
+  return performed;
 }
 
 GenericRecordCPtr HypoDD::getWaveform(const Core::TimeWindow &tw,
@@ -2124,9 +2779,12 @@ GenericRecordCPtr HypoDD::getWaveform(const Core::TimeWindow &tw,
 
   // Check if we have already excluded the trace because we couldn't load it
   // (save time)
-  if (_unloadableWfs.count(wfId) != 0)
   {
-    return nullptr;
+    std::lock_guard<std::mutex> lock(_unloadableWfsMutex);
+    if (_unloadableWfs.count(wfId) != 0)
+    {
+      return nullptr;
+    }
   }
 
   // try to load the waveform
@@ -2135,6 +2793,7 @@ GenericRecordCPtr HypoDD::getWaveform(const Core::TimeWindow &tw,
 
   if (!trace)
   {
+    std::lock_guard<std::mutex> lock(_unloadableWfsMutex);
     _unloadableWfs.insert(wfId);
     return nullptr;
   }
@@ -2142,6 +2801,44 @@ GenericRecordCPtr HypoDD::getWaveform(const Core::TimeWindow &tw,
   return trace;
 }
 
+vector<GenericRecordCPtr>
+HypoDD::getWaveforms(const vector<Waveform::Loader::Request> &requests,
+                     Waveform::LoaderPtr wfLoader)
+{
+  vector<GenericRecordCPtr> traces(requests.size());
+
+  // Skip the traces we have already excluded because we couldn't load them
+  vector<size_t> toLoadIdx;
+  vector<Waveform::Loader::Request> toLoad;
+  vector<string> wfIds(requests.size());
+  {
+    std::lock_guard<std::mutex> lock(_unloadableWfsMutex);
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+      wfIds[i] = Waveform::waveformId(*requests[i].ph, requests[i].tw);
+      if (_unloadableWfs.count(wfIds[i]) != 0) continue;
+      toLoadIdx.push_back(i);
+      toLoad.push_back(requests[i]);
+    }
+  }
+
+  // try to load the waveforms
+  vector<GenericRecordCPtr> loaded = wfLoader->get(
+      toLoad, true, _cfg.wfFilter.filterStr, _cfg.wfFilter.resampleFreq);
+
+  std::lock_guard<std::mutex> lock(_unloadableWfsMutex);
+  for (size_t j = 0; j < toLoad.size(); j++)
+  {
+    const size_t i = toLoadIdx[j];
+    if (!loaded[j])
+      _unloadableWfs.insert(wfIds[i]);
+    else
+      traces[i] = loaded[j];
+  }
+
+  return traces;
+}
+
 namespace {
 
 struct XCorrEvalStats
@@ -2286,7 +2983,7 @@ void HypoDD::evalXCorr()
           _cfg.ddObservations2.minEStoIEratio, _cfg.ddObservations2.minDTperEvt,
           _cfg.ddObservations2.maxDTperEvt, _cfg.ddObservations2.minNumNeigh,
           _cfg.ddObservations2.maxNumNeigh, _cfg.ddObservations2.numEllipsoids,
-          _cfg.ddObservations2.maxEllipsoidSize, false);
+          _cfg.ddObservations2.maxEllipsoidSize, false, _bgCatIndex.get());
     }
     catch (...)
     {
@@ -2434,5 +3131,52 @@ void HypoDD::evalXCorr()
   printCounters();
 }
 
+void HypoDD::precomputeCatalogXCorr()
+{
+  if (!_xcorrArchive)
+  {
+    throw runtime_error("Cannot precompute the catalog cross-correlations: "
+                        "the catalog cross-correlation store is not enabled");
+  }
+
+  resetCounters();
+  unsigned loop = 0;
+
+  for (const auto &kv : _bgCat->getEvents())
+  {
+    const Event &event = kv.second;
+
+    // find the neighbouring events, as the relocations do
+    NeighboursPtr neighbours;
+    try
+    {
+      neighbours = selectNeighbouringEvents(
+          _bgCat, event, _bgCat, _cfg.ddObservations2.minWeight,
+          _cfg.ddObservations2.minESdist, _cfg.ddObservations2.maxESdist,
+          _cfg.ddObservations2.minEStoIEratio, _cfg.ddObservations2.minDTperEvt,
+          _cfg.ddObservations2.maxDTperEvt, _cfg.ddObservations2.minNumNeigh,
+          _cfg.ddObservations2.maxNumNeigh, _cfg.ddObservations2.numEllipsoids,
+          _cfg.ddObservations2.maxEllipsoidSize, false, _bgCatIndex.get());
+    }
+    catch (...)
+    {
+      continue;
+    }
+
+    // the results are stored by xcorrPhases
+    CatalogPtr catalog = neighbours->toCatalog(_bgCat, true);
+    XCorrCache xcorr;
+    buildXcorrDiffTTimePairs(catalog, neighbours, event, xcorr);
+
+    if (++loop % 100 == 0)
+    {
+      SEISCOMP_INFO("Catalog cross-correlations computed for %u/%zu events",
+                    loop, _bgCat->getEvents().size());
+    }
+  }
+
+  printCounters();
+}
+
 } // namespace HDD
 } // namespace Seiscomp
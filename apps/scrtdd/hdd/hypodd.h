@@ -20,14 +20,19 @@
 
 #include "catalog.h"
 #include "clustering.h"
+#include "packedarchive.h"
 #include "solver.h"
+#include "threadpool.h"
 #include "ttt.h"
 #include "waveform.h"
 #include "xcorrcache.ipp"
 
 #include <seiscomp3/core/baseobject.h>
 
+#include <atomic>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -41,6 +46,13 @@ struct Config
   std::vector<std::string> validPphases = {"Pg", "P", "Px"};
   std::vector<std::string> validSphases = {"Sg", "S", "Sx"};
 
+  // number of threads used by the parallel computations (0 = all CPUs)
+  unsigned workerThreads = 1;
+
+  // max number of waveform requests loaded concurrently when preloading the
+  // catalog data
+  unsigned wfPrefetchRequests = 4;
+
   // Absolute travel time difference observations only
   struct
   {
@@ -87,8 +99,9 @@ struct Config
     double maxEllipsoidSize = 10; // km
 
     //  cross-correlation specific
-    double xcorrMaxEvStaDist   = -1; // max event to station distance
-    double xcorrMaxInterEvDist = -1; // max inter-event distance
+    double xcorrMaxEvStaDist          = -1; // max event to station distance
+    double xcorrMaxInterEvDist        = -1; // max inter-event distance
+    Waveform::XCorrEngine xcorrEngine = Waveform::XCorrEngine::AUTO;
     std::string recordStreamURL;
   } ddObservations2;
 
@@ -118,16 +131,41 @@ struct Config
     double signalEnd   = 0;
   } snr;
 
+  struct
+  {
+    // memory used by the catalog waveforms kept in memory (0 = no limit):
+    // the least recently used ones are evicted and reloaded from disk
+    size_t memoryBudget = 0; // bytes
+    // store the processed catalog waveforms on disk too, keyed by the
+    // processing settings
+    bool storeProcessed = false;
+    // don't request again from the record stream the catalog waveforms that
+    // were not available, for this long (0 = always request them again)
+    double unavailableTTL = 0; // secs
+    // store on disk the results of the cross-correlations between catalog
+    // phases, keyed by the xcorr settings, and reuse them instead of
+    // computing them again
+    bool storeCatalogXCorr = false;
+  } wfCache;
+
   struct
   {
     std::string type  = "LOCSAT";
     std::string model = "iasp91";
+    // precomputed per-station travel time grids (see TravelTimeTable)
+    bool useGrids           = false;
+    bool precomputeGrids    = false; // build them all at startup
+    double gridDepthStep    = 1;   // km
+    double gridMaxDepth     = 40;  // km
+    double gridDistanceStep = 2;   // km
+    double gridMaxDistance  = 300; // km
   } ttt;
 
   struct
   {
     std::string type                               = "LSMR"; // LSMR or LSQR
     bool L2normalization                           = true;
+    bool blockJacobi                               = false;
     unsigned solverIterations                      = 0;
     unsigned algoIterations                        = 20;
     double dampingFactorStart                      = 0.;
@@ -141,6 +179,16 @@ struct Config
     bool usePickUncertainty             = false;
     double absTTDiffObsWeight           = 1.0;
     double xcorrObsWeight               = 1.0;
+    // use workerThreads for the LSQR/LSMR matrix-vector products
+    bool multiThreaded = false;
+    // stop before algoIterations when, between two iterations, no event
+    // location changed more than convergenceLocChange, no origin time more
+    // than convergenceTimeChange and no event rms more than
+    // convergenceRmsChange (0 disables a criterion). One last iteration with
+    // the final values of the start/end parameters is performed first
+    double convergenceLocChange  = 0; // km
+    double convergenceTimeChange = 0; // secs
+    double convergenceRmsChange  = 0; // secs
   } solver;
 };
 
@@ -163,6 +211,9 @@ public:
   CatalogPtr relocateCatalog();
   CatalogPtr relocateSingleEvent(const CatalogCPtr &orgToRelocate);
   void evalXCorr();
+  // cross-correlate the catalog events with their neighbours and store the
+  // results, so that they are not computed again (wfCache.storeCatalogXCorr)
+  void precomputeCatalogXCorr();
 
   void setWorkingDirCleanup(bool cleanup) { _workingDirCleanup = cleanup; }
   bool workingDirCleanup() const { return _workingDirCleanup; }
@@ -182,6 +233,13 @@ public:
   void setUseArtificialPhases(bool use) { _useArtificialPhases = use; }
   bool useArtificialPhases() const { return _useArtificialPhases; }
 
+  // the waveforms of the events to relocate are read from this buffer of
+  // real-time records, when available there (nullptr disables it)
+  void setRecordBuffer(Waveform::RecordBufferPtr buffer)
+  {
+    _recordBuffer = buffer;
+  }
+
   static std::string relocationReport(const CatalogCPtr &relocatedEv);
 
 private:
@@ -190,6 +248,7 @@ private:
   std::string generateWorkingSubDir(const Catalog::Event &ev) const;
 
   CatalogPtr relocateEventSingleStep(const CatalogCPtr bgCat,
+                                     const EventSpatialIndex *bgCatIndex,
                                      const CatalogCPtr &evToRelocateCat,
                                      const std::string &workingDir,
                                      bool doXcorr,
@@ -233,13 +292,41 @@ private:
     std::unordered_map<std::string, Entry> _entries;
   };
 
+  // The double-difference observations of a relocation. They are collected
+  // once from the catalog, the neighbours and the xcorr results, then every
+  // solver iteration only updates their travel times and weights
+  struct ObservationGraph
+  {
+    struct PhaseNode
+    {
+      unsigned eventIdx;               // index in eventIds
+      const Catalog::Phase *phase;     // owned by the relocated catalog
+      const Catalog::Station *station; // owned by the relocated catalog
+    };
+    struct Observation
+    {
+      unsigned refPhaseIdx; // index in phases
+      unsigned phaseIdx;    // index in phases
+      double aPrioriWeight; // before the observation type weighting
+      double xcorrLag;
+      bool isXcorr;
+    };
+    std::vector<unsigned> eventIds;
+    std::vector<PhaseNode> phases;
+    std::vector<Observation> observations;
+  };
+
+  ObservationGraph
+  buildObservationGraph(const CatalogCPtr &catalog,
+                        const std::list<NeighboursPtr> &neighCluster,
+                        const XCorrCache &xcorr) const;
+
   void addObservations(Solver &solver,
                        double absTTDiffObsWeight,
                        double xcorrObsWeight,
                        const CatalogCPtr &catalog,
-                       const NeighboursPtr &neighbours,
+                       const ObservationGraph &graph,
                        bool keepNeighboursFixed,
-                       const XCorrCache &xcorr,
                        ObservationParams &obsparams) const;
 
   CatalogPtr
@@ -248,10 +335,17 @@ private:
                         const std::list<NeighboursPtr> &neighbourCats,
                         ObservationParams &obsparams) const;
 
+  bool hasConverged(const CatalogCPtr &prevCatalog,
+                    const CatalogCPtr &currCatalog,
+                    const std::list<NeighboursPtr> &neighCluster,
+                    bool compareRms) const;
+
   CatalogPtr updateRelocatedEventsFinalStats(
       const CatalogCPtr &startingCatalog,
       const CatalogCPtr &finalCatalog,
-      const std::list<NeighboursPtr> &neighCluster) const;
+      const std::list<NeighboursPtr> &neighCluster,
+      unsigned iterations,
+      bool converged) const;
 
   void addMissingEventPhases(const Catalog::Event &refEv,
                              CatalogPtr &refEvCatalog,
@@ -297,23 +391,27 @@ private:
                  const Catalog::Event &refEv,
                  XCorrCache &xcorr);
 
-  bool xcorrPhases(const Catalog::Event &event1,
-                   const Catalog::Phase &phase1,
-                   Waveform::LoaderPtr ph1Cache,
-                   const Catalog::Event &event2,
-                   const Catalog::Phase &phase2,
-                   Waveform::LoaderPtr ph2Cache,
-                   double &coeffOut,
-                   double &lagOut);
-
-  bool _xcorrPhases(const Catalog::Event &event1,
-                    const Catalog::Phase &phase1,
-                    Waveform::LoaderPtr ph1Cache,
-                    const Catalog::Event &event2,
-                    const Catalog::Phase &phase2,
-                    Waveform::LoaderPtr ph2Cache,
-                    double &coeffOut,
-                    double &lagOut);
+  std::string commonChannelCodeRoot(const Catalog::Phase &phase1,
+                                    const Catalog::Phase &phase2) const;
+
+  std::vector<bool> xcorrPhases(const Catalog::Event &event1,
+                                const Catalog::Phase &phase1,
+                                Waveform::LoaderPtr ph1Cache,
+                                const std::vector<PhasePeer> &peers,
+                                Waveform::LoaderPtr ph2Cache,
+                                std::vector<double> &coeffOut,
+                                std::vector<double> &lagOut);
+
+  std::vector<bool> _xcorrPhases(const Catalog::Event &event1,
+                                 const Catalog::Phase &phase1,
+                                 Waveform::LoaderPtr ph1Cache,
+                                 const std::vector<PhasePeer> &peers,
+                                 Waveform::LoaderPtr ph2Cache,
+                                 std::vector<double> &coeffOut,
+                                 std::vector<double> &lagOut);
+
+  std::string xcorrStoreKey(const Catalog::Phase &phase1,
+                            const Catalog::Phase &phase2) const;
 
   Core::TimeWindow xcorrTimeWindowLong(const Catalog::Phase &phase) const;
 
@@ -324,8 +422,14 @@ private:
                                 const Catalog::Phase &ph,
                                 Waveform::LoaderPtr wfLoader);
 
+  // like getWaveform, but the waveforms are loaded all together
+  std::vector<GenericRecordCPtr>
+  getWaveforms(const std::vector<Waveform::Loader::Request> &requests,
+               Waveform::LoaderPtr wfLoader);
+
   void resetCounters();
   void printCounters() const;
+  void printMemCacheCounters() const;
   void updateCounters() const
   {
     updateCounters(_wfDiskCache, _wfSnrFilter, _wfMemCache);
@@ -339,10 +443,12 @@ private:
   std::string _workingDir;
   std::string _cacheDir;
   std::string _tmpCacheDir;
+  std::string _tttGridDir;
   std::string _wfDebugDir;
 
   CatalogCPtr _srcCat;
   CatalogCPtr _bgCat;
+  EventSpatialIndexCPtr _bgCatIndex;
 
   const Config _cfg;
 
@@ -352,28 +458,38 @@ private:
 
   bool _useArtificialPhases = true;
 
+  Waveform::RecordBufferPtr _recordBuffer;
+
   HDD::TravelTimeTablePtr _ttt;
 
   Waveform::DiskCachedLoaderPtr _wfDiskCache;
   Waveform::SnrFilteredLoaderPtr _wfSnrFilter;
   Waveform::MemCachedLoaderPtr _wfMemCache;
 
+  // results of the cross-correlations between catalog phases
+  std::shared_ptr<PackedArchive> _xcorrArchive;
+
   std::unordered_set<std::string> _unloadableWfs;
+  std::mutex _unloadableWfsMutex;
+
+  std::unique_ptr<ThreadPool> _threadPool;
 
+  // atomic, since they are updated by the cross-correlation worker threads
   struct
   {
-    unsigned xcorr_performed;
-    unsigned xcorr_performed_theo;
-    unsigned xcorr_performed_s;
-    unsigned xcorr_performed_s_theo;
-    unsigned xcorr_good_cc;
-    unsigned xcorr_good_cc_theo;
-    unsigned xcorr_good_cc_s;
-    unsigned xcorr_good_cc_s_theo;
-    unsigned wf_downloaded;
-    unsigned wf_no_avail;
-    unsigned wf_disk_cached;
-    unsigned wf_snr_low;
+    std::atomic<unsigned> xcorr_performed;
+    std::atomic<unsigned> xcorr_performed_theo;
+    std::atomic<unsigned> xcorr_performed_s;
+    std::atomic<unsigned> xcorr_performed_s_theo;
+    std::atomic<unsigned> xcorr_good_cc;
+    std::atomic<unsigned> xcorr_good_cc_theo;
+    std::atomic<unsigned> xcorr_good_cc_s;
+    std::atomic<unsigned> xcorr_good_cc_s_theo;
+    std::atomic<unsigned> xcorr_stored; // reused from _xcorrArchive
+    std::atomic<unsigned> wf_downloaded;
+    std::atomic<unsigned> wf_no_avail;
+    std::atomic<unsigned> wf_disk_cached;
+    std::atomic<unsigned> wf_snr_low;
   } mutable _counters;
 
   // For waveforms that are cached to disk store at least DISK_TRACE_MIN_LEN
@@ -384,6 +500,17 @@ private:
   // This is a little overhead for the disk space but saves lot of precious user
   // time
   static constexpr const double DISK_TRACE_MIN_LEN = 10;
+
+  // Number of waveforms requested together to the record stream when
+  // preloading the catalog data
+  static constexpr const unsigned PRELOAD_BATCH_SIZE = 1000;
+
+  // How often (secs) the preloading progress is logged
+  static constexpr const double PRELOAD_PROGRESS_INTERVAL = 30;
+
+  // To be increased when the cross-correlation changes its results, so that
+  // the catalog results stored by the previous versions are not used anymore
+  static constexpr const unsigned XCORR_STORE_VERSION = 1;
 };
 
 } // namespace HDD
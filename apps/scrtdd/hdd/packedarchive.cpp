@@ -0,0 +1,541 @@
+/***************************************************************************
+ *   Copyright (C) by ETHZ/SED                                             *
+ *                                                                         *
+ * This program is free software: you can redistribute it and/or modify    *
+ * it under the terms of the GNU Affero General Public License as published*
+ * by the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                     *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ * GNU Affero General Public License for more details.                     *
+ *                                                                         *
+ *                                                                         *
+ *   Developed by Luca Scarabello <luca.scarabello@sed.ethz.ch>            *
+ ***************************************************************************/
+
+#include "packedarchive.h"
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SEISCOMP_COMPONENT HDD
+#include <seiscomp3/logging/log.h>
+
+using namespace std;
+
+namespace {
+
+// The index is a log of entries following this header. Each entry is:
+//   keyLength (uint32), segment (uint32), offset (uint64), length (uint64),
+//   key (keyLength bytes), checksum (uint32) of the previous fields
+// The values are stored in native byte order, the archive is a local cache
+const char INDEX_MAGIC[8] = {'H', 'D', 'D', 'P', 'A', 'K', '0', '1'};
+
+const size_t ENTRY_HEADER_SIZE = 4 + 4 + 8 + 8;
+
+const uint64_t MAX_SEGMENT_SIZE = uint64_t(1) << 30; // 1 GiB
+
+// FNV-1a
+uint32_t checksum(const char *data, size_t size)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; i++)
+  {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+bool pwriteAll(int fd, const char *data, size_t size, uint64_t offset)
+{
+  while (size > 0)
+  {
+    const ssize_t written = ::pwrite(fd, data, size, offset);
+    if (written < 0)
+    {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += written;
+    size -= written;
+    offset += written;
+  }
+  return true;
+}
+
+bool preadAll(int fd, char *data, size_t size, uint64_t offset)
+{
+  while (size > 0)
+  {
+    const ssize_t read = ::pread(fd, data, size, offset);
+    if (read < 0)
+    {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    if (read == 0) return false;
+    data += read;
+    size -= read;
+    offset += read;
+  }
+  return true;
+}
+
+template <typename T> void put(char *&dest, const T &value)
+{
+  std::memcpy(dest, &value, sizeof(T));
+  dest += sizeof(T);
+}
+
+template <typename T> T get(const char *&src)
+{
+  T value;
+  std::memcpy(&value, src, sizeof(T));
+  src += sizeof(T);
+  return value;
+}
+
+std::string indexEntry(const std::string &key,
+                       uint32_t segId,
+                       uint64_t offset,
+                       uint64_t length)
+{
+  std::string entry(ENTRY_HEADER_SIZE + key.size() + 4, '\0');
+  char *dest = &entry[0];
+  put<uint32_t>(dest, key.size());
+  put<uint32_t>(dest, segId);
+  put<uint64_t>(dest, offset);
+  put<uint64_t>(dest, length);
+  std::memcpy(dest, key.data(), key.size());
+  dest += key.size();
+  put<uint32_t>(dest, checksum(entry.data(), ENTRY_HEADER_SIZE + key.size()));
+  return entry;
+}
+
+} // namespace
+
+namespace Seiscomp {
+namespace HDD {
+
+std::shared_ptr<PackedArchive> PackedArchive::open(const std::string &directory)
+{
+  static std::mutex registryMutex;
+  static std::unordered_map<string, std::weak_ptr<PackedArchive>> registry;
+
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(directory, ec);
+  const string path = boost::filesystem::canonical(directory, ec).string();
+  if (ec)
+  {
+    string msg = "Unable to create archive directory: " + directory;
+    throw runtime_error(msg);
+  }
+
+  std::lock_guard<std::mutex> lock(registryMutex);
+  std::shared_ptr<PackedArchive> archive = registry[path].lock();
+  if (!archive)
+  {
+    archive.reset(new PackedArchive(path, MAX_SEGMENT_SIZE));
+    registry[path] = archive;
+  }
+  return archive;
+}
+
+PackedArchive::PackedArchive(const std::string &directory,
+                             uint64_t maxSegmentSize)
+    : _directory(directory), _maxSegmentSize(maxSegmentSize), _readOnly(false),
+      _lockFd(-1), _indexFd(-1), _indexSize(0)
+{
+  // The writer lock is taken on a separate file, since compact() replaces
+  // the index file
+  const string lockPath =
+      (boost::filesystem::path(_directory) / "lock").string();
+  _lockFd = ::open(lockPath.c_str(), O_RDWR | O_CREAT, 0644);
+  if (_lockFd < 0)
+    _readOnly = true;
+  else if (::flock(_lockFd, LOCK_EX | LOCK_NB) != 0)
+  {
+    SEISCOMP_WARNING("Archive %s is in use by another process, it will be "
+                     "read-only",
+                     _directory.c_str());
+    _readOnly = true;
+  }
+
+  const string indexPath =
+      (boost::filesystem::path(_directory) / "index").string();
+  _indexFd = ::open(indexPath.c_str(),
+                    _readOnly ? O_RDONLY : (O_RDWR | O_CREAT), 0644);
+  if (_indexFd < 0 && !_readOnly)
+  {
+    _readOnly = true;
+    _indexFd  = ::open(indexPath.c_str(), O_RDONLY);
+  }
+  if (_indexFd < 0)
+  {
+    if (_lockFd >= 0) ::close(_lockFd);
+    string msg = "Unable to open archive index: " + indexPath;
+    throw runtime_error(msg);
+  }
+
+  try
+  {
+    loadIndex();
+  }
+  catch (...)
+  {
+    ::close(_indexFd);
+    if (_lockFd >= 0) ::close(_lockFd);
+    throw;
+  }
+}
+
+PackedArchive::~PackedArchive()
+{
+  for (Segment &seg : _segments)
+  {
+    if (seg.map) ::munmap(seg.map, seg.mapSize);
+    if (seg.fd >= 0) ::close(seg.fd);
+  }
+  for (const Mapping &m : _retiredMaps) ::munmap(m.addr, m.size);
+  ::close(_indexFd);
+  if (_lockFd >= 0) ::close(_lockFd);
+}
+
+void PackedArchive::loadIndex()
+{
+  struct stat st;
+  if (::fstat(_indexFd, &st) != 0)
+    throw runtime_error("Unable to read archive index in " + _directory);
+
+  string buffer(st.st_size, '\0');
+  if (!preadAll(_indexFd, &buffer[0], buffer.size(), 0))
+    throw runtime_error("Unable to read archive index in " + _directory);
+
+  if (buffer.empty())
+  {
+    if (!_readOnly)
+    {
+      if (!pwriteAll(_indexFd, INDEX_MAGIC, sizeof(INDEX_MAGIC), 0))
+        throw runtime_error("Unable to write archive index in " + _directory);
+      _indexSize = sizeof(INDEX_MAGIC);
+    }
+    return;
+  }
+
+  if (buffer.size() < sizeof(INDEX_MAGIC) ||
+      std::memcmp(buffer.data(), INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)
+  {
+    throw runtime_error("Unknown archive index format in " + _directory);
+  }
+
+  // Load the entries up to the first incomplete or corrupted one (e.g. the
+  // process was killed while writing it) or the first one referring to data
+  // not entirely written
+  size_t pos = sizeof(INDEX_MAGIC);
+  while (pos + ENTRY_HEADER_SIZE <= buffer.size())
+  {
+    const char *entry      = buffer.data() + pos;
+    const char *src        = entry;
+    const uint32_t keyLen  = get<uint32_t>(src);
+    const uint32_t segId   = get<uint32_t>(src);
+    const uint64_t offset  = get<uint64_t>(src);
+    const uint64_t length  = get<uint64_t>(src);
+    const size_t entrySize = ENTRY_HEADER_SIZE + keyLen + 4;
+
+    if (pos + entrySize > buffer.size()) break;
+
+    const char *sumSrc = entry + ENTRY_HEADER_SIZE + keyLen;
+    if (get<uint32_t>(sumSrc) != checksum(entry, ENTRY_HEADER_SIZE + keyLen))
+      break;
+
+    if (offset + length > segment(segId).size) break;
+
+    _index[string(src, keyLen)] = {segId, offset, length};
+    pos += entrySize;
+  }
+
+  if (pos < buffer.size())
+  {
+    SEISCOMP_WARNING("Archive %s: discarding %zu bytes of incomplete index",
+                     _directory.c_str(), buffer.size() - pos);
+    if (!_readOnly && ::ftruncate(_indexFd, pos) != 0)
+      throw runtime_error("Unable to repair archive index in " + _directory);
+  }
+  _indexSize = pos;
+}
+
+std::string PackedArchive::segmentPath(uint32_t id) const
+{
+  return (boost::filesystem::path(_directory) / ("data." + to_string(id)))
+      .string();
+}
+
+PackedArchive::Segment &PackedArchive::segment(uint32_t id) const
+{
+  if (id >= _segments.size()) _segments.resize(id + 1);
+  Segment &seg = _segments[id];
+  if (seg.fd < 0)
+  {
+    seg.fd = ::open(segmentPath(id).c_str(),
+                    _readOnly ? O_RDONLY : (O_RDWR | O_CREAT), 0644);
+    struct stat st;
+    if (seg.fd >= 0 && ::fstat(seg.fd, &st) == 0) seg.size = st.st_size;
+  }
+  return seg;
+}
+
+bool PackedArchive::has(const std::string &key) const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _index.find(key) != _index.end();
+}
+
+size_t PackedArchive::size() const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _index.size();
+}
+
+std::vector<std::string> PackedArchive::keys() const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::vector<std::string> keys;
+  keys.reserve(_index.size());
+  for (const auto &kv : _index) keys.push_back(kv.first);
+  return keys;
+}
+
+const char *PackedArchive::dataOf(const Location &loc) const
+{
+  // Each segment is mapped once, for the maximum segment size: the file
+  // grows into the mapping, so the appended values don't require a new
+  // mapping. A bigger one is needed only by a value exceeding that size
+  Segment &seg = segment(loc.segment);
+  if (loc.offset + loc.length > seg.mapSize)
+  {
+    const uint64_t mapSize = std::max(_maxSegmentSize, seg.size);
+    void *map = ::mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, seg.fd, 0);
+    if (map == MAP_FAILED)
+    {
+      SEISCOMP_WARNING("Archive %s: unable to map %s", _directory.c_str(),
+                       segmentPath(loc.segment).c_str());
+      return nullptr;
+    }
+    if (seg.map) _retiredMaps.push_back({seg.map, seg.mapSize});
+    seg.map     = map;
+    seg.mapSize = mapSize;
+  }
+  return static_cast<const char *>(seg.map) + loc.offset;
+}
+
+bool PackedArchive::read(const std::string &key, std::string &value) const
+{
+  const char *data;
+  uint64_t length;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const auto it = _index.find(key);
+    if (it == _index.end()) return false;
+
+    length = it->second.length;
+    if (length == 0)
+    {
+      value.clear();
+      return true;
+    }
+
+    data = dataOf(it->second);
+    if (!data) return false;
+  }
+
+  // the mapping stays valid until the archive is destroyed and the data of an
+  // entry is never modified, so the copy doesn't need the lock
+  value.assign(data, length);
+  return true;
+}
+
+bool PackedArchive::write(const std::string &key, const std::string &value)
+{
+  if (_readOnly) return false;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  return append(key, value);
+}
+
+bool PackedArchive::insert(const std::string &key, const std::string &value)
+{
+  if (_readOnly) return false;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_index.find(key) != _index.end()) return true;
+  return append(key, value);
+}
+
+bool PackedArchive::append(const std::string &key, const std::string &value)
+{
+  uint32_t segId = _segments.empty() ? 0 : _segments.size() - 1;
+  if (segment(segId).size > 0 &&
+      segment(segId).size + value.size() > _maxSegmentSize)
+    segId++;
+  Segment &seg = segment(segId);
+
+  if (seg.fd < 0)
+  {
+    SEISCOMP_WARNING("Archive %s: unable to open %s", _directory.c_str(),
+                     segmentPath(segId).c_str());
+    return false;
+  }
+
+  // write the value first and then its index entry: an interrupted write
+  // leaves an index entry that is discarded at the next loading
+  const uint64_t offset = seg.size;
+  if (!pwriteAll(seg.fd, value.data(), value.size(), offset))
+  {
+    SEISCOMP_WARNING("Archive %s: unable to write to %s", _directory.c_str(),
+                     segmentPath(segId).c_str());
+    return false;
+  }
+  seg.size += value.size();
+
+  const string entry = indexEntry(key, segId, offset, value.size());
+
+  if (!pwriteAll(_indexFd, entry.data(), entry.size(), _indexSize))
+  {
+    SEISCOMP_WARNING("Archive %s: unable to write the index",
+                     _directory.c_str());
+    return false;
+  }
+  _indexSize += entry.size();
+
+  _index[key] = {segId, offset, value.size()};
+  return true;
+}
+
+size_t PackedArchive::compact(
+    const std::function<bool(const std::string &, const std::string &)> &keep)
+{
+  if (_readOnly) return 0;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  //
+  // Write the kept entries to new segments, after the current ones, and to
+  // a new index. The new index replaces the current one only when it is
+  // complete, so an interruption leaves the archive as it was
+  //
+  const uint32_t firstSegId = _segments.size();
+  uint32_t segId            = firstSegId;
+  uint64_t segSize          = 0;
+  std::vector<int> segFds;
+  std::unordered_map<std::string, Location> index;
+
+  const string indexPath =
+      (boost::filesystem::path(_directory) / "index").string();
+  const string tmpIndexPath = indexPath + ".tmp";
+  int indexFd = ::open(tmpIndexPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  uint64_t indexSize = sizeof(INDEX_MAGIC);
+
+  auto cleanup = [&]() {
+    for (int fd : segFds) ::close(fd);
+    for (uint32_t id = firstSegId; id < firstSegId + segFds.size(); id++)
+      ::unlink(segmentPath(id).c_str());
+    if (indexFd >= 0) ::close(indexFd);
+    ::unlink(tmpIndexPath.c_str());
+  };
+
+  bool ok = indexFd >= 0 &&
+            pwriteAll(indexFd, INDEX_MAGIC, sizeof(INDEX_MAGIC), 0);
+  size_t dropped = 0;
+  for (const auto &kv : _index)
+  {
+    if (!ok) break;
+    const Location &loc = kv.second;
+    const char *data    = loc.length > 0 ? dataOf(loc) : "";
+    if (!data)
+    {
+      ok = false;
+      break;
+    }
+    const string value(data, loc.length);
+    if (!keep(kv.first, value))
+    {
+      dropped++;
+      continue;
+    }
+
+    if (segFds.empty() ||
+        (segSize > 0 && segSize + value.size() > _maxSegmentSize))
+    {
+      if (!segFds.empty()) segId++;
+      segFds.push_back(::open(segmentPath(segId).c_str(),
+                              O_RDWR | O_CREAT | O_TRUNC, 0644));
+      segSize = 0;
+      if (segFds.back() < 0)
+      {
+        ok = false;
+        break;
+      }
+    }
+
+    const string entry = indexEntry(kv.first, segId, segSize, value.size());
+    ok = pwriteAll(segFds.back(), value.data(), value.size(), segSize) &&
+         pwriteAll(indexFd, entry.data(), entry.size(), indexSize);
+    index[kv.first] = {segId, segSize, value.size()};
+    segSize += value.size();
+    indexSize += entry.size();
+  }
+
+  for (int fd : segFds) ok = ok && ::fsync(fd) == 0;
+  ok = ok && ::fsync(indexFd) == 0 &&
+       ::rename(tmpIndexPath.c_str(), indexPath.c_str()) == 0;
+  if (!ok)
+  {
+    SEISCOMP_WARNING("Archive %s: unable to compact", _directory.c_str());
+    cleanup();
+    return 0;
+  }
+
+  //
+  // Switch to the new index and segments. The old segments are removed, but
+  // their mappings are kept for the values being copied by read()
+  //
+  for (uint32_t id = 0; id < firstSegId; id++)
+  {
+    Segment &seg = _segments[id];
+    if (seg.map) _retiredMaps.push_back({seg.map, seg.mapSize});
+    if (seg.fd >= 0) ::close(seg.fd);
+    seg = Segment();
+    ::unlink(segmentPath(id).c_str());
+  }
+  _segments.resize(firstSegId + segFds.size());
+  for (size_t i = 0; i < segFds.size(); i++)
+  {
+    Segment &seg = _segments[firstSegId + i];
+    seg.fd       = segFds[i];
+    struct stat st;
+    if (::fstat(seg.fd, &st) == 0) seg.size = st.st_size;
+  }
+  ::close(_indexFd);
+  _indexFd   = indexFd;
+  _indexSize = indexSize;
+  _index     = std::move(index);
+
+  SEISCOMP_DEBUG("Archive %s: compacted, %zu entries removed",
+                 _directory.c_str(), dropped);
+  return dropped;
+}
+
+} // namespace HDD
+} // namespace Seiscomp
@@ -0,0 +1,132 @@
+/***************************************************************************
+ *   Copyright (C) by ETHZ/SED                                             *
+ *                                                                         *
+ * This program is free software: you can redistribute it and/or modify    *
+ * it under the terms of the GNU Affero General Public License as published*
+ * by the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                     *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ * GNU Affero General Public License for more details.                     *
+ *                                                                         *
+ *                                                                         *
+ *   Developed by Luca Scarabello <luca.scarabello@sed.ethz.ch>            *
+ ***************************************************************************/
+
+#ifndef __HDD_PACKEDARCHIVE_H__
+#define __HDD_PACKEDARCHIVE_H__
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Seiscomp {
+namespace HDD {
+
+/*
+ * Key/value store of binary blobs packed in a few big files, for caches with
+ * many small entries. The values are appended to segment files (data.N) and
+ * their locations to an index log (index). The index is loaded in memory
+ * when the archive is opened, so a lookup never touches the file system, and
+ * the values are read from the memory mapped segments.
+ * Writing an existing key supersedes the previous value, whose space is not
+ * reclaimed.
+ *
+ * Only one process at a time can write to an archive, the others open it
+ * read-only and don't see the entries added or compacted after they opened
+ * it. Within a
+ * process the archive of a directory is shared by all the open() callers.
+ */
+class PackedArchive
+{
+public:
+  static std::shared_ptr<PackedArchive> open(const std::string &directory);
+
+  ~PackedArchive();
+
+  PackedArchive(const PackedArchive &) = delete;
+  PackedArchive &operator=(const PackedArchive &) = delete;
+
+  bool has(const std::string &key) const;
+
+  // return false if key is not in the archive
+  bool read(const std::string &key, std::string &value) const;
+
+  // return false if the archive is read-only or in case of I/O errors
+  bool write(const std::string &key, const std::string &value);
+
+  // like write, but does nothing (and returns true) if the key is already in
+  // the archive, e.g. when concurrent callers store the same value
+  bool insert(const std::string &key, const std::string &value);
+
+  size_t size() const;
+
+  std::vector<std::string> keys() const;
+
+  // Rewrite the archive with only the entries for which keep(key, value)
+  // returns true, reclaiming the space of the other entries and of the
+  // superseded values. Return the number of removed entries (0 if the archive
+  // is read-only)
+  size_t compact(const std::function<bool(const std::string &key,
+                                          const std::string &value)> &keep);
+
+  bool readOnly() const { return _readOnly; }
+
+private:
+  PackedArchive(const std::string &directory, uint64_t maxSegmentSize);
+
+  struct Location
+  {
+    uint32_t segment;
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  struct Segment
+  {
+    int fd           = -1;
+    uint64_t size    = 0; // file size
+    void *map        = nullptr;
+    uint64_t mapSize = 0; // can be bigger than the file, which grows into it
+  };
+
+  struct Mapping
+  {
+    void *addr;
+    uint64_t size;
+  };
+
+  void loadIndex();
+  // the data of an entry, mapping its segment if needed. _mutex must be
+  // locked
+  const char *dataOf(const Location &loc) const;
+  // append the value and its index entry, _mutex must be locked
+  bool append(const std::string &key, const std::string &value);
+  Segment &segment(uint32_t id) const;
+  std::string segmentPath(uint32_t id) const;
+
+  const std::string _directory;
+  const uint64_t _maxSegmentSize;
+  bool _readOnly;
+  int _lockFd;
+  int _indexFd;
+  uint64_t _indexSize; // append position in the index
+
+  mutable std::mutex _mutex;
+  std::unordered_map<std::string, Location> _index;
+  mutable std::vector<Segment> _segments;
+  // Mappings replaced by bigger ones. They are unmapped only when the archive
+  // is destroyed, so that read() can copy the values outside of the lock
+  mutable std::vector<Mapping> _retiredMaps;
+};
+
+} // namespace HDD
+} // namespace Seiscomp
+
+#endif
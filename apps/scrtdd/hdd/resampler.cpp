@@ -0,0 +1,190 @@
+/***************************************************************************
+ *   Copyright (C) by ETHZ/SED                                             *
+ *                                                                         *
+ * This program is free software: you can redistribute it and/or modify    *
+ * it under the terms of the GNU Affero General Public License as published*
+ * by the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                     *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ * GNU Affero General Public License for more details.                     *
+ *                                                                         *
+ *                                                                         *
+ *   Developed by Luca Scarabello <luca.scarabello@sed.ethz.ch>            *
+ ***************************************************************************/
+
+#include "resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+
+// Zero crossings of the sinc on each side of the filter center and Kaiser
+// window parameter (about 80 dB of stop-band attenuation)
+const double KERNEL_ZERO_CROSSINGS = 10;
+const double KAISER_BETA           = 8.6;
+
+// The cutoff frequency is this fraction of the lower Nyquist frequency,
+// which leaves room for the transition band
+const double CUTOFF_ROLLOFF = 0.9;
+
+// Above these the filter banks become too big and slow, the frequencies are
+// probably not meant to be in a rational ratio
+const unsigned MAX_UP   = 1000;
+const unsigned MAX_DOWN = 1000;
+
+// modified Bessel function of the first kind, order 0
+double besselI0(double x)
+{
+  double sum = 1, term = 1;
+  for (int k = 1; k < 50; k++)
+  {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+    if (term < sum * 1e-16) break;
+  }
+  return sum;
+}
+
+unsigned long gcd(unsigned long a, unsigned long b)
+{
+  while (b != 0)
+  {
+    const unsigned long t = a % b;
+    a                     = b;
+    b                     = t;
+  }
+  return a;
+}
+
+} // namespace
+
+namespace Seiscomp {
+namespace HDD {
+
+std::shared_ptr<const Resampler> Resampler::get(double fromFreq, double toFreq)
+{
+  if (fromFreq <= 0 || toFreq <= 0) return nullptr;
+
+  // the frequencies are expressed in mHz to support fractional frequencies
+  const double from = std::round(fromFreq * 1000);
+  const double to   = std::round(toFreq * 1000);
+  if (std::abs(from - fromFreq * 1000) > 1e-6 * from ||
+      std::abs(to - toFreq * 1000) > 1e-6 * to)
+    return nullptr;
+
+  const unsigned long divisor =
+      gcd(static_cast<unsigned long>(from), static_cast<unsigned long>(to));
+  const unsigned long up   = static_cast<unsigned long>(to) / divisor;
+  const unsigned long down = static_cast<unsigned long>(from) / divisor;
+  if (up > MAX_UP || down > MAX_DOWN) return nullptr;
+
+  static std::mutex cacheMutex;
+  static std::map<std::pair<unsigned, unsigned>,
+                  std::shared_ptr<const Resampler>>
+      cache;
+
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  std::shared_ptr<const Resampler> &resampler = cache[{up, down}];
+  if (!resampler) resampler = std::make_shared<Resampler>(up, down);
+  return resampler;
+}
+
+Resampler::Resampler(unsigned up, unsigned down) : _up(up), _down(down)
+{
+  if (up == 0 || down == 0) throw runtime_error("Invalid resampling ratio");
+
+  // prototype filter at the upsampled rate, cutoff in cycles per sample
+  const double cutoff  = CUTOFF_ROLLOFF * 0.5 / std::max(up, down);
+  const int halfLength = std::ceil(KERNEL_ZERO_CROSSINGS / (2 * cutoff));
+  const int length     = 2 * halfLength + 1;
+  const double i0Beta  = besselI0(KAISER_BETA);
+  vector<double> kernel(length);
+  for (int i = 0; i < length; i++)
+  {
+    const double t    = i - halfLength;
+    const double x    = 2 * M_PI * cutoff * t;
+    const double sinc = (t == 0) ? 1 : std::sin(x) / x;
+    const double r    = t / halfLength;
+    const double window =
+        besselI0(KAISER_BETA * std::sqrt(1 - r * r)) / i0Beta;
+    // the gain "up" compensates the zeros inserted by the upsampling
+    kernel[i] = up * 2 * cutoff * sinc * window;
+  }
+
+  // split the taps in phases: phase p contains kernel[p + k * up]
+  _taps  = (length + up - 1) / up;
+  _delay = halfLength;
+  _banks.assign(size_t(up) * _taps, 0);
+  for (unsigned p = 0; p < up; p++)
+  {
+    for (unsigned k = 0; k < _taps; k++)
+    {
+      const size_t i = p + size_t(k) * up;
+      if (i < kernel.size())
+        _banks[size_t(p) * _taps + (_taps - 1 - k)] = kernel[i];
+    }
+  }
+}
+
+size_t Resampler::outputSize(size_t inSize) const
+{
+  return (inSize * _up + _down - 1) / _down;
+}
+
+std::vector<double> Resampler::apply(const double *in, size_t inSize) const
+{
+  vector<double> out(outputSize(inSize));
+  apply(in, inSize, out.data(), 0);
+  return out;
+}
+
+void Resampler::apply(const double *in,
+                      size_t inSize,
+                      double *out,
+                      double bias) const
+{
+  if (inSize == 0) return;
+
+  // Output sample m is at position j = m * down + delay of the upsampled and
+  // filtered sequence, which is
+  //   sum_k phase[j % up][k] * in[j / up - k]
+  // The input is padded so that the inner loop doesn't need bound checks
+  const size_t pad = _taps + (_delay + _up - 1) / _up;
+  vector<double> padded(inSize + 2 * pad);
+  std::fill(padded.begin(), padded.begin() + pad, in[0] - bias);
+  for (size_t i = 0; i < inSize; i++) padded[pad + i] = in[i] - bias;
+  std::fill(padded.begin() + pad + inSize, padded.end(), in[inSize - 1] - bias);
+
+  const size_t outSize = outputSize(inSize);
+  for (size_t m = 0; m < outSize; m++)
+  {
+    const size_t j       = m * _down + _delay;
+    const double *phase  = &_banks[(j % _up) * _taps];
+    const double *sample = &padded[pad + j / _up - (_taps - 1)];
+
+    // independent accumulators let the compiler use SIMD registers
+    double acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+    unsigned k = 0;
+    for (; k + 4 <= _taps; k += 4)
+    {
+      acc0 += phase[k] * sample[k];
+      acc1 += phase[k + 1] * sample[k + 1];
+      acc2 += phase[k + 2] * sample[k + 2];
+      acc3 += phase[k + 3] * sample[k + 3];
+    }
+    for (; k < _taps; k++) acc0 += phase[k] * sample[k];
+    out[m] = (acc0 + acc1) + (acc2 + acc3);
+  }
+}
+
+} // namespace HDD
+} // namespace Seiscomp
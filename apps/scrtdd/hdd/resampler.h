@@ -0,0 +1,74 @@
+/***************************************************************************
+ *   Copyright (C) by ETHZ/SED                                             *
+ *                                                                         *
+ * This program is free software: you can redistribute it and/or modify    *
+ * it under the terms of the GNU Affero General Public License as published*
+ * by the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                     *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ * GNU Affero General Public License for more details.                     *
+ *                                                                         *
+ *                                                                         *
+ *   Developed by Luca Scarabello <luca.scarabello@sed.ethz.ch>            *
+ ***************************************************************************/
+
+#ifndef __HDD_RESAMPLER_H__
+#define __HDD_RESAMPLER_H__
+
+#include <memory>
+#include <vector>
+
+namespace Seiscomp {
+namespace HDD {
+
+/*
+ * Polyphase FIR resampler for rational ratios up/down. The input is
+ * (conceptually) upsampled by "up", low-pass filtered by a Kaiser windowed
+ * sinc, with the cutoff below the lower of the two Nyquist frequencies, and
+ * decimated by "down". Only the filter taps touching non-zero samples are
+ * evaluated: the taps are split in "up" phases, one per output position
+ * relative to the input samples, and each output sample is the dot product
+ * of one phase with consecutive input samples.
+ * The first output sample is aligned with the first input sample.
+ */
+class Resampler
+{
+public:
+  /*
+   * Return the resampler from fromFreq to toFreq, the filter banks are
+   * computed once per frequency pair and shared. Return nullptr when the
+   * ratio of the two frequencies is not a ratio of small integers
+   */
+  static std::shared_ptr<const Resampler> get(double fromFreq, double toFreq);
+
+  Resampler(unsigned up, unsigned down);
+
+  unsigned up() const { return _up; }
+  unsigned down() const { return _down; }
+
+  // ceil(inSize * up / down)
+  size_t outputSize(size_t inSize) const;
+
+  // The samples before and after the input are assumed equal to the first
+  // and last input sample
+  std::vector<double> apply(const double *in, size_t inSize) const;
+
+  // Like above, but the output (outputSize(inSize) samples) is written to
+  // out and bias is subtracted from the input samples while resampling
+  void apply(const double *in, size_t inSize, double *out, double bias) const;
+
+private:
+  const unsigned _up;
+  const unsigned _down;
+  unsigned _taps;             // taps per phase
+  int _delay;                 // filter delay in upsampled samples
+  std::vector<double> _banks; // _up phases of _taps, in reverse order
+};
+
+} // namespace HDD
+} // namespace Seiscomp
+
+#endif
@@ -18,6 +18,7 @@
 #include "solver.h"
 #include "utils.h"
 
+#include <algorithm>
 #include <seiscomp3/core/strings.h>
 #include <seiscomp3/math/geo.h>
 #include <seiscomp3/math/math.h>
@@ -32,6 +33,34 @@ using Seiscomp::Core::stringify;
 
 namespace {
 
+/*
+ * Cholesky decomposition (A = L*L') of a 4x4 symmetric positive definite A.
+ * The lower triangle of A is overwritten by L. Returns false when A is not
+ * (numerically) positive definite
+ */
+bool choleskyDecompose4(double A[4][4])
+{
+  double maxDiag = 0;
+  for (unsigned i = 0; i < 4; i++) maxDiag = std::max(maxDiag, A[i][i]);
+  const double minPivot = maxDiag * 1e-12;
+
+  for (unsigned j = 0; j < 4; j++)
+  {
+    double diag = A[j][j];
+    for (unsigned k = 0; k < j; k++) diag -= A[j][k] * A[j][k];
+    if (!(diag > minPivot)) return false; // catches NaN too
+    A[j][j] = std::sqrt(diag);
+
+    for (unsigned i = j + 1; i < 4; i++)
+    {
+      double val = A[i][j];
+      for (unsigned k = 0; k < j; k++) val -= A[i][k] * A[j][k];
+      A[i][j] = val / A[j][j];
+    }
+  }
+  return true;
+}
+
 /**
  * Common DDSystem adapter for both LSQR and LSMR solvers
  * T can be lsqrBase or lsmrBase
@@ -45,6 +74,12 @@ public:
 
   void setDDSytem(const Seiscomp::HDD::DDSystemPtr &dd) { _dd = dd; }
 
+  // nullptr disables multithreading
+  void setThreadPool(Seiscomp::HDD::ThreadPool *threadPool)
+  {
+    _threadPool = threadPool;
+  }
+
   /*
    * Scale G by normalizing the L2-norm of each column as suggested
    * by LSQR and LSMR solvers
@@ -53,36 +88,37 @@ public:
   {
     std::fill_n(_dd->L2NScaler, _dd->numColsG, 0.);
 
-    for (unsigned int ob = 0; ob < _dd->nObs; ob++)
-    {
-      const double obsW = _dd->W[ob];
-      if (obsW == 0.) continue;
-
-      const unsigned phStaIdx =
-          _dd->phStaByObs[ob]; // station for this observation
-
-      const int evIdx1 = _dd->evByObs[ob][0]; // event 1 for this observation
-      if (evIdx1 >= 0)
+    scatterByChunk(_dd->L2NScaler, _dd->numColsG, [this](unsigned obStart,
+                                                         unsigned obEnd,
+                                                         double *scaler) {
+      for (unsigned int ob = obStart; ob < obEnd; ob++)
       {
-        const unsigned idxG     = evIdx1 * _dd->nPhStas + phStaIdx;
-        const unsigned evOffset = evIdx1 * 4;
-        _dd->L2NScaler[evOffset + 0] += std::pow(_dd->G[idxG][0] * obsW, 2);
-        _dd->L2NScaler[evOffset + 1] += std::pow(_dd->G[idxG][1] * obsW, 2);
-        _dd->L2NScaler[evOffset + 2] += std::pow(_dd->G[idxG][2] * obsW, 2);
-        _dd->L2NScaler[evOffset + 3] += std::pow(_dd->G[idxG][3] * obsW, 2);
-      }
+        const double obsW = _dd->W[ob];
+        if (obsW == 0.) continue;
 
-      const int evIdx2 = _dd->evByObs[ob][1]; // event 2 for this observation
-      if (evIdx2 >= 0)
-      {
-        const unsigned idxG     = evIdx2 * _dd->nPhStas + phStaIdx;
-        const unsigned evOffset = evIdx2 * 4;
-        _dd->L2NScaler[evOffset + 0] += std::pow(_dd->G[idxG][0] * obsW, 2);
-        _dd->L2NScaler[evOffset + 1] += std::pow(_dd->G[idxG][1] * obsW, 2);
-        _dd->L2NScaler[evOffset + 2] += std::pow(_dd->G[idxG][2] * obsW, 2);
-        _dd->L2NScaler[evOffset + 3] += std::pow(_dd->G[idxG][3] * obsW, 2);
+        const int evIdx1 = _dd->evByObs[ob][0]; // event 1 for this observation
+        if (evIdx1 >= 0)
+        {
+          const unsigned idxG     = _dd->idxGByObs[ob][0];
+          const unsigned evOffset = evIdx1 * 4;
+          scaler[evOffset + 0] += std::pow(_dd->G[idxG][0] * obsW, 2);
+          scaler[evOffset + 1] += std::pow(_dd->G[idxG][1] * obsW, 2);
+          scaler[evOffset + 2] += std::pow(_dd->G[idxG][2] * obsW, 2);
+          scaler[evOffset + 3] += std::pow(_dd->G[idxG][3] * obsW, 2);
+        }
+
+        const int evIdx2 = _dd->evByObs[ob][1]; // event 2 for this observation
+        if (evIdx2 >= 0)
+        {
+          const unsigned idxG     = _dd->idxGByObs[ob][1];
+          const unsigned evOffset = evIdx2 * 4;
+          scaler[evOffset + 0] += std::pow(_dd->G[idxG][0] * obsW, 2);
+          scaler[evOffset + 1] += std::pow(_dd->G[idxG][1] * obsW, 2);
+          scaler[evOffset + 2] += std::pow(_dd->G[idxG][2] * obsW, 2);
+          scaler[evOffset + 3] += std::pow(_dd->G[idxG][3] * obsW, 2);
+        }
       }
-    }
+    });
 
     double const *meanShiftWeight = &_dd->W[_dd->nObs];
     if (meanShiftWeight[0] != 0 || meanShiftWeight[1] != 0 ||
@@ -117,6 +153,99 @@ public:
     }
   }
 
+  /*
+   * Block-Jacobi right preconditioner: the solver works on m' = P^-1 * m,
+   * where P is block diagonal with a 4x4 block per event. The block of an
+   * event is the inverse of the transposed Cholesky factor of the event
+   * columns of the weighted G (G'W'WG = L*L', P = L'^-1), so that the event
+   * columns of G*P are orthonormal. Unlike L2normalize, which only scales
+   * the columns, this removes the correlation between the hypocentral
+   * parameters of the same event. Events whose block is not positive definite
+   * fall back to the L2 column scaling.
+   * L2NScaler must be 1 (i.e. don't use L2normalize too)
+   */
+  void blockJacobiPrecondition()
+  {
+    // G'W'WG block of each event (4x4, only the lower triangle is filled)
+    vector<double> blocks(size_t(_dd->nEvts) * 16, 0.);
+
+    scatterByChunk(blocks.data(), blocks.size(), [this](unsigned obStart,
+                                                        unsigned obEnd,
+                                                        double *block) {
+      for (unsigned int ob = obStart; ob < obEnd; ob++)
+      {
+        const double obsW = _dd->W[ob];
+        if (obsW == 0.) continue;
+
+        for (unsigned ev = 0; ev < 2; ev++)
+        {
+          const int evIdx = _dd->evByObs[ob][ev];
+          if (evIdx < 0) continue;
+
+          const double *g = _dd->G[_dd->idxGByObs[ob][ev]];
+          double *evBlock = &block[evIdx * 16];
+          for (unsigned i = 0; i < 4; i++)
+            for (unsigned j = 0; j <= i; j++)
+              evBlock[i * 4 + j] += g[i] * g[j] * obsW * obsW;
+        }
+      }
+    });
+
+    const double *meanShiftWeight = &_dd->W[_dd->nObs];
+    unsigned diagonalBlocks       = 0;
+
+    _blockPrecond.assign(size_t(_dd->nEvts) * 16, 0.);
+    for (unsigned evIdx = 0; evIdx < _dd->nEvts; evIdx++)
+    {
+      double L[4][4];
+      for (unsigned i = 0; i < 4; i++)
+      {
+        for (unsigned j = 0; j <= i; j++)
+          L[i][j] = blocks[evIdx * 16 + i * 4 + j];
+        L[i][i] += std::pow(meanShiftWeight[i], 2);
+      }
+      const double diag[4] = {L[0][0], L[1][1], L[2][2], L[3][3]};
+
+      double *P = &_blockPrecond[evIdx * 16];
+
+      if (!choleskyDecompose4(L))
+      {
+        diagonalBlocks++;
+        for (unsigned k = 0; k < 4; k++)
+          P[k * 4 + k] = diag[k] > 0 ? 1. / std::sqrt(diag[k]) : 1.;
+        continue;
+      }
+
+      // P = L'^-1 is upper triangular: invert L row by row and transpose
+      for (unsigned i = 0; i < 4; i++)
+      {
+        P[i * 4 + i] = 1. / L[i][i];
+        for (unsigned j = 0; j < i; j++)
+        {
+          double val = 0;
+          for (unsigned k = j; k < i; k++) val -= L[i][k] * P[j * 4 + k];
+          P[j * 4 + i] = val / L[i][i];
+        }
+      }
+    }
+
+    if (diagonalBlocks > 0)
+    {
+      SEISCOMP_INFO("Solver: block-Jacobi preconditioner uses column scaling "
+                    "for %u events (singular blocks)",
+                    diagonalBlocks);
+    }
+  }
+
+  /*
+   * Convert the solution m' back to m = P * m'
+   */
+  void blockJacobiDeNormalize()
+  {
+    vector<double> x(_dd->m, _dd->m + _dd->numColsG);
+    applyBlockPrecond(x.data(), _dd->m);
+  }
+
   /**
    * Required by lsqrBase and lsmrBase:
    *
@@ -135,38 +264,55 @@ public:
       throw std::runtime_error(msg.c_str());
     }
 
-    for (unsigned int ob = 0; ob < _dd->nObs; ob++)
+    // with block-Jacobi preconditioning A = G*P: multiply x by P first
+    if (!_blockPrecond.empty())
     {
-      if (_dd->W[ob] == 0.) continue;
-
-      const unsigned phStaIdx =
-          _dd->phStaByObs[ob]; // station for this observation
-      double sum = 0;
+      _precondX.resize(n);
+      applyBlockPrecond(x, _precondX.data());
+      x = _precondX.data();
+    }
 
-      const int evIdx1 = _dd->evByObs[ob][0]; // event 1 for this observation
-      if (evIdx1 >= 0)
+    // each observation is a row of A, so the chunks write disjoint parts of y
+    forEachChunk([this, x, y](unsigned obStart, unsigned obEnd) {
+      for (unsigned int ob = obStart; ob < obEnd; ob++)
       {
-        const unsigned idxG     = evIdx1 * _dd->nPhStas + phStaIdx;
-        const unsigned evOffset = evIdx1 * 4;
-        sum += _dd->G[idxG][0] * _dd->L2NScaler[evOffset + 0] * x[evOffset + 0];
-        sum += _dd->G[idxG][1] * _dd->L2NScaler[evOffset + 1] * x[evOffset + 1];
-        sum += _dd->G[idxG][2] * _dd->L2NScaler[evOffset + 2] * x[evOffset + 2];
-        sum += _dd->G[idxG][3] * _dd->L2NScaler[evOffset + 3] * x[evOffset + 3];
-      }
+        if (_dd->W[ob] == 0.) continue;
 
-      const int evIdx2 = _dd->evByObs[ob][1]; // event 2 for this observation
-      if (evIdx2 >= 0)
-      {
-        const unsigned idxG     = evIdx2 * _dd->nPhStas + phStaIdx;
-        const unsigned evOffset = evIdx2 * 4;
-        sum -= _dd->G[idxG][0] * _dd->L2NScaler[evOffset + 0] * x[evOffset + 0];
-        sum -= _dd->G[idxG][1] * _dd->L2NScaler[evOffset + 1] * x[evOffset + 1];
-        sum -= _dd->G[idxG][2] * _dd->L2NScaler[evOffset + 2] * x[evOffset + 2];
-        sum -= _dd->G[idxG][3] * _dd->L2NScaler[evOffset + 3] * x[evOffset + 3];
-      }
+        double sum = 0;
 
-      y[ob] += _dd->W[ob] * sum;
-    }
+        const int evIdx1 = _dd->evByObs[ob][0]; // event 1 for this observation
+        if (evIdx1 >= 0)
+        {
+          const unsigned idxG     = _dd->idxGByObs[ob][0];
+          const unsigned evOffset = evIdx1 * 4;
+          sum += _dd->G[idxG][0] * _dd->L2NScaler[evOffset + 0] *
+                 x[evOffset + 0];
+          sum += _dd->G[idxG][1] * _dd->L2NScaler[evOffset + 1] *
+                 x[evOffset + 1];
+          sum += _dd->G[idxG][2] * _dd->L2NScaler[evOffset + 2] *
+                 x[evOffset + 2];
+          sum += _dd->G[idxG][3] * _dd->L2NScaler[evOffset + 3] *
+                 x[evOffset + 3];
+        }
+
+        const int evIdx2 = _dd->evByObs[ob][1]; // event 2 for this observation
+        if (evIdx2 >= 0)
+        {
+          const unsigned idxG     = _dd->idxGByObs[ob][1];
+          const unsigned evOffset = evIdx2 * 4;
+          sum -= _dd->G[idxG][0] * _dd->L2NScaler[evOffset + 0] *
+                 x[evOffset + 0];
+          sum -= _dd->G[idxG][1] * _dd->L2NScaler[evOffset + 1] *
+                 x[evOffset + 1];
+          sum -= _dd->G[idxG][2] * _dd->L2NScaler[evOffset + 2] *
+                 x[evOffset + 2];
+          sum -= _dd->G[idxG][3] * _dd->L2NScaler[evOffset + 3] *
+                 x[evOffset + 3];
+        }
+
+        y[ob] += _dd->W[ob] * sum;
+      }
+    });
 
     double *meanShiftWeight = &_dd->W[_dd->nObs];
     if (meanShiftWeight[0] != 0 || meanShiftWeight[1] != 0 ||
@@ -205,36 +351,52 @@ public:
       throw std::runtime_error(msg.c_str());
     }
 
-    for (unsigned int ob = 0; ob < _dd->nObs; ob++)
+    // with block-Jacobi preconditioning A' = P'*G': compute G'*y first
+    double *const xOut = x;
+    if (!_blockPrecond.empty())
     {
-      const double wY = y[ob] * _dd->W[ob];
-      if (wY == 0.) continue;
-
-      const unsigned phStaIdx =
-          _dd->phStaByObs[ob]; // station for this observation
+      _precondX.assign(n, 0.);
+      x = _precondX.data();
+    }
 
-      const int evIdx1 = _dd->evByObs[ob][0]; // event 1 for this observation
-      if (evIdx1 >= 0)
+    scatterByChunk(x, n, [this, y](unsigned obStart, unsigned obEnd,
+                                   double *out) {
+      for (unsigned int ob = obStart; ob < obEnd; ob++)
       {
-        const unsigned idxG     = evIdx1 * _dd->nPhStas + phStaIdx;
-        const unsigned evOffset = evIdx1 * 4;
-        x[evOffset + 0] += _dd->G[idxG][0] * _dd->L2NScaler[evOffset + 0] * wY;
-        x[evOffset + 1] += _dd->G[idxG][1] * _dd->L2NScaler[evOffset + 1] * wY;
-        x[evOffset + 2] += _dd->G[idxG][2] * _dd->L2NScaler[evOffset + 2] * wY;
-        x[evOffset + 3] += _dd->G[idxG][3] * _dd->L2NScaler[evOffset + 3] * wY;
-      }
+        const double wY = y[ob] * _dd->W[ob];
+        if (wY == 0.) continue;
 
-      const int evIdx2 = _dd->evByObs[ob][1]; // event 2 for this observation
-      if (evIdx2 >= 0)
-      {
-        const unsigned idxG     = evIdx2 * _dd->nPhStas + phStaIdx;
-        const unsigned evOffset = evIdx2 * 4;
-        x[evOffset + 0] -= _dd->G[idxG][0] * _dd->L2NScaler[evOffset + 0] * wY;
-        x[evOffset + 1] -= _dd->G[idxG][1] * _dd->L2NScaler[evOffset + 1] * wY;
-        x[evOffset + 2] -= _dd->G[idxG][2] * _dd->L2NScaler[evOffset + 2] * wY;
-        x[evOffset + 3] -= _dd->G[idxG][3] * _dd->L2NScaler[evOffset + 3] * wY;
+        const int evIdx1 = _dd->evByObs[ob][0]; // event 1 for this observation
+        if (evIdx1 >= 0)
+        {
+          const unsigned idxG     = _dd->idxGByObs[ob][0];
+          const unsigned evOffset = evIdx1 * 4;
+          out[evOffset + 0] +=
+              _dd->G[idxG][0] * _dd->L2NScaler[evOffset + 0] * wY;
+          out[evOffset + 1] +=
+              _dd->G[idxG][1] * _dd->L2NScaler[evOffset + 1] * wY;
+          out[evOffset + 2] +=
+              _dd->G[idxG][2] * _dd->L2NScaler[evOffset + 2] * wY;
+          out[evOffset + 3] +=
+              _dd->G[idxG][3] * _dd->L2NScaler[evOffset + 3] * wY;
+        }
+
+        const int evIdx2 = _dd->evByObs[ob][1]; // event 2 for this observation
+        if (evIdx2 >= 0)
+        {
+          const unsigned idxG     = _dd->idxGByObs[ob][1];
+          const unsigned evOffset = evIdx2 * 4;
+          out[evOffset + 0] -=
+              _dd->G[idxG][0] * _dd->L2NScaler[evOffset + 0] * wY;
+          out[evOffset + 1] -=
+              _dd->G[idxG][1] * _dd->L2NScaler[evOffset + 1] * wY;
+          out[evOffset + 2] -=
+              _dd->G[idxG][2] * _dd->L2NScaler[evOffset + 2] * wY;
+          out[evOffset + 3] -=
+              _dd->G[idxG][3] * _dd->L2NScaler[evOffset + 3] * wY;
+        }
       }
-    }
+    });
 
     double *meanShiftWeight = &_dd->W[_dd->nObs];
     if (meanShiftWeight[0] != 0 || meanShiftWeight[1] != 0 ||
@@ -252,12 +414,143 @@ public:
                            _dd->L2NScaler[evOffset + 3];
       }
     }
+
+    if (!_blockPrecond.empty()) applyBlockPrecondTransposed(x, xOut);
   }
 
 private:
+  // out = P * x, where each 4x4 block of P is upper triangular
+  void applyBlockPrecond(const double *x, double *out) const
+  {
+    for (unsigned evIdx = 0; evIdx < _dd->nEvts; evIdx++)
+    {
+      const double *P  = &_blockPrecond[evIdx * 16];
+      const double *xe = &x[evIdx * 4];
+      for (unsigned i = 0; i < 4; i++)
+      {
+        double val = 0;
+        for (unsigned k = i; k < 4; k++) val += P[i * 4 + k] * xe[k];
+        out[evIdx * 4 + i] = val;
+      }
+    }
+  }
+
+  // out = out + P' * x
+  void applyBlockPrecondTransposed(const double *x, double *out) const
+  {
+    for (unsigned evIdx = 0; evIdx < _dd->nEvts; evIdx++)
+    {
+      const double *P  = &_blockPrecond[evIdx * 16];
+      const double *xe = &x[evIdx * 4];
+      for (unsigned i = 0; i < 4; i++)
+      {
+        double val = 0;
+        for (unsigned k = 0; k <= i; k++) val += P[k * 4 + i] * xe[k];
+        out[evIdx * 4 + i] += val;
+      }
+    }
+  }
+
+  /*
+   * The observations (rows of G) are split in contiguous chunks, one per
+   * thread. The chunks depend only on the number of observations and threads,
+   * so the results are deterministic for a given number of threads
+   */
+  unsigned numChunks() const
+  {
+    const unsigned minChunkSize = 10000; // not worth a thread below that
+    if (!_threadPool) return 1;
+    return std::max(1u,
+                    std::min(_threadPool->size(), _dd->nObs / minChunkSize));
+  }
+
+  static unsigned chunkStart(size_t chunk, unsigned numChunks, unsigned size)
+  {
+    return static_cast<unsigned>(chunk * size / numChunks);
+  }
+
+  // calls func(obStart, obEnd) for each chunk
+  template <class Func> void forEachChunk(const Func &func) const
+  {
+    const unsigned chunks = numChunks();
+    if (chunks == 1)
+    {
+      func(0, _dd->nObs);
+      return;
+    }
+    _threadPool->parallelFor(chunks, [this, chunks, &func](size_t c) {
+      func(chunkStart(c, chunks, _dd->nObs),
+           chunkStart(c + 1, chunks, _dd->nObs));
+    });
+  }
+
+  /*
+   * Calls func(obStart, obEnd, out) for each chunk, where out is a vector of
+   * numCols values to be accumulated. Multiple chunks accumulate on their
+   * own zero initialized copy, which are then added to out in chunk order
+   */
+  template <class Func>
+  void scatterByChunk(double *out, unsigned numCols, const Func &func) const
+  {
+    const unsigned chunks = numChunks();
+    if (chunks == 1)
+    {
+      func(0, _dd->nObs, out);
+      return;
+    }
+
+    _partials.assign(size_t(chunks) * numCols, 0.);
+
+    _threadPool->parallelFor(chunks, [this, chunks, numCols, &func](size_t c) {
+      func(chunkStart(c, chunks, _dd->nObs),
+           chunkStart(c + 1, chunks, _dd->nObs), &_partials[c * numCols]);
+    });
+
+    _threadPool->parallelFor(chunks, [this, chunks, numCols, out](size_t c) {
+      const unsigned colEnd = chunkStart(c + 1, chunks, numCols);
+      for (unsigned col = chunkStart(c, chunks, numCols); col < colEnd; col++)
+      {
+        for (unsigned k = 0; k < chunks; k++)
+          out[col] += _partials[k * numCols + col];
+      }
+    });
+  }
+
   Seiscomp::HDD::DDSystemPtr _dd;
+  Seiscomp::HDD::ThreadPool *_threadPool = nullptr;
+  mutable std::vector<double> _partials; // scatterByChunk buffers
+  std::vector<double> _blockPrecond;     // 4x4 block of P per event
+  mutable std::vector<double> _precondX; // Aprod1/Aprod2 buffer
 };
 
+/*
+ * Solve A*x = b for a 4x4 symmetric positive definite A via Cholesky
+ * decomposition (A = L*L'). A is overwritten by L. Returns false when A is
+ * not (numerically) positive definite
+ */
+bool choleskySolve4(double A[4][4], const double b[4], double x[4])
+{
+  if (!choleskyDecompose4(A)) return false;
+
+  // forward substitution L*y = b
+  double y[4];
+  for (unsigned i = 0; i < 4; i++)
+  {
+    double val = b[i];
+    for (unsigned k = 0; k < i; k++) val -= A[i][k] * y[k];
+    y[i] = val / A[i][i];
+  }
+
+  // back substitution L'*x = y
+  for (int i = 3; i >= 0; i--)
+  {
+    double val = y[i];
+    for (unsigned k = i + 1; k < 4; k++) val -= A[k][i] * x[k];
+    x[i] = val / A[i][i];
+  }
+  return true;
+}
+
 } // namespace
 
 namespace Seiscomp {
@@ -660,29 +953,45 @@ void Solver::prepareDDSystem(array<double, 4> meanShiftConstraint,
 {
   computePartialDerivatives();
 
+  // Assign a G row to each event/station pair whose parameters have to be
+  // computed by at least one observation
+  // key1=evIdx  key2=phStaIdx  value=G row
+  unordered_map<unsigned, unordered_map<unsigned, unsigned>> gRows;
+  unsigned nObsPrms = 0;
+  for (const auto &kw : _observations)
+  {
+    const Observation &obsrv = kw.second;
+    if (obsrv.computeEv1Changes &&
+        gRows[obsrv.ev1Idx].emplace(obsrv.phStaIdx, nObsPrms).second)
+      nObsPrms++;
+    if (obsrv.computeEv2Changes &&
+        gRows[obsrv.ev2Idx].emplace(obsrv.phStaIdx, nObsPrms).second)
+      nObsPrms++;
+  }
+
   _dd = DDSystemPtr(new DDSystem(_observations.size(), _eventIdConverter.size(),
-                                 _phStaIdConverter.size()));
+                                 _phStaIdConverter.size(), nObsPrms));
 
   // Init m and L2NScaler
   std::fill_n(_dd->m, _dd->numColsG, 0);
   std::fill_n(_dd->L2NScaler, _dd->numColsG, 1.);
 
   // initialize G
-  for (const auto &kv1 : _obsParams)
+  for (const auto &kv1 : gRows)
   {
     unsigned evIdx = kv1.first;
     for (const auto &kv2 : kv1.second)
     {
-      unsigned phStaIdx                          = kv2.first;
-      const ObservationParams &obsprm            = kv2.second;
-      _dd->G[evIdx * _dd->nPhStas + phStaIdx][0] = obsprm.dx;
-      _dd->G[evIdx * _dd->nPhStas + phStaIdx][1] = obsprm.dy;
-      _dd->G[evIdx * _dd->nPhStas + phStaIdx][2] = obsprm.dz;
-      _dd->G[evIdx * _dd->nPhStas + phStaIdx][3] = 1.; // travel time
+      const ObservationParams &obsprm = _obsParams.at(evIdx).at(kv2.first);
+      const unsigned idxG             = kv2.second;
+      _dd->G[idxG][0]                 = obsprm.dx;
+      _dd->G[idxG][1]                 = obsprm.dy;
+      _dd->G[idxG][2]                 = obsprm.dz;
+      _dd->G[idxG][3]                 = 1.; // travel time
     }
   }
 
-  // initialize: W, d, evByObsi, phStaByObs
+  // initialize: W, d, evByObs, idxGByObs, phStaByObs
   // note: m is zero initialized
   for (auto &kw : _observations)
   {
@@ -694,6 +1003,11 @@ void Solver::prepareDDSystem(array<double, 4> meanShiftConstraint,
     _dd->evByObs[obIdx][1] = obsrv.computeEv2Changes ? obsrv.ev2Idx : -1;
     _dd->phStaByObs[obIdx] = obsrv.phStaIdx;
 
+    if (obsrv.computeEv1Changes)
+      _dd->idxGByObs[obIdx][0] = gRows.at(obsrv.ev1Idx).at(obsrv.phStaIdx);
+    if (obsrv.computeEv2Changes)
+      _dd->idxGByObs[obIdx][1] = gRows.at(obsrv.ev2Idx).at(obsrv.phStaIdx);
+
     // compute double difference
     const ObservationParams &obsprm1 =
         _obsParams.at(obsrv.ev1Idx).at(obsrv.phStaIdx);
@@ -784,6 +1098,108 @@ void Solver::prepareDDSystem(array<double, 4> meanShiftConstraint,
   _stationParams.clear();
 }
 
+/*
+ * When a single event has parameters to solve (e.g. the neighbours are kept
+ * fixed) the system has only 4 unknowns and the normal equations
+ *
+ *   (G'W'WG + damp^2*I) * m = G'W'*Wd
+ *
+ * can be solved directly instead of iterating with LSQR/LSMR. The problem
+ * solved is the same as the one given to LSQR/LSMR, including L2
+ * normalization and damping (which are applied to the scaled unknowns) and
+ * the cluster mean shift constraints. Since the mean shift equations involve
+ * the parameters of all events, the ones of the other events (which are
+ * otherwise undetermined) absorb part of the constraint: this is taken into
+ * account analytically.
+ *
+ * Returns false if the system is not a single event one or if the normal
+ * equations matrix is not positive definite, in which case the iterative
+ * solver has to be used
+ */
+bool Solver::solveSingleEvent(double dampingFactor, bool normalizeG)
+{
+  int evIdx = -1;
+  for (unsigned ob = 0; ob < _dd->nObs; ob++)
+  {
+    for (int obEvIdx : _dd->evByObs[ob])
+    {
+      if (obEvIdx < 0) continue;
+      if (evIdx < 0)
+        evIdx = obEvIdx;
+      else if (evIdx != obEvIdx)
+        return false;
+    }
+  }
+  if (evIdx < 0) return false;
+
+  // accumulate G'W'WG and G'W'Wd (d is already weighted)
+  double N[4][4] = {{0}};
+  double rhs[4]  = {0};
+  for (unsigned ob = 0; ob < _dd->nObs; ob++)
+  {
+    const double obsW = _dd->W[ob];
+    if (obsW == 0.) continue;
+
+    const bool isEv1    = _dd->evByObs[ob][0] == evIdx;
+    const unsigned idxG = _dd->idxGByObs[ob][isEv1 ? 0 : 1];
+    const double signW  = isEv1 ? obsW : -obsW;
+    double row[4];
+    for (unsigned k = 0; k < 4; k++) row[k] = _dd->G[idxG][k] * signW;
+
+    for (unsigned i = 0; i < 4; i++)
+    {
+      for (unsigned j = 0; j <= i; j++) N[i][j] += row[i] * row[j];
+      rhs[i] += row[i] * _dd->d[ob];
+    }
+  }
+  for (unsigned i = 0; i < 4; i++)
+    for (unsigned j = i + 1; j < 4; j++) N[i][j] = N[j][i];
+
+  const double *meanShiftWeight = &_dd->W[_dd->nObs];
+  const bool meanShift = meanShiftWeight[0] != 0 || meanShiftWeight[1] != 0 ||
+                         meanShiftWeight[2] != 0 || meanShiftWeight[3] != 0;
+  const double damp2       = dampingFactor * dampingFactor;
+  const unsigned numOthers = _dd->nEvts - 1;
+
+  for (unsigned k = 0; k < 4; k++)
+  {
+    const double msW2 = meanShift ? std::pow(meanShiftWeight[k], 2) : 0;
+
+    // same column scaling as Adapter::L2normalize
+    const double scaler2 = normalizeG ? 1. / (N[k][k] + msW2) : 1.;
+
+    // Mean shift constraint: msW * (m_k + sum of the other events m_k) = 0.
+    // Minimizing over the other events parameters, each one damped and
+    // scaled by 1/msW (L2 normalization) or 1, leaves an equivalent weight
+    // on m_k of msW^2 * damp^2 / (damp^2 + msW^2 * sum(scaler^2))
+    if (msW2 != 0)
+    {
+      const double othersW2 = numOthers * (normalizeG ? 1. : msW2);
+      if (numOthers == 0)
+        N[k][k] += msW2;
+      else if (damp2 != 0)
+        N[k][k] += msW2 * damp2 / (damp2 + othersW2);
+    }
+
+    // the damping applies to the scaled unknowns m_k / scaler
+    N[k][k] += damp2 / scaler2;
+  }
+
+  double solution[4];
+  if (!choleskySolve4(N, rhs, solution))
+  {
+    SEISCOMP_INFO("Solver: single event normal equations are not positive "
+                  "definite, falling back to the iterative solver");
+    return false;
+  }
+
+  std::fill_n(_dd->m, _dd->numColsG, 0);
+  std::copy_n(solution, 4, &_dd->m[evIdx * 4]);
+
+  SEISCOMP_DEBUG("Solver: single event system solved via normal equations");
+  return true;
+}
+
 void Solver::solve(unsigned numIterations,
                    double dampingFactor,
                    double residualDownWeight,
@@ -791,7 +1207,8 @@ void Solver::solve(unsigned numIterations,
                    double meanLatShiftConstraint,
                    double meanDepthShiftConstraint,
                    double meanTTShiftConstraint,
-                   bool normalizeG)
+                   bool normalizeG,
+                   bool blockJacobi)
 {
   if (_observations.size() == 0)
   {
@@ -808,12 +1225,12 @@ void Solver::solve(unsigned numIterations,
   if (_type == "LSQR")
   {
     _solve<lsqrBase>(numIterations, dampingFactor, residualDownWeight,
-                     meanShiftConstraint, normalizeG);
+                     meanShiftConstraint, normalizeG, blockJacobi);
   }
   else if (_type == "LSMR")
   {
     _solve<lsmrBase>(numIterations, dampingFactor, residualDownWeight,
-                     meanShiftConstraint, normalizeG);
+                     meanShiftConstraint, normalizeG, blockJacobi);
   }
   else
   {
@@ -827,50 +1244,66 @@ void Solver::_solve(unsigned numIterations,
                     double dampingFactor,
                     double residualDownWeight,
                     array<double, 4> meanShiftConstraint,
-                    bool normalizeG)
+                    bool normalizeG,
+                    bool blockJacobi)
 {
   prepareDDSystem(meanShiftConstraint, residualDownWeight);
 
-  Adapter<T> solver;
-  solver.setDDSytem(_dd);
-  if (normalizeG)
+  // the single event system is solved directly and it doesn't need the
+  // block-Jacobi preconditioner, but the damping still applies to scaled
+  // unknowns
+  if (!solveSingleEvent(dampingFactor, normalizeG || blockJacobi))
   {
-    solver.L2normalize();
-  }
+    Adapter<T> solver;
+    solver.setDDSytem(_dd);
+    solver.setThreadPool(_threadPool);
+    if (blockJacobi)
+    {
+      solver.blockJacobiPrecondition();
+    }
+    else if (normalizeG)
+    {
+      solver.L2normalize();
+    }
 
-  solver.SetDamp(dampingFactor);
-  solver.SetMaximumNumberOfIterations(numIterations ? numIterations
-                                                    : _dd->numColsG / 2);
+    solver.SetDamp(dampingFactor);
+    solver.SetMaximumNumberOfIterations(numIterations ? numIterations
+                                                      : _dd->numColsG / 2);
 
-  const double eps = 1e-15;
-  solver.SetEpsilon(eps);
-  solver.SetToleranceA(1e-16);
-  solver.SetToleranceB(1e-16);
-  solver.SetUpperLimitOnConditional(1.0 / (10 * sqrt(eps)));
+    const double eps = 1e-15;
+    solver.SetEpsilon(eps);
+    solver.SetToleranceA(1e-16);
+    solver.SetToleranceB(1e-16);
+    solver.SetUpperLimitOnConditional(1.0 / (10 * sqrt(eps)));
 
-  // std::ostringstream solverLogs;
-  // solver.SetOutputStream( solverLogs );
+    // std::ostringstream solverLogs;
+    // solver.SetOutputStream( solverLogs );
 
-  solver.Solve(_dd->numRowsG, _dd->numColsG, _dd->d, _dd->m);
+    solver.Solve(_dd->numRowsG, _dd->numColsG, _dd->d, _dd->m);
 
-  // SEISCOMP_DEBUG("%s", solverLogs.str().c_str() );
+    // SEISCOMP_DEBUG("%s", solverLogs.str().c_str() );
 
-  SEISCOMP_INFO("Stopped because %u : %s (used %u Iterations)",
-                solver.GetStoppingReason(),
-                solver.GetStoppingReasonMessage().c_str(),
-                solver.GetNumberOfIterationsPerformed());
+    SEISCOMP_INFO("Stopped because %u : %s (used %u Iterations)",
+                  solver.GetStoppingReason(),
+                  solver.GetStoppingReasonMessage().c_str(),
+                  solver.GetNumberOfIterationsPerformed());
 
-  if (solver.GetStoppingReason() == 4)
-  {
-    _dd        = nullptr;
-    string msg = stringify("Solver: no solution found (%s)",
-                           solver.GetStoppingReasonMessage().c_str());
-    throw runtime_error(msg.c_str());
-  }
+    if (solver.GetStoppingReason() == 4)
+    {
+      _dd        = nullptr;
+      string msg = stringify("Solver: no solution found (%s)",
+                             solver.GetStoppingReasonMessage().c_str());
+      throw runtime_error(msg.c_str());
+    }
 
-  if (normalizeG)
-  {
-    solver.L2DeNormalize();
+    if (blockJacobi)
+    {
+      solver.blockJacobiDeNormalize();
+    }
+    else if (normalizeG)
+    {
+      solver.L2DeNormalize();
+    }
   }
 
   loadSolutions();
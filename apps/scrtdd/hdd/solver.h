@@ -20,6 +20,7 @@
 
 #include "lsmr.h"
 #include "lsqr.h"
+#include "threadpool.h"
 
 #include <seiscomp3/core/baseobject.h>
 #include <unordered_map>
@@ -44,7 +45,10 @@ namespace HDD {
  * This class also contains 4 additional equations for constraining the mean
  * shift of all earthquakes during relocation.
  *
- * We take advantage of the sparsness of G matrix, so G is not a full matrix
+ * We take advantage of the sparsness of G matrix, so G is not a full matrix:
+ * only the partial derivatives of the event/station pairs actually used by
+ * the observations are stored and the observations reference them by index,
+ * so that the memory scales with the number of observations
  */
 struct DDSystem : public Core::BaseObject
 {
@@ -55,10 +59,12 @@ struct DDSystem : public Core::BaseObject
   const unsigned nEvts;
   // number of stations
   const unsigned nPhStas;
+  // number of event/station pairs whose partial derivatives are stored in G
+  const unsigned nObsPrms;
   // W[nObs+4]: weight of each observation + cluster mean shift constraints
   // (x,y,z,time)
   double *W;
-  // G[nEvts*nPhStas][4]: 3 partial derivatives for each event/station pair + tt
+  // G[nObsPrms][4]: 3 partial derivatives for each event/station pair + tt
   // (dx,dy,dz,1)
   double (*G)[4];
   // m[nEvts*4]: changes for each event hypocentral parameters we wish to
@@ -72,28 +78,36 @@ struct DDSystem : public Core::BaseObject
   // evByObs[nObs][2]: map of 2 event idx for each observation (index -1 means
   // no parameters)
   int (*evByObs)[2];
+  // idxGByObs[nObs][2]: G row of the 2 events for each observation (only
+  // meaningful when the corresponding evByObs index is not -1)
+  unsigned (*idxGByObs)[2];
   // phStaByObs[nObs]: map of station idx for each observation
   unsigned *phStaByObs;
 
   const unsigned numRowsG;
   const unsigned numColsG;
 
-  DDSystem(unsigned _nObs, unsigned _nEvts, unsigned _nPhStas)
-      : nObs(_nObs), nEvts(_nEvts), nPhStas(_nPhStas), numRowsG(nObs + 4),
-        numColsG(nEvts * 4)
+  DDSystem(unsigned _nObs,
+           unsigned _nEvts,
+           unsigned _nPhStas,
+           unsigned _nObsPrms)
+      : nObs(_nObs), nEvts(_nEvts), nPhStas(_nPhStas), nObsPrms(_nObsPrms),
+        numRowsG(nObs + 4), numColsG(nEvts * 4)
   {
     W          = new double[numRowsG];
-    G          = new double[nEvts * nPhStas][4];
+    G          = new double[nObsPrms][4];
     m          = new double[numColsG];
     d          = new double[numRowsG];
     L2NScaler  = new double[numColsG];
     evByObs    = new int[nObs][2];
+    idxGByObs  = new unsigned[nObs][2];
     phStaByObs = new unsigned[nObs];
   }
 
   virtual ~DDSystem()
   {
     delete[] phStaByObs;
+    delete[] idxGByObs;
     delete[] evByObs;
     delete[] L2NScaler;
     delete[] d;
@@ -118,10 +132,13 @@ class Solver : public Core::BaseObject
 {
 
 public:
-  Solver(std::string type) : _type(type) {}
+  // threadPool, if given, is used to parallelize the LSQR/LSMR iterations
+  Solver(std::string type, ThreadPool *threadPool = nullptr)
+      : _type(type), _threadPool(threadPool)
+  {}
   virtual ~Solver() {}
 
-  void reset() { *this = Solver(_type); }
+  void reset() { *this = Solver(_type, _threadPool); }
 
   void addObservation(unsigned evId1,
                       unsigned evId2,
@@ -146,6 +163,9 @@ public:
                             double takeOffAngle  = 0,
                             double velocityAtSrc = 0);
 
+  // normalizeG: scale the G columns to unit L2 norm
+  // blockJacobi: precondition G by the 4x4 block of each event (it replaces
+  //              the L2 normalization)
   void solve(unsigned numIterations          = 0,
              double dampingFactor            = 0,
              double residualDownWeight       = 0,
@@ -153,7 +173,8 @@ public:
              double meanLatShiftConstraint   = 0,
              double meanDepthShiftConstraint = 0,
              double meanTTShiftConstraint    = 0,
-             bool normalizeG                 = true);
+             bool normalizeG                 = true,
+             bool blockJacobi                = false);
 
   bool getEventChanges(unsigned evId,
                        double &deltaLat,
@@ -188,7 +209,10 @@ private:
               double dampingFactor,
               double residualDownWeight,
               std::array<double, 4> meanShiftConstraint,
-              bool normalizeG);
+              bool normalizeG,
+              bool blockJacobi);
+
+  bool solveSingleEvent(double dampingFactor, bool normalizeG);
 
   void loadSolutions();
 
@@ -296,6 +320,7 @@ private:
   std::vector<double> _residuals;
   DDSystemPtr _dd;
   std::string _type;
+  ThreadPool *_threadPool;
 };
 
 DEFINE_SMARTPOINTER(Solver);
@@ -0,0 +1,149 @@
+/***************************************************************************
+ *   Copyright (C) by ETHZ/SED                                             *
+ *                                                                         *
+ * This program is free software: you can redistribute it and/or modify    *
+ * it under the terms of the GNU Affero General Public License as published*
+ * by the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                     *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ * GNU Affero General Public License for more details.                     *
+ *                                                                         *
+ *                                                                         *
+ *   Developed by Luca Scarabello <luca.scarabello@sed.ethz.ch>            *
+ ***************************************************************************/
+
+#include "threadpool.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace Seiscomp {
+namespace HDD {
+
+namespace {
+// true on the pool threads and on a caller inside parallelFor
+thread_local bool insideParallelFor = false;
+} // namespace
+
+ThreadPool::ThreadPool(unsigned numThreads)
+{
+  if (numThreads == 0)
+    numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+  for (unsigned i = 1; i < numThreads; i++)
+    _workers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    lock_guard<mutex> lock(_mutex);
+    _stop = true;
+  }
+  _wakeUp.notify_all();
+  for (thread &worker : _workers) worker.join();
+}
+
+void ThreadPool::parallelFor(size_t count,
+                             const std::function<void(size_t)> &task)
+{
+  if (count == 0) return;
+
+  if (_workers.empty() || count == 1 || insideParallelFor)
+  {
+    for (size_t i = 0; i < count; i++) task(i);
+    return;
+  }
+
+  // the pool runs one loop at a time: concurrent callers wait here
+  lock_guard<mutex> callerLock(_callerMutex);
+
+  {
+    lock_guard<mutex> lock(_mutex);
+    _task      = &task;
+    _count     = count;
+    _next      = 0;
+    _completed = 0;
+    _error     = nullptr;
+    _generation++;
+  }
+  _wakeUp.notify_all();
+
+  insideParallelFor = true;
+  runTasks();
+  insideParallelFor = false;
+
+  exception_ptr error;
+  {
+    unique_lock<mutex> lock(_mutex);
+    _done.wait(lock, [this] { return _completed == _count; });
+    _task  = nullptr;
+    error  = _error;
+    _error = nullptr;
+  }
+
+  if (error) rethrow_exception(error);
+}
+
+void ThreadPool::workerLoop()
+{
+  insideParallelFor = true;
+
+  unsigned seenGeneration = 0;
+  while (true)
+  {
+    {
+      unique_lock<mutex> lock(_mutex);
+      _wakeUp.wait(lock, [this, seenGeneration] {
+        return _stop || _generation != seenGeneration;
+      });
+      if (_stop) return;
+      seenGeneration = _generation;
+    }
+    runTasks();
+  }
+}
+
+void ThreadPool::runTasks()
+{
+  while (true)
+  {
+    size_t i;
+    const std::function<void(size_t)> *task;
+    {
+      lock_guard<mutex> lock(_mutex);
+      if (!_task || _next >= _count) return;
+      i    = _next++;
+      task = _task;
+    }
+
+    exception_ptr error;
+    try
+    {
+      (*task)(i);
+    }
+    catch (...)
+    {
+      error = current_exception();
+    }
+
+    bool allDone;
+    {
+      lock_guard<mutex> lock(_mutex);
+      if (error && (!_error || i < _errorIndex))
+      {
+        _error      = error;
+        _errorIndex = i;
+      }
+      allDone = (++_completed == _count);
+    }
+    if (allDone) _done.notify_all();
+  }
+}
+
+} // namespace HDD
+} // namespace Seiscomp
@@ -0,0 +1,88 @@
+/***************************************************************************
+ *   Copyright (C) by ETHZ/SED                                             *
+ *                                                                         *
+ * This program is free software: you can redistribute it and/or modify    *
+ * it under the terms of the GNU Affero General Public License as published*
+ * by the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                     *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ * GNU Affero General Public License for more details.                     *
+ *                                                                         *
+ *                                                                         *
+ *   Developed by Luca Scarabello <luca.scarabello@sed.ethz.ch>            *
+ ***************************************************************************/
+
+#ifndef __HDD_THREADPOOL_H__
+#define __HDD_THREADPOOL_H__
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Seiscomp {
+namespace HDD {
+
+/*
+ * Fixed size pool of worker threads for data-parallel loops. The workers are
+ * created once and reused by every parallelFor call. The calling thread takes
+ * part in the loop too, so a pool of N threads spawns N-1 workers and a pool
+ * of 1 thread runs everything on the caller.
+ */
+class ThreadPool
+{
+public:
+  // numThreads == 0 uses all the available CPUs
+  explicit ThreadPool(unsigned numThreads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  unsigned size() const { return _workers.size() + 1; }
+
+  /*
+   * Call task(i) for every i in [0, count) and wait for all the calls to
+   * complete. The order of execution is unspecified, so any result must be
+   * stored by index and merged by the caller for a deterministic outcome.
+   * If any task throws, the exception of the lowest index is rethrown once
+   * all the tasks have completed. Nested calls (from within a task) run
+   * sequentially on the calling thread. Calls from different threads are
+   * serialized: a call waits for the loop in progress to complete.
+   */
+  void parallelFor(size_t count, const std::function<void(size_t)> &task);
+
+private:
+  void workerLoop();
+  void runTasks();
+
+  std::vector<std::thread> _workers;
+
+  // held by the external caller for the whole parallelFor
+  std::mutex _callerMutex;
+
+  std::mutex _mutex;
+  std::condition_variable _wakeUp;
+  std::condition_variable _done;
+  bool _stop           = false;
+  unsigned _generation = 0;
+
+  // current parallelFor state, protected by _mutex
+  const std::function<void(size_t)> *_task = nullptr;
+  size_t _count                            = 0;
+  size_t _next                             = 0;
+  size_t _completed                        = 0;
+  size_t _errorIndex                       = 0;
+  std::exception_ptr _error;
+};
+
+} // namespace HDD
+} // namespace Seiscomp
+
+#endif
@@ -18,11 +18,17 @@
 #include "ttt.h"
 #include "utils.h"
 
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <cmath>
+#include <fstream>
+#include <limits>
 #include <seiscomp3/core/strings.h>
 #include <seiscomp3/math/geo.h>
 #include <seiscomp3/math/math.h>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 
 #define SEISCOMP_COMPONENT RTDD
 #include <seiscomp3/logging/log.h>
@@ -30,13 +36,67 @@
 using namespace std;
 using Seiscomp::Core::stringify;
 
+namespace {
+// serializes the creation of the travel time table implementations, which
+// load the model files
+std::mutex tttCreateMutex;
+
+template <class T> void writeValue(std::ostream &out, const T &value)
+{
+  out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <class T> void readValue(std::istream &in, T &value)
+{
+  in.read(reinterpret_cast<char *>(&value), sizeof(T));
+}
+
+} // namespace
+
 namespace Seiscomp {
 namespace HDD {
 
-TravelTimeTable::TravelTimeTable(std::string type, std::string model)
+TravelTimeTable::TravelTimeTable(std::string type,
+                                 std::string model,
+                                 const GridSpec &gridSpec,
+                                 const std::string &gridCacheDir)
+    : _type(type), _model(model), _gridSpec(gridSpec),
+      _gridCacheDir(gridCacheDir)
 {
-  _ttt = TravelTimeTableInterface::Create(type.c_str());
-  _ttt->setModel(model.c_str());
+  // fail early on an invalid type or model
+  tttInterface();
+
+  if (gridsEnabled() &&
+      (_gridSpec.maxDepth <= 0 || _gridSpec.distanceStep <= 0 ||
+       _gridSpec.maxDistance <= 0))
+  {
+    throw runtime_error("Travel time grid: invalid grid parameters");
+  }
+}
+
+TravelTimeTableInterface *TravelTimeTable::tttInterface()
+{
+  const std::thread::id threadId = std::this_thread::get_id();
+  {
+    std::lock_guard<std::mutex> lock(_tttsMutex);
+    auto it = _ttts.find(threadId);
+    if (it != _ttts.end()) return it->second.get();
+  }
+
+  TravelTimeTableInterfacePtr ttt;
+  {
+    std::lock_guard<std::mutex> lock(tttCreateMutex);
+    ttt = TravelTimeTableInterface::Create(_type.c_str());
+    if (!ttt)
+      throw runtime_error("Unknown travel time table type: " + _type);
+    if (!ttt->setModel(_model.c_str()))
+      throw runtime_error("Unable to load travel time table model: " +
+                          _model);
+  }
+
+  std::lock_guard<std::mutex> lock(_tttsMutex);
+  _ttts[threadId] = ttt;
+  return ttt.get();
 }
 
 void TravelTimeTable::compute(double eventLat,
@@ -56,10 +116,306 @@ void TravelTimeTable::compute(double eventLat,
   travelTime = takeOffAngle = velocityAtSrc = 0;
 
   double depth  = eventDepth > 0 ? eventDepth : 0;
-  TravelTime tt = _ttt->compute(phaseType.c_str(), eventLat, eventLon, depth,
-                                stationLat, stationLon, stationElevation);
+  TravelTime tt =
+      tttInterface()->compute(phaseType.c_str(), eventLat, eventLon, depth,
+                              stationLat, stationLon, stationElevation);
   travelTime    = tt.time;
 }
 
+void TravelTimeTable::compute(const Catalog::Event &event,
+                              const Catalog::Station &station,
+                              const std::string &phaseType,
+                              double &travelTime,
+                              double &takeOffAngle,
+                              double &velocityAtSrc)
+{
+  if (gridsEnabled())
+  {
+    std::shared_ptr<const Grid> grid = getGrid(station, phaseType);
+    double depth    = event.depth > 0 ? event.depth : 0;
+    double distance = computeDistance(event.latitude, event.longitude,
+                                      station.latitude, station.longitude);
+    double dTdDepth, dTdDistance;
+    if (interpolate(*grid, depth, distance, travelTime, dTdDepth,
+                    dTdDistance))
+    {
+      // The derivatives are the components of the slowness vector at the
+      // source, along the depth and the horizontal distance from the station
+      const double slowness = std::sqrt(dTdDepth * dTdDepth +
+                                        dTdDistance * dTdDistance);
+      takeOffAngle  = slowness > 0 ? std::atan2(dTdDepth, dTdDistance) : 0;
+      velocityAtSrc = slowness > 0 ? 1. / slowness : 0;
+      return;
+    }
+  }
+
+  compute(event.latitude, event.longitude, event.depth, station.latitude,
+          station.longitude, station.elevation, phaseType, travelTime,
+          takeOffAngle, velocityAtSrc);
+}
+
+void TravelTimeTable::precomputeGrid(const Catalog::Station &station,
+                                     const std::string &phaseType)
+{
+  if (gridsEnabled()) getGrid(station, phaseType);
+}
+
+std::shared_ptr<const TravelTimeTable::Grid>
+TravelTimeTable::getGrid(const Catalog::Station &station,
+                         const std::string &phaseType)
+{
+  const std::string key = station.id + "." + phaseType;
+
+  //
+  // The grid is loaded/built outside of the lock: the first caller inserts
+  // an in-flight entry and builds the grid, while concurrent callers for the
+  // same key wait for that entry only
+  //
+  while (true)
+  {
+    std::shared_ptr<GridFuture> entry;
+    std::promise<std::shared_ptr<const Grid>> promise;
+    bool mustBuild = false;
+    {
+      std::lock_guard<std::mutex> lock(_gridsMutex);
+      auto it = _grids.find(key);
+      if (it != _grids.end())
+        entry = it->second;
+      else
+      {
+        entry.reset(new GridFuture(promise.get_future().share()));
+        _grids[key] = entry;
+        mustBuild   = true;
+      }
+    }
+
+    if (mustBuild)
+    {
+      std::shared_ptr<const Grid> grid;
+      try
+      {
+        grid = loadOrBuildGrid(station, phaseType);
+      }
+      catch (...)
+      {
+        promise.set_exception(std::current_exception());
+        std::lock_guard<std::mutex> lock(_gridsMutex);
+        _grids.erase(key);
+        throw;
+      }
+      promise.set_value(grid);
+      return grid;
+    }
+
+    std::shared_ptr<const Grid> grid = entry->get();
+    if (grid->stationLat == station.latitude &&
+        grid->stationLon == station.longitude &&
+        grid->stationElevation == station.elevation)
+    {
+      return grid;
+    }
+
+    // the station has moved: drop the outdated grid and build it again
+    std::lock_guard<std::mutex> lock(_gridsMutex);
+    auto it = _grids.find(key);
+    if (it != _grids.end() && it->second == entry) _grids.erase(it);
+  }
+}
+
+std::shared_ptr<const TravelTimeTable::Grid>
+TravelTimeTable::loadOrBuildGrid(const Catalog::Station &station,
+                                 const std::string &phaseType)
+{
+  std::shared_ptr<const Grid> grid;
+  const std::string cacheFile = gridCacheFile(station, phaseType);
+  if (!cacheFile.empty()) grid = readGrid(cacheFile, station);
+
+  if (!grid)
+  {
+    grid = buildGrid(station, phaseType);
+    if (!cacheFile.empty()) writeGrid(*grid, cacheFile);
+  }
+  return grid;
+}
+
+std::shared_ptr<const TravelTimeTable::Grid>
+TravelTimeTable::buildGrid(const Catalog::Station &station,
+                           const std::string &phaseType)
+{
+  SEISCOMP_DEBUG("Building travel time grid for station %s phase %s",
+                 station.id.c_str(), phaseType.c_str());
+
+  std::shared_ptr<Grid> grid(new Grid());
+  grid->stationLat       = station.latitude;
+  grid->stationLon       = station.longitude;
+  grid->stationElevation = station.elevation;
+  grid->numDepths =
+      std::ceil(_gridSpec.maxDepth / _gridSpec.depthStep - 1e-9) + 1;
+  grid->numDistances =
+      std::ceil(_gridSpec.maxDistance / _gridSpec.distanceStep - 1e-9) + 1;
+  grid->times.resize(grid->numDepths * grid->numDistances);
+
+  TravelTimeTableInterface *ttt = tttInterface();
+
+  for (unsigned distIdx = 0; distIdx < grid->numDistances; distIdx++)
+  {
+    // place the source north of the station, the models are 1D anyway
+    const double distance = distIdx * _gridSpec.distanceStep;
+    double sourceLat, sourceLon;
+    Math::Geo::delandaz2coord(Math::Geo::km2deg(distance), 0,
+                              station.latitude, station.longitude,
+                              &sourceLat, &sourceLon);
+
+    for (unsigned depthIdx = 0; depthIdx < grid->numDepths; depthIdx++)
+    {
+      double &time = grid->times[depthIdx * grid->numDistances + distIdx];
+      try
+      {
+        TravelTime tt = ttt->compute(
+            phaseType.c_str(), sourceLat, sourceLon,
+            depthIdx * _gridSpec.depthStep, station.latitude,
+            station.longitude, station.elevation);
+        time = tt.time;
+      }
+      catch (exception &e)
+      {
+        time = std::numeric_limits<double>::quiet_NaN();
+      }
+    }
+  }
+
+  return grid;
+}
+
+bool TravelTimeTable::interpolate(const Grid &grid,
+                                  double depth,
+                                  double distance,
+                                  double &travelTime,
+                                  double &dTdDepth,
+                                  double &dTdDistance) const
+{
+  const double depthPos = depth / _gridSpec.depthStep;
+  const double distPos  = distance / _gridSpec.distanceStep;
+  if (depthPos < 0 || depthPos > grid.numDepths - 1 || distPos < 0 ||
+      distPos > grid.numDistances - 1)
+  {
+    return false;
+  }
+
+  // cell containing the point (the last node belongs to the previous cell)
+  const unsigned depthIdx =
+      std::min<unsigned>(depthPos, grid.numDepths - 2);
+  const unsigned distIdx =
+      std::min<unsigned>(distPos, grid.numDistances - 2);
+  const double fz = depthPos - depthIdx;
+  const double fx = distPos - distIdx;
+
+  // the 2 nodes of the cell at depthIdx (t0) and depthIdx+1 (t1)
+  const double *t0 = &grid.times[depthIdx * grid.numDistances + distIdx];
+  const double *t1 = t0 + grid.numDistances;
+  if (std::isnan(t0[0]) || std::isnan(t0[1]) || std::isnan(t1[0]) ||
+      std::isnan(t1[1]))
+  {
+    return false;
+  }
+
+  travelTime = (1 - fz) * ((1 - fx) * t0[0] + fx * t0[1]) +
+               fz * ((1 - fx) * t1[0] + fx * t1[1]);
+  dTdDepth =
+      ((1 - fx) * (t1[0] - t0[0]) + fx * (t1[1] - t0[1])) / _gridSpec.depthStep;
+  dTdDistance = ((1 - fz) * (t0[1] - t0[0]) + fz * (t1[1] - t1[0])) /
+                _gridSpec.distanceStep;
+  return true;
+}
+
+std::string TravelTimeTable::gridCacheFile(const Catalog::Station &station,
+                                           const std::string &phaseType) const
+{
+  if (_gridCacheDir.empty()) return "";
+
+  // the model can be a path
+  std::string modelDir = _type + "_" + _model;
+  std::replace(modelDir.begin(), modelDir.end(), '/', '_');
+
+  return (boost::filesystem::path(_gridCacheDir) / modelDir /
+          (station.id + "." + phaseType + ".ttgrid"))
+      .string();
+}
+
+/*
+ * Grid file format (native binary): station latitude, longitude and
+ * elevation, the GridSpec values, numDepths, numDistances and the times. The
+ * file is discarded if the station or the grid spec don't match
+ */
+std::shared_ptr<const TravelTimeTable::Grid>
+TravelTimeTable::readGrid(const std::string &file,
+                          const Catalog::Station &station) const
+{
+  std::ifstream in(file, std::ios::binary);
+  if (!in) return nullptr;
+
+  std::shared_ptr<Grid> grid(new Grid());
+  GridSpec spec;
+  readValue(in, grid->stationLat);
+  readValue(in, grid->stationLon);
+  readValue(in, grid->stationElevation);
+  readValue(in, spec.depthStep);
+  readValue(in, spec.maxDepth);
+  readValue(in, spec.distanceStep);
+  readValue(in, spec.maxDistance);
+  readValue(in, grid->numDepths);
+  readValue(in, grid->numDistances);
+
+  if (!in || grid->stationLat != station.latitude ||
+      grid->stationLon != station.longitude ||
+      grid->stationElevation != station.elevation ||
+      spec.depthStep != _gridSpec.depthStep ||
+      spec.maxDepth != _gridSpec.maxDepth ||
+      spec.distanceStep != _gridSpec.distanceStep ||
+      spec.maxDistance != _gridSpec.maxDistance)
+  {
+    SEISCOMP_DEBUG("Discarding outdated travel time grid %s", file.c_str());
+    return nullptr;
+  }
+
+  grid->times.resize(grid->numDepths * grid->numDistances);
+  in.read(reinterpret_cast<char *>(grid->times.data()),
+          grid->times.size() * sizeof(double));
+  if (!in)
+  {
+    SEISCOMP_WARNING("Discarding corrupted travel time grid %s", file.c_str());
+    return nullptr;
+  }
+  return grid;
+}
+
+void TravelTimeTable::writeGrid(const Grid &grid, const std::string &file) const
+{
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(
+      boost::filesystem::path(file).parent_path(), ec);
+
+  bool written = writeFileAtomically(file, [&](std::ostream &out) {
+    writeValue(out, grid.stationLat);
+    writeValue(out, grid.stationLon);
+    writeValue(out, grid.stationElevation);
+    writeValue(out, _gridSpec.depthStep);
+    writeValue(out, _gridSpec.maxDepth);
+    writeValue(out, _gridSpec.distanceStep);
+    writeValue(out, _gridSpec.maxDistance);
+    writeValue(out, grid.numDepths);
+    writeValue(out, grid.numDistances);
+    out.write(reinterpret_cast<const char *>(grid.times.data()),
+              grid.times.size() * sizeof(double));
+    return out.good();
+  });
+
+  if (!written)
+  {
+    SEISCOMP_WARNING("Couldn't write travel time grid to disk %s",
+                     file.c_str());
+  }
+}
+
 } // namespace HDD
 } // namespace Seiscomp
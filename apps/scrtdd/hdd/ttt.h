@@ -20,18 +20,54 @@
 
 #include "catalog.h"
 
+#include <future>
+#include <memory>
+#include <mutex>
 #include <seiscomp3/core/baseobject.h>
 #include <seiscomp3/seismology/ttt.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace Seiscomp {
 namespace HDD {
 
 DEFINE_SMARTPOINTER(TravelTimeTable);
 
+/*
+ * Travel time computation on top of the SeisComP travel time table interface
+ * (LOCSAT, libtau).
+ *
+ * Optionally, the travel times of each station/phase can be precomputed over
+ * a source depth x epicentral distance grid: since the velocity models are
+ * 1D, those are the only variables for a given station. Events inside the
+ * grid are then answered by bilinear interpolation, which also gives the
+ * travel time derivatives with respect to depth and distance, from which the
+ * take-off angle and the velocity at source are derived. Events outside the
+ * grid are computed by the travel time table as usual. The grids are saved
+ * in a cache directory and reloaded when the same model, station and grid
+ * are requested again.
+ */
 class TravelTimeTable : public Core::BaseObject
 {
 public:
-  TravelTimeTable(std::string type, std::string model);
+  // grid nodes every depthStep/distanceStep km from 0 to maxDepth/maxDistance
+  struct GridSpec
+  {
+    double depthStep    = 0; // 0 disables the grids
+    double maxDepth     = 0;
+    double distanceStep = 0;
+    double maxDistance  = 0;
+  };
+
+  TravelTimeTable(std::string type, std::string model)
+      : TravelTimeTable(type, model, GridSpec(), "")
+  {}
+
+  TravelTimeTable(std::string type,
+                  std::string model,
+                  const GridSpec &gridSpec,
+                  const std::string &gridCacheDir);
   virtual ~TravelTimeTable() {}
 
   void compute(double eventLat,
@@ -45,20 +81,70 @@ public:
                double &takeOffAngle,
                double &velocityAtSrc);
 
+  // uses the station grid when enabled
   void compute(const Catalog::Event &event,
                const Catalog::Station &station,
                const std::string &phaseType,
                double &travelTime,
                double &takeOffAngle,
-               double &velocityAtSrc)
-  {
-    return compute(event.latitude, event.longitude, event.depth,
-                   station.latitude, station.longitude, station.elevation,
-                   phaseType, travelTime, takeOffAngle, velocityAtSrc);
-  }
+               double &velocityAtSrc);
+
+  // Build, or load from the cache, the grid of a station/phase in advance
+  // (otherwise that is done by the first compute call that needs it)
+  void precomputeGrid(const Catalog::Station &station,
+                      const std::string &phaseType);
+
+  bool gridsEnabled() const { return _gridSpec.depthStep > 0; }
 
 private:
-  TravelTimeTableInterfacePtr _ttt;
+  struct Grid
+  {
+    double stationLat, stationLon, stationElevation;
+    unsigned numDepths, numDistances;
+    // times[depthIdx * numDistances + distanceIdx], NaN where the phase
+    // doesn't exist
+    std::vector<double> times;
+  };
+
+  std::shared_ptr<const Grid> getGrid(const Catalog::Station &station,
+                                      const std::string &phaseType);
+
+  std::shared_ptr<const Grid> loadOrBuildGrid(const Catalog::Station &station,
+                                              const std::string &phaseType);
+
+  std::shared_ptr<const Grid> buildGrid(const Catalog::Station &station,
+                                        const std::string &phaseType);
+
+  bool interpolate(const Grid &grid,
+                   double depth,
+                   double distance,
+                   double &travelTime,
+                   double &dTdDepth,
+                   double &dTdDistance) const;
+
+  std::string gridCacheFile(const Catalog::Station &station,
+                            const std::string &phaseType) const;
+  std::shared_ptr<const Grid> readGrid(const std::string &file,
+                                       const Catalog::Station &station) const;
+  void writeGrid(const Grid &grid, const std::string &file) const;
+
+  // the travel time table implementation of the calling thread
+  TravelTimeTableInterface *tttInterface();
+
+  // One travel time table implementation (e.g. LOCSAT) instance per thread,
+  // so that the threads don't have to serialize their computations
+  std::unordered_map<std::thread::id, TravelTimeTableInterfacePtr> _ttts;
+  std::mutex _tttsMutex;
+  const std::string _type;
+  const std::string _model;
+  const GridSpec _gridSpec;
+  const std::string _gridCacheDir;
+
+  // key = station id + phase type. The entries are inserted before the grid
+  // is ready, so that concurrent callers wait for the one build in progress
+  typedef std::shared_future<std::shared_ptr<const Grid>> GridFuture;
+  std::unordered_map<std::string, std::shared_ptr<GridFuture>> _grids;
+  std::mutex _gridsMutex;
 };
 
 DEFINE_SMARTPOINTER(TravelTimeTable);
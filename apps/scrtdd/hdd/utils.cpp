@@ -16,8 +16,12 @@
  ***************************************************************************/
 
 #include "utils.h"
+#include <boost/filesystem.hpp>
+#include <fstream>
 #include <seiscomp3/math/geo.h>
 #include <seiscomp3/math/math.h>
+#include <sstream>
+#include <thread>
 
 using namespace std;
 
@@ -127,5 +131,33 @@ double computeMeanAbsoluteDeviation(const std::vector<double> &values,
   return computeMean(absoluteDeviations);
 }
 
+bool writeFileAtomically(const std::string &file,
+                         const std::function<bool(std::ostream &)> &writer)
+{
+  std::ostringstream tmpFile;
+  tmpFile << file << ".tmp." << std::this_thread::get_id();
+
+  boost::system::error_code ec;
+  bool written;
+  try
+  {
+    std::ofstream out(tmpFile.str(), std::ios::binary);
+    written = out && writer(out) && out.flush();
+  }
+  catch (...)
+  {
+    boost::filesystem::remove(tmpFile.str(), ec);
+    throw;
+  }
+
+  if (written) boost::filesystem::rename(tmpFile.str(), file, ec);
+  if (!written || ec)
+  {
+    boost::filesystem::remove(tmpFile.str(), ec);
+    return false;
+  }
+  return true;
+}
+
 } // namespace HDD
 } // namespace Seiscomp
@@ -19,6 +19,9 @@
 #define __HDD_UTILS_H__
 
 #include "catalog.h"
+#include <functional>
+#include <limits>
+#include <ostream>
 #include <random>
 #include <seiscomp3/core/strings.h>
 #include <vector>
@@ -62,6 +65,26 @@ double computeMean(const std::vector<double> &values);
 double computeMeanAbsoluteDeviation(const std::vector<double> &values,
                                     const double mean);
 
+// smallest power of 2 >= a, starting from min. Returns 0 if that is bigger
+// than max
+template <class T>
+T nextPowerOf2(T a, T min = 1, T max = std::numeric_limits<T>::max())
+{
+  T b = min;
+  while (b < a)
+  {
+    if (b > max / 2) return 0;
+    b <<= 1;
+  }
+  return b;
+}
+
+// Write a file via writer: the data is written to a temporary file that is
+// then renamed to file. The rename is atomic, so concurrent readers never see
+// a partially written file. Returns false on error
+bool writeFileAtomically(const std::string &file,
+                         const std::function<bool(std::ostream &)> &writer);
+
 class Randomer
 {
 
@@ -16,11 +16,19 @@
  ***************************************************************************/
 
 #include "waveform.h"
+#include "fft.h"
+#include "resampler.h"
+#include "utils.h"
+#include "xcorrkernel.h"
 
+#include <algorithm>
 #include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/range/iterator_range_core.hpp>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <seiscomp3/client/inventory.h>
 #include <seiscomp3/core/datetime.h>
 #include <seiscomp3/datamodel/station.h>
@@ -31,6 +39,8 @@
 #include <seiscomp3/processing/operator/ncomps.h>
 #include <seiscomp3/processing/operator/transformation.h>
 #include <seiscomp3/utils/files.h>
+#include <sstream>
+#include <unordered_map>
 
 #define SEISCOMP_COMPONENT HDD
 #include <seiscomp3/logging/log.h>
@@ -44,15 +54,248 @@ using Catalog = HDD::Catalog;
 
 namespace {
 
-template <class T> T nextPowerOf2(T a, T min = 1, T max = 1 << 31)
+/*
+ * Decide whether the cross-correlation numerators are cheaper to compute via
+ * FFT than with the direct loop. The direct loop costs smpsSsize
+ * multiply-adds per delay, the FFT approach costs two transforms of the
+ * padded length (one forward for both traces, one inverse)
+ */
+bool useFFTXcorr(HDD::Waveform::XCorrEngine engine,
+                 int smpsSsize,
+                 int maxDelaySmps)
 {
-  int b = min;
-  while (b < a)
+  if (maxDelaySmps <= 0 || smpsSsize <= 0) return false;
+  if (engine == HDD::Waveform::XCorrEngine::DIRECT) return false;
+  if (engine == HDD::Waveform::XCorrEngine::FFT) return true;
+
+  // too few delays to amortize the FFT setup
+  const int numDelays = 2 * maxDelaySmps;
+  if (numDelays < 16) return false;
+
+  // the direct kernel computes as many delays at once as the SIMD lanes
+  double lanes = 1;
+  switch (HDD::XCorrKernel::detectIsa())
+  {
+  case HDD::XCorrKernel::Isa::AVX512: lanes = 8; break;
+  case HDD::XCorrKernel::Isa::AVX2: lanes = 4; break;
+  case HDD::XCorrKernel::Isa::SSE2: lanes = 2; break;
+  case HDD::XCorrKernel::Isa::SCALAR: break;
+  }
+
+  const double N          = HDD::nextPowerOf2(smpsSsize + numDelays - 1);
+  const double directCost = double(smpsSsize) * numDelays / lanes;
+  const double fftCost    = 6 * N * std::log2(N);
+  return fftCost < directCost;
+}
+
+/*
+ * The two traces to cross-correlate, sorted by length. The samples of the
+ * longer trace are accessed aligning the middle points of the two traces
+ */
+struct XCorrTraces
+{
+  const double *smpsS;
+  const double *smpsL;
+  int smpsSsize;
+  int smpsLsize;
+
+  double sampleAtLong(int idxS, int delay) const
   {
-    b <<= 1;
-    if (b > max) return -1;
+    int idxL = idxS + (smpsLsize - smpsSsize) / 2 + delay;
+    return (idxL < 0 || idxL >= smpsLsize) ? 0 : smpsL[idxL];
+  }
+};
+
+XCorrTraces makeXCorrTraces(const HDD::Waveform::TraceView &trShorter,
+                            const HDD::Waveform::TraceView &trLonger)
+{
+  return XCorrTraces{trShorter.data(), trLonger.data(), trShorter.size,
+                     trLonger.size};
+}
+
+double shortTraceEnergy(const XCorrTraces &t)
+{
+  double denomS = 0;
+  for (int idxS = 0; idxS < t.smpsSsize; idxS++)
+    denomS += t.smpsS[idxS] * t.smpsS[idxS];
+  return denomS;
+}
+
+/*
+ * Energy of the longer trace within the xcorr window, for every delay in
+ * [-maxDelaySmps, maxDelaySmps)
+ */
+vector<double> longTraceEnergies(const XCorrTraces &t, int maxDelaySmps)
+{
+  double denomL = 0;
+  for (int idxS = 0; idxS < t.smpsSsize; idxS++)
+  {
+    double sampleL = t.sampleAtLong(idxS, -(maxDelaySmps + 1));
+    denomL += sampleL * sampleL;
+  }
+
+  vector<double> denomLs(std::max(2 * maxDelaySmps, 0));
+  for (int delay = -maxDelaySmps; delay < maxDelaySmps; delay++)
+  {
+    // remove from denomL the sample that has exited the current xcorr win
+    double lastSampleL = t.sampleAtLong(-1, delay);
+    denomL -= lastSampleL * lastSampleL;
+    // add to denomL the sample that has just entered the current xcorr win
+    double newSampleL = t.sampleAtLong(t.smpsSsize - 1, delay);
+    denomL += newSampleL * newSampleL;
+
+    denomLs[delay + maxDelaySmps] = denomL;
+  }
+  return denomLs;
+}
+
+/*
+ * The portion of the longer trace covered by all the delays, zero padded where
+ * the longer trace is not long enough: seg[i] = sampleAtLong(i, -maxDelaySmps)
+ */
+vector<double> longTraceSegment(const XCorrTraces &t, int maxDelaySmps)
+{
+  vector<double> seg(t.smpsSsize + 2 * maxDelaySmps - 1);
+  for (unsigned i = 0; i < seg.size(); i++)
+    seg[i] = t.sampleAtLong(i, -maxDelaySmps);
+  return seg;
+}
+
+/*
+ * Numerators of the correlation series for every delay in
+ * [-maxDelaySmps, maxDelaySmps) computed with the time-domain loop
+ */
+vector<double> directNumerators(const XCorrTraces &t, int maxDelaySmps)
+{
+  const int numDelays = std::max(2 * maxDelaySmps, 0);
+  vector<double> numers(numDelays);
+  if (numDelays == 0) return numers;
+  // the zero padding is done once here, so that the SIMD kernel doesn't have
+  // to check the bounds of the long trace
+  vector<double> seg = longTraceSegment(t, maxDelaySmps);
+  HDD::XCorrKernel::numerators(t.smpsS, t.smpsSsize, seg.data(), numDelays,
+                               numers.data());
+  return numers;
+}
+
+/*
+ * Same as directNumerators but computed in the frequency domain
+ */
+vector<double> fftNumerators(const XCorrTraces &t, int maxDelaySmps)
+{
+  const int numDelays = 2 * maxDelaySmps;
+  vector<double> seg  = longTraceSegment(t, maxDelaySmps);
+  vector<double> numers(numDelays);
+  HDD::FFT::xcorr(t.smpsS, t.smpsSsize, seg.data(), seg.size(), numers.data(),
+                  numDelays);
+  return numers;
+}
+
+/*
+ * Normalize the correlation series, find the delay with the highest
+ * correlation coefficient and perform the quality check on the side lobes
+ */
+void evalXCorrSeries(const vector<double> &numers,
+                     double denomS,
+                     const vector<double> &denomLs,
+                     int maxDelaySmps,
+                     double freq,
+                     bool swap,
+                     bool qualityCheck,
+                     double &delayOut,
+                     double &coeffOut)
+{
+  coeffOut = std::nan("");
+
+  //
+  // for later quality check: save local maxima/minima
+  //
+  struct LocalMaxima
+  {
+    bool notDecreasing = false;
+    double prevCoeff   = -1;
+    vector<double> values;
+    void update(double coeff)
+    {
+      if (!std::isfinite(coeff)) return;
+      if (coeff < prevCoeff && notDecreasing) values.push_back(prevCoeff);
+      notDecreasing = coeff >= prevCoeff;
+      prevCoeff     = coeff;
+    }
+  };
+  LocalMaxima localMaxs, localMins;
+
+  // The delays where the long trace window has (almost) no energy, e.g. in
+  // the zero padding or in a gap, are skipped: there the direct numerators
+  // are 0/0, while the FFT ones are round-off noise over a tiny denominator,
+  // which would give an arbitrarily large coefficient
+  const double minDenomL =
+      denomLs.empty() ? 0
+                      : 1e-9 * *std::max_element(denomLs.begin(),
+                                                  denomLs.end());
+
+  // cross-correlation loop
+  for (int delay = -maxDelaySmps; delay < maxDelaySmps; delay++)
+  {
+    const double numer  = numers[delay + maxDelaySmps];
+    const double denomL = denomLs[delay + maxDelaySmps];
+    const double coeff  = denomL > minDenomL
+                              ? numer / std::sqrt(denomS * denomL)
+                              : std::nan("");
+
+    if (std::abs(coeff) > std::abs(coeffOut) || !std::isfinite(coeffOut))
+    {
+      coeffOut = coeff;
+      delayOut = delay / freq; // samples to secs
+    }
+
+    // for later quality check
+    localMaxs.update(coeff);
+    localMins.update(-coeff);
+  }
+
+  if (swap)
+  {
+    delayOut = -delayOut;
+  }
+
+  /*
+   * To avoid errors introduced by cycle skipping the differential time
+   * measurement is only accepted, if all side lobe maxima CCslm of the
+   * cross-correlation function fulfill the following condition:
+   *
+   *                CCslm < CCmax - ( (1.0-CCmax) / 2.0 )
+   *
+   * where CCmax corresponds to the global maximum of the cross-correlation
+   * function. By discarding measurements with local maxima CCslm close to the
+   * global maximum CC, the number of potential blunders due to cycle skipping
+   * is significantly reduced.
+   *
+   * See Diehl et al. (2017): The induced earthquake sequence related to the St.
+   * Gallen deep geothermal project: Fault reactivation and fluid interactions
+   * imaged by microseismicity
+   * */
+  if (qualityCheck && std::isfinite(coeffOut))
+  {
+    double threshold = std::abs(coeffOut) - ((1.0 - std::abs(coeffOut)) / 2.0);
+    int numMax       = 0;
+    vector<double> localMs = coeffOut > 0 ? localMaxs.values : localMins.values;
+    for (double CCslm : localMs)
+    {
+      if (std::isfinite(CCslm) && CCslm >= threshold) numMax++;
+      if (numMax > 1)
+      {
+        coeffOut = std::nan("");
+        break;
+      }
+    }
+  }
+
+  if (!std::isfinite(coeffOut))
+  {
+    coeffOut = 0;
+    delayOut = 0.;
   }
-  return b;
 }
 
 string waveformDebugPath(const string &wfDebugDir,
@@ -67,6 +310,13 @@ string waveformDebugPath(const string &wfDebugDir,
   return (boost::filesystem::path(wfDebugDir) / debugFile).string();
 }
 
+/*
+ * PROCESSING_VERSION must be increased when filter() changes its output, so
+ * that the results based on the traces processed by the previous versions
+ * (see processingId) are not used anymore
+ */
+const unsigned PROCESSING_VERSION = 2;
+
 } // namespace
 
 namespace Seiscomp {
@@ -104,34 +354,36 @@ std::string waveformId(const HDD::Catalog::Phase &ph,
                     ph.channelCode);
 }
 
-GenericRecordPtr readWaveformFromRecordStream(const string &recordStreamURL,
-                                              const Core::TimeWindow &tw,
-                                              const string &networkCode,
-                                              const string &stationCode,
-                                              const string &locationCode,
-                                              const string &channelCode)
+/*
+ * Identify the processing applied to a trace by filter(), for the keys of
+ * the processed traces disk cache and of the results computed from them
+ */
+std::string processingId(bool demeaning,
+                         const std::string &filterStr,
+                         double resampleFreq)
 {
-  IO::RecordStreamPtr rs = IO::RecordStream::Open(recordStreamURL.c_str());
-  if (rs == nullptr)
+  const string desc = stringify("v%u|%d|%s|%.9g", PROCESSING_VERSION,
+                                demeaning, filterStr.c_str(), resampleFreq);
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ull;
+  for (const char c : desc)
   {
-    string msg = "Cannot open RecordStream: " + recordStreamURL;
-    throw runtime_error(msg);
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
   }
+  return stringify("%016llx", static_cast<unsigned long long>(hash));
+}
 
-  rs->setTimeWindow(tw);
-  rs->addStream(networkCode, stationCode, locationCode, channelCode);
-
-  // Store each record in a RecordSequence
-  IO::RecordInput inp(rs.get(), Array::DOUBLE, Record::DATA_ONLY);
-  std::shared_ptr<RecordSequence> seq(new TimeWindowBuffer(tw));
-  RecordPtr rec;
-  while (rec = inp.next())
-  {
-    seq->feed(rec.get());
-  }
-  rs->close();
+namespace {
 
-  if (seq->empty())
+GenericRecordPtr buildTrace(const RecordSequence &seq,
+                            const Core::TimeWindow &tw,
+                            const string &networkCode,
+                            const string &stationCode,
+                            const string &locationCode,
+                            const string &channelCode)
+{
+  if (seq.empty())
   {
     string msg = stringify(
         "Data could not be loaded (stream %s.%s.%s.%s from %s length %.2f sec)",
@@ -142,7 +394,7 @@ GenericRecordPtr readWaveformFromRecordStream(const string &recordStreamURL,
 
   GenericRecordPtr trace = new GenericRecord();
 
-  if (!merge(*trace, *seq))
+  if (!merge(*trace, seq))
   {
     string msg = stringify(
         "Data records could not be merged into a single trace "
@@ -165,6 +417,173 @@ GenericRecordPtr readWaveformFromRecordStream(const string &recordStreamURL,
   return trace;
 }
 
+} // namespace
+
+GenericRecordPtr readWaveformFromRecordStream(const string &recordStreamURL,
+                                              const Core::TimeWindow &tw,
+                                              const string &networkCode,
+                                              const string &stationCode,
+                                              const string &locationCode,
+                                              const string &channelCode)
+{
+  IO::RecordStreamPtr rs = IO::RecordStream::Open(recordStreamURL.c_str());
+  if (rs == nullptr)
+  {
+    string msg = "Cannot open RecordStream: " + recordStreamURL;
+    throw runtime_error(msg);
+  }
+
+  rs->setTimeWindow(tw);
+  rs->addStream(networkCode, stationCode, locationCode, channelCode);
+
+  // Store each record in a RecordSequence
+  IO::RecordInput inp(rs.get(), Array::DOUBLE, Record::DATA_ONLY);
+  std::shared_ptr<RecordSequence> seq(new TimeWindowBuffer(tw));
+  RecordPtr rec;
+  while (rec = inp.next())
+  {
+    seq->feed(rec.get());
+  }
+  rs->close();
+
+  return buildTrace(*seq, tw, networkCode, stationCode, locationCode,
+                    channelCode);
+}
+
+std::vector<GenericRecordPtr>
+readWaveformsFromRecordStream(const string &recordStreamURL,
+                              const vector<StreamRequest> &requests,
+                              vector<bool> *sessionErrors,
+                              unsigned maxStreamsPerSession)
+{
+  vector<GenericRecordPtr> traces(requests.size());
+  if (sessionErrors) sessionErrors->assign(requests.size(), false);
+
+  vector<string> streamIds(requests.size());
+  for (size_t i = 0; i < requests.size(); i++)
+  {
+    const StreamRequest &req = requests[i];
+    streamIds[i] = req.networkCode + "." + req.stationCode + "." +
+                   req.locationCode + "." + req.channelCode;
+  }
+
+  // Sort the requests by stream and start time: the streams of a station end
+  // up in the same session and the overlapping time windows of a stream are
+  // next to each other
+  vector<size_t> order(requests.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    if (streamIds[a] != streamIds[b]) return streamIds[a] < streamIds[b];
+    return requests[a].tw.startTime() < requests[b].tw.startTime();
+  });
+
+  size_t next = 0;
+  while (next < order.size())
+  {
+    //
+    // Collect the streams of this session. Overlapping time windows of the
+    // same stream are merged in a single stream request
+    //
+    vector<std::pair<size_t, Core::TimeWindow>> streams; // request, window
+    unordered_map<string, vector<size_t>> requestsByStream;
+    for (; next < order.size(); next++)
+    {
+      const size_t idx           = order[next];
+      const Core::TimeWindow &tw = requests[idx].tw;
+
+      if (!streams.empty() &&
+          streamIds[streams.back().first] == streamIds[idx] &&
+          tw.startTime() <= streams.back().second.endTime())
+      {
+        streams.back().second = streams.back().second | tw;
+      }
+      else
+      {
+        if (streams.size() >= maxStreamsPerSession) break;
+        streams.emplace_back(idx, tw);
+      }
+      requestsByStream[streamIds[idx]].push_back(idx);
+    }
+
+    //
+    // Fetch the data and demultiplex the records
+    //
+    unordered_map<size_t, vector<RecordCPtr>> recordsByRequest;
+    try
+    {
+      IO::RecordStreamPtr rs = IO::RecordStream::Open(recordStreamURL.c_str());
+      if (rs == nullptr)
+      {
+        string msg = "Cannot open RecordStream: " + recordStreamURL;
+        throw runtime_error(msg);
+      }
+
+      for (const auto &stream : streams)
+      {
+        const StreamRequest &req = requests[stream.first];
+        rs->addStream(req.networkCode, req.stationCode, req.locationCode,
+                      req.channelCode, stream.second.startTime(),
+                      stream.second.endTime());
+      }
+
+      IO::RecordInput inp(rs.get(), Array::DOUBLE, Record::DATA_ONLY);
+      RecordPtr rec;
+      while (rec = inp.next())
+      {
+        const auto it = requestsByStream.find(rec->streamID());
+        if (it == requestsByStream.end()) continue;
+        const Core::TimeWindow recTw(rec->startTime(), rec->endTime());
+        for (size_t idx : it->second)
+        {
+          if (requests[idx].tw.overlaps(recTw))
+            recordsByRequest[idx].push_back(rec);
+        }
+      }
+      rs->close();
+    }
+    catch (exception &e)
+    {
+      SEISCOMP_WARNING("Failed to load %zu streams from %s: %s", streams.size(),
+                       recordStreamURL.c_str(), e.what());
+      if (sessionErrors)
+      {
+        for (const auto &kv : requestsByStream)
+          for (size_t idx : kv.second) (*sessionErrors)[idx] = true;
+      }
+    }
+
+    //
+    // Build the requested traces
+    //
+    for (const auto &kv : requestsByStream)
+    {
+      for (size_t idx : kv.second)
+      {
+        const StreamRequest &req    = requests[idx];
+        vector<RecordCPtr> &records = recordsByRequest[idx];
+        std::stable_sort(records.begin(), records.end(),
+                         [](const RecordCPtr &a, const RecordCPtr &b) {
+                           return a->startTime() < b->startTime();
+                         });
+        TimeWindowBuffer seq(req.tw);
+        for (const RecordCPtr &record : records) seq.feed(record.get());
+        try
+        {
+          traces[idx] = buildTrace(seq, req.tw, req.networkCode,
+                                   req.stationCode, req.locationCode,
+                                   req.channelCode);
+        }
+        catch (exception &e)
+        {
+          SEISCOMP_DEBUG("%s", e.what());
+        }
+      }
+    }
+  }
+
+  return traces;
+}
+
 bool merge(GenericRecord &trace, const RecordSequence &seq)
 {
   if (seq.empty())
@@ -238,11 +657,20 @@ bool merge(GenericRecord &trace, const RecordSequence &seq)
   return true;
 }
 
-bool trim(GenericRecord &trace, const Core::TimeWindow &tw)
+namespace {
+
+// samples within tw of the "size" samples of trace starting at startTime,
+// false if they don't contain tw
+bool trimRange(const GenericRecord &trace,
+               const Core::Time &startTime,
+               int size,
+               const Core::TimeWindow &tw,
+               int &ofs,
+               int &samples)
 {
-  int ofs     = (int)(double(tw.startTime() - trace.startTime()) *
-                  trace.samplingFrequency());
-  int samples = (int)(tw.length() * trace.samplingFrequency());
+  ofs     = (int)(double(tw.startTime() - startTime) *
+              trace.samplingFrequency());
+  samples = (int)(tw.length() * trace.samplingFrequency());
 
   // Not enough data at start of time window
   if (ofs < 0)
@@ -253,14 +681,44 @@ bool trim(GenericRecord &trace, const Core::TimeWindow &tw)
   }
 
   // Not enough data at end of time window
-  if (ofs + samples > trace.data()->size())
+  if (ofs + samples > size)
   {
     SEISCOMP_DEBUG("%s: need %d more samples past the end",
-                   trace.streamID().c_str(),
-                   trace.data()->size() - samples - ofs);
+                   trace.streamID().c_str(), size - samples - ofs);
     return false;
   }
 
+  return true;
+}
+
+void applyFilter(double *data,
+                 int size,
+                 double samplingFrequency,
+                 const std::string &filterStr)
+{
+  string filterError;
+  auto filter =
+      Math::Filtering::InPlaceFilter<double>::Create(filterStr, &filterError);
+  if (!filter)
+  {
+    string msg = stringify("Filter creation failed %s: %s", filterStr.c_str(),
+                           filterError.c_str());
+    throw runtime_error(msg);
+  }
+  filter->setSamplingFrequency(samplingFrequency);
+  filter->apply(size, data);
+  delete filter;
+}
+
+} // namespace
+
+bool trim(GenericRecord &trace, const Core::TimeWindow &tw)
+{
+  int ofs, samples;
+  if (!trimRange(trace, trace.startTime(), trace.data()->size(), tw, ofs,
+                 samples))
+    return false;
+
   ArrayPtr sliced = trace.data()->slice(ofs, ofs + samples);
 
   trace.setStartTime(tw.startTime());
@@ -269,6 +727,43 @@ bool trim(GenericRecord &trace, const Core::TimeWindow &tw)
   return true;
 }
 
+GenericRecordPtr trimmedCopy(const GenericRecord &trace,
+                             const Core::TimeWindow &tw)
+{
+  int ofs, samples;
+  if (!trimRange(trace, trace.startTime(), trace.data()->size(), tw, ofs,
+                 samples))
+    return nullptr;
+
+  GenericRecordPtr trimmed = new GenericRecord(
+      trace.networkCode(), trace.stationCode(), trace.locationCode(),
+      trace.channelCode(), tw.startTime(), trace.samplingFrequency());
+  ArrayPtr sliced = trace.data()->slice(ofs, ofs + samples);
+  trimmed->setData(sliced.get());
+  return trimmed;
+}
+
+TraceView::TraceView(const GenericRecord &tr)
+    : trace(&tr), offset(0), size(tr.data()->size()), startTime(tr.startTime())
+{}
+
+const double *TraceView::data() const
+{
+  return DoubleArray::ConstCast(trace->data())->typedData() + offset;
+}
+
+bool trim(TraceView &view, const Core::TimeWindow &tw)
+{
+  int ofs, samples;
+  if (!trimRange(*view.trace, view.startTime, view.size, tw, ofs, samples))
+    return false;
+
+  view.offset    = view.offset + ofs;
+  view.size      = samples;
+  view.startTime = tw.startTime();
+  return true;
+}
+
 void filter(GenericRecord &trace,
             bool demeaning,
             const std::string &filterStr,
@@ -289,22 +784,62 @@ void filter(GenericRecord &trace,
 
   if (!filterStr.empty())
   {
-    string filterError;
-    auto filter =
-        Math::Filtering::InPlaceFilter<double>::Create(filterStr, &filterError);
-    if (!filter)
-    {
-      string msg = stringify("Filter creation failed %s: %s", filterStr.c_str(),
-                             filterError.c_str());
-      throw runtime_error(msg);
-    }
-    filter->setSamplingFrequency(trace.samplingFrequency());
-    filter->apply(data->size(), data->typedData());
-    delete filter;
+    applyFilter(data->typedData(), data->size(), trace.samplingFrequency(),
+                filterStr);
     trace.dataUpdated();
   }
 }
 
+GenericRecordPtr processedCopy(const GenericRecord &trace,
+                               bool demeaning,
+                               const std::string &filterStr,
+                               double resampleFreq)
+{
+  const DoubleArray *data = DoubleArray::ConstCast(trace.data());
+  const double mean       = demeaning ? data->mean() : 0;
+
+  GenericRecordPtr processed = new GenericRecord(
+      trace.networkCode(), trace.stationCode(), trace.locationCode(),
+      trace.channelCode(), trace.startTime(), trace.samplingFrequency());
+
+  std::shared_ptr<const Resampler> resampler;
+  if (resampleFreq > 0 && resampleFreq != trace.samplingFrequency())
+    resampler = Resampler::get(trace.samplingFrequency(), resampleFreq);
+
+  // copy, demean and resample the data in one pass
+  DoubleArrayPtr output;
+  if (resampler)
+  {
+    output = new DoubleArray(resampler->outputSize(data->size()));
+    resampler->apply(data->typedData(), data->size(), output->typedData(),
+                     mean);
+    processed->setSamplingFrequency(resampleFreq);
+  }
+  else
+  {
+    output            = new DoubleArray(data->size());
+    const double *in  = data->typedData();
+    double *out       = output->typedData();
+    const int numSmps = data->size();
+    for (int i = 0; i < numSmps; i++) out[i] = in[i] - mean;
+  }
+  processed->setData(output.get());
+
+  // the frequencies are not in a rational ratio
+  if (!resampler && resampleFreq > 0)
+    resample(*processed, resampleFreq, true);
+
+  if (!filterStr.empty())
+  {
+    DoubleArray *outData = DoubleArray::Cast(processed->data());
+    applyFilter(outData->typedData(), outData->size(),
+                processed->samplingFrequency(), filterStr);
+  }
+
+  processed->dataUpdated();
+  return processed;
+}
+
 void resample(GenericRecord &trace, double sf, bool average)
 {
   if (sf <= 0) return;
@@ -312,7 +847,23 @@ void resample(GenericRecord &trace, double sf, bool average)
   if (trace.samplingFrequency() == sf) return;
 
   DoubleArray *data = DoubleArray::Cast(trace.data());
-  double step       = trace.samplingFrequency() / sf;
+
+  // Anti-aliased polyphase resampling when the frequencies are in a rational
+  // ratio (the usual case), otherwise the nearest sample/averaging fallback
+  std::shared_ptr<const Resampler> resampler =
+      Resampler::get(trace.samplingFrequency(), sf);
+  if (resampler)
+  {
+    const vector<double> resampled =
+        resampler->apply(data->typedData(), data->size());
+    data->resize(resampled.size());
+    std::copy(resampled.begin(), resampled.end(), data->typedData());
+    trace.setSamplingFrequency(sf);
+    trace.dataUpdated();
+    return;
+  }
+
+  double step = trace.samplingFrequency() / sf;
 
   if (trace.samplingFrequency() < sf) // upsampling
   {
@@ -375,22 +926,40 @@ void resample(GenericRecord &trace, double sf, bool average)
   trace.dataUpdated();
 }
 
+void writeTrace(const GenericRecordCPtr &trace, std::ostream &os)
+{
+  IO::MSeedRecord msRec(*trace);
+  int reclen = msRec.data()->size() * msRec.data()->bytes() + 64;
+  reclen     = nextPowerOf2<int>(reclen, 128,
+                             1048576); // MINRECLEN 128, MAXRECLEN 1048576
+  if (reclen > 0)
+  {
+    msRec.setOutputRecordLength(reclen);
+    msRec.write(os);
+  }
+}
+
+GenericRecordPtr readTrace(std::istream &is)
+{
+  IO::MSeedRecord msRec(Array::DOUBLE, Record::Hint::DATA_ONLY);
+  msRec.read(is);
+  GenericRecordPtr trace = new GenericRecord(msRec);
+  trace->setData(msRec.data()->clone()); // copy data too
+  return trace;
+}
+
 void writeTrace(GenericRecordCPtr trace, const std::string &file)
 {
   if (!trace) return;
 
   try
   {
-    std::ofstream ofs(file);
-    IO::MSeedRecord msRec(*trace);
-    int reclen = msRec.data()->size() * msRec.data()->bytes() + 64;
-    reclen     = nextPowerOf2<int>(reclen, 128,
-                               1048576); // MINRECLEN 128, MAXRECLEN 1048576
-    if (reclen > 0)
-    {
-      msRec.setOutputRecordLength(reclen);
-      msRec.write(ofs);
-    }
+    bool written = writeFileAtomically(file, [&trace](std::ostream &os) {
+      writeTrace(trace, os);
+      return os.good();
+    });
+    if (!written)
+      SEISCOMP_WARNING("Couldn't write waveform to disk %s", file.c_str());
   }
   catch (exception &e)
   {
@@ -406,11 +975,7 @@ GenericRecordPtr readTrace(const std::string &file)
   try
   {
     std::ifstream ifs(file);
-    IO::MSeedRecord msRec(Array::DOUBLE, Record::Hint::DATA_ONLY);
-    msRec.read(ifs);
-    GenericRecordPtr trace = new GenericRecord(msRec);
-    trace->setData(msRec.data()->clone()); // copy data too
-    return trace;
+    return readTrace(ifs);
   }
   catch (exception &e)
   {
@@ -431,136 +996,185 @@ bool xcorr(const GenericRecordCPtr &tr1,
            double maxDelay,
            bool qualityCheck,
            double &delayOut,
-           double &coeffOut)
+           double &coeffOut,
+           XCorrEngine engine)
+{
+  return xcorr(TraceView(*tr1), TraceView(*tr2), maxDelay, qualityCheck,
+               delayOut, coeffOut, engine);
+}
+
+bool xcorr(const TraceView &tr1,
+           const TraceView &tr2,
+           double maxDelay,
+           bool qualityCheck,
+           double &delayOut,
+           double &coeffOut,
+           XCorrEngine engine)
 {
   coeffOut = std::nan("");
 
-  if (tr1->samplingFrequency() != tr2->samplingFrequency())
+  if (tr1.samplingFrequency() != tr2.samplingFrequency())
   {
     SEISCOMP_INFO(
         "Cannot cross correlate traces with different sampling freq (%f!=%f)",
-        tr1->samplingFrequency(), tr2->samplingFrequency());
+        tr1.samplingFrequency(), tr2.samplingFrequency());
     return false;
   }
 
-  const double freq      = tr1->samplingFrequency();
+  const double freq      = tr1.samplingFrequency();
   const int maxDelaySmps = maxDelay * freq; // secs to samples
 
   // check longest/shortest trace
-  const bool swap             = tr1->data()->size() > tr2->data()->size();
-  GenericRecordCPtr trShorter = swap ? tr2 : tr1;
-  GenericRecordCPtr trLonger  = swap ? tr1 : tr2;
-
-  const double *smpsS = DoubleArray::ConstCast(trShorter->data())->typedData();
-  const double *smpsL = DoubleArray::ConstCast(trLonger->data())->typedData();
-  const int smpsSsize = trShorter->data()->size();
-  const int smpsLsize = trLonger->data()->size();
-
-  //
-  // for later quality check: save local maxima/minima
-  //
-  struct LocalMaxima
-  {
-    bool notDecreasing = false;
-    double prevCoeff   = -1;
-    vector<double> values;
-    void update(double coeff)
-    {
-      if (!std::isfinite(coeff)) return;
-      if (coeff < prevCoeff && notDecreasing) values.push_back(prevCoeff);
-      notDecreasing = coeff >= prevCoeff;
-      prevCoeff     = coeff;
-    }
-  };
-  LocalMaxima localMaxs, localMins;
-
-  auto sampleAtLong = [&smpsSsize, &smpsLsize, &smpsL](int idxS, int delay) {
-    int idxL = idxS + (smpsLsize - smpsSsize) / 2 + delay;
-    return (idxL < 0 || idxL >= smpsLsize) ? 0 : smpsL[idxL];
-  };
+  const bool swap       = tr1.size > tr2.size;
+  const XCorrTraces trs = swap ? makeXCorrTraces(tr2, tr1)
+                               : makeXCorrTraces(tr1, tr2);
+
+  const vector<double> numers =
+      useFFTXcorr(engine, trs.smpsSsize, maxDelaySmps)
+          ? fftNumerators(trs, maxDelaySmps)
+          : directNumerators(trs, maxDelaySmps);
+
+  evalXCorrSeries(numers, shortTraceEnergy(trs),
+                  longTraceEnergies(trs, maxDelaySmps), maxDelaySmps, freq,
+                  swap, qualityCheck, delayOut, coeffOut);
+  return true;
+}
 
-  // do as much computation as possible outside the main xcorr loop
-  double denomL = 0, denomS = 0;
-  for (int idxS = 0; idxS < smpsSsize; idxS++)
+/*
+ * One-vs-many version of xcorr: results[i] is the same as
+ * xcorr(ref, others[i], ...) but all the computation that depends on ref only
+ * (energy, long trace segment, spectrum) is performed once for all the traces
+ * sharing the same length. When the FFT engine is used the other traces are
+ * also transformed two at a time
+ */
+std::vector<XCorrResult> xcorr(const GenericRecordCPtr &ref,
+                               const std::vector<GenericRecordCPtr> &others,
+                               double maxDelay,
+                               bool qualityCheck,
+                               XCorrEngine engine)
+{
+  vector<TraceView> otherViews(others.size());
+  for (size_t i = 0; i < others.size(); i++)
   {
-    denomS += smpsS[idxS] * smpsS[idxS];
-    double sampleL = sampleAtLong(idxS, -(maxDelaySmps + 1));
-    denomL += sampleL * sampleL;
+    if (others[i]) otherViews[i] = TraceView(*others[i]);
   }
+  return xcorr(TraceView(*ref), otherViews, maxDelay, qualityCheck, engine);
+}
 
-  // cross-correlation loop
-  for (int delay = -maxDelaySmps; delay < maxDelaySmps; delay++)
-  {
-    // remove from denomL the sample that has exited the current xcorr win
-    double lastSampleL = sampleAtLong(-1, delay);
-    denomL -= lastSampleL * lastSampleL;
-    // add to denomL the sample that has just entered the current xcorr win
-    double newSampleL = sampleAtLong(smpsSsize - 1, delay);
-    denomL += newSampleL * newSampleL;
-
-    // compute numerator
-    double numer = 0;
-    for (int idxS = 0; idxS < smpsSsize; idxS++)
-      numer += smpsS[idxS] * sampleAtLong(idxS, delay);
-
-    const double denom = std::sqrt(denomS * denomL);
-    const double coeff = numer / denom;
-
-    if (std::abs(coeff) > std::abs(coeffOut) || !std::isfinite(coeffOut))
-    {
-      coeffOut = coeff;
-      delayOut = delay / freq; // samples to secs
-    }
-
-    // for later quality check
-    localMaxs.update(coeff);
-    localMins.update(-coeff);
-  }
+std::vector<XCorrResult> xcorr(const TraceView &ref,
+                               const std::vector<TraceView> &others,
+                               double maxDelay,
+                               bool qualityCheck,
+                               XCorrEngine engine)
+{
+  std::vector<XCorrResult> results(others.size(), XCorrResult{false, 0., 0.});
 
-  if (swap)
-  {
-    delayOut = -delayOut;
-  }
+  const double freq      = ref.samplingFrequency();
+  const int maxDelaySmps = maxDelay * freq; // secs to samples
+  const int numDelays    = std::max(2 * maxDelaySmps, 0);
+  const int refSize      = ref.size;
 
-  /*
-   * To avoid errors introduced by cycle skipping the differential time
-   * measurement is only accepted, if all side lobe maxima CCslm of the
-   * cross-correlation function fulfill the following condition:
-   *
-   *                CCslm < CCmax - ( (1.0-CCmax) / 2.0 )
-   *
-   * where CCmax corresponds to the global maximum of the cross-correlation
-   * function. By discarding measurements with local maxima CCslm close to the
-   * global maximum CC, the number of potential blunders due to cycle skipping
-   * is significantly reduced.
-   *
-   * See Diehl et al. (2017): The induced earthquake sequence related to the St.
-   * Gallen deep geothermal project: Fault reactivation and fluid interactions
-   * imaged by microseismicity
-   * */
-  if (qualityCheck && std::isfinite(coeffOut))
+  // group the traces by length: within a group ref plays always the same role
+  // (shorter or longer trace) and everything that depends on ref is the same
+  map<int, vector<size_t>> groups;
+  for (size_t i = 0; i < others.size(); i++)
   {
-    double threshold = std::abs(coeffOut) - ((1.0 - std::abs(coeffOut)) / 2.0);
-    int numMax       = 0;
-    vector<double> localMs = coeffOut > 0 ? localMaxs.values : localMins.values;
-    for (double CCslm : localMs)
+    if (!others[i].trace) continue;
+    if (others[i].samplingFrequency() != freq)
     {
-      if (std::isfinite(CCslm) && CCslm >= threshold) numMax++;
-      if (numMax > 1)
-      {
-        coeffOut = std::nan("");
-        break;
-      }
+      SEISCOMP_INFO(
+          "Cannot cross correlate traces with different sampling freq (%f!=%f)",
+          freq, others[i].samplingFrequency());
+      continue;
     }
+    groups[others[i].size].push_back(i);
   }
 
-  if (!std::isfinite(coeffOut))
+  for (const auto &kv : groups)
   {
-    coeffOut = 0;
-    delayOut = 0.;
+    const vector<size_t> &members = kv.second;
+    const bool swap               = refSize > kv.first; // ref is the longer
+
+    auto tracesOf = [&](size_t i) {
+      return swap ? makeXCorrTraces(others[i], ref)
+                  : makeXCorrTraces(ref, others[i]);
+    };
+
+    const XCorrTraces refTrs = tracesOf(members[0]);
+    const int smpsSsize      = refTrs.smpsSsize;
+
+    // ref energy
+    double refDenomS = 0;
+    vector<double> refDenomLs;
+    if (swap)
+      refDenomLs = longTraceEnergies(refTrs, maxDelaySmps);
+    else
+      refDenomS = shortTraceEnergy(refTrs);
+
+    // correlation series numerators
+    vector<vector<double>> numers(members.size());
+
+    if (useFFTXcorr(engine, smpsSsize, maxDelaySmps))
+    {
+      // ref spectrum: ref is either the shorter trace or the segment of the
+      // longer trace covered by all the delays
+      const int segLen = smpsSsize + numDelays - 1;
+      vector<double> refSeg;
+      std::unique_ptr<HDD::FFT::Correlator> correlator;
+      if (swap)
+      {
+        refSeg = longTraceSegment(refTrs, maxDelaySmps);
+        correlator.reset(
+            new HDD::FFT::Correlator(refSeg.data(), segLen, segLen, false));
+      }
+      else
+      {
+        correlator.reset(
+            new HDD::FFT::Correlator(refTrs.smpsS, smpsSsize, segLen, true));
+      }
+
+      // the other traces contribute the shorter trace or the segment of the
+      // longer trace, the opposite of ref
+      vector<double> buf1, buf2;
+      auto operandOf = [&](size_t i, vector<double> &buf) -> const double * {
+        const XCorrTraces trs = tracesOf(i);
+        if (swap) return trs.smpsS;
+        buf = longTraceSegment(trs, maxDelaySmps);
+        return buf.data();
+      };
+      const int operandSize = swap ? smpsSsize : segLen;
+
+      for (size_t m = 0; m < members.size(); m += 2)
+      {
+        const bool hasPair = (m + 1) < members.size();
+        numers[m].resize(numDelays);
+        if (hasPair) numers[m + 1].resize(numDelays);
+        correlator->xcorr(operandOf(members[m], buf1), operandSize,
+                          numers[m].data(),
+                          hasPair ? operandOf(members[m + 1], buf2) : nullptr,
+                          operandSize,
+                          hasPair ? numers[m + 1].data() : nullptr, numDelays);
+      }
+    }
+    else
+    {
+      for (size_t m = 0; m < members.size(); m++)
+        numers[m] = directNumerators(tracesOf(members[m]), maxDelaySmps);
+    }
+
+    for (size_t m = 0; m < members.size(); m++)
+    {
+      const XCorrTraces trs = tracesOf(members[m]);
+      XCorrResult &result   = results[members[m]];
+      evalXCorrSeries(numers[m], swap ? shortTraceEnergy(trs) : refDenomS,
+                      swap ? refDenomLs : longTraceEnergies(trs, maxDelaySmps),
+                      maxDelaySmps, freq, swap, qualityCheck, result.delay,
+                      result.coeff);
+      result.performed = true;
+    }
   }
 
-  return true;
+  return results;
 }
 
 double computeSnr(const GenericRecordCPtr &tr,
@@ -612,8 +1226,11 @@ double computeSnr(const GenericRecordCPtr &tr,
 
 GenericRecordPtr Loader::readAndProjectWaveform(const Core::TimeWindow &tw,
                                                 const Catalog::Phase &ph,
-                                                const Catalog::Event &ev)
+                                                const Catalog::Event &ev,
+                                                bool *sessionError)
 {
+  if (sessionError) *sessionError = false;
+
   string wfDesc = stringify("Waveform Projection for '%s'", string(ph).c_str());
 
   string channelCodeRoot = getBandAndInstrumentCodes(ph.channelCode);
@@ -730,42 +1347,54 @@ GenericRecordPtr Loader::readAndProjectWaveform(const Core::TimeWindow &tw,
   }
 
   //
-  // Load the components
+  // Load the components, the ones that are not cached are fetched together
   //
-  auto loadWaveform = [this](
-                          const string &networkCode, const string &stationCode,
-                          const string &locationCode, const string &channelCode,
-                          const Core::TimeWindow &tw) {
-    GenericRecordCPtr trace;
+  const string compCodes[3] = {
+      tc.comps[ThreeComponents::Vertical]->code(),
+      tc.comps[ThreeComponents::FirstHorizontal]->code(),
+      tc.comps[ThreeComponents::SecondHorizontal]->code()};
+  GenericRecordCPtr compTraces[3];
+  vector<StreamRequest> toDownload;
+  vector<unsigned> toDownloadComps;
+  for (unsigned i = 0; i < 3; i++)
+  {
     if (_doCaching && !_cacheProcessed)
     {
-      trace =
-          getFromCache(tw, networkCode, stationCode, locationCode, channelCode);
-      if (trace) _counters_wf_cached++;
+      compTraces[i] = getFromCache(tw, ph.networkCode, ph.stationCode,
+                                   ph.locationCode, compCodes[i]);
+      if (compTraces[i]) _counters_wf_cached++;
     }
-    if (!trace)
+    if (!compTraces[i])
     {
-      trace =
-          readWaveformFromRecordStream(_recordStreamURL, tw, networkCode,
-                                       stationCode, locationCode, channelCode);
-      _counters_wf_downloaded++;
+      toDownload.push_back({tw, ph.networkCode, ph.stationCode,
+                            ph.locationCode, compCodes[i]});
+      toDownloadComps.push_back(i);
     }
-    if (trace && _doCaching && !_cacheProcessed)
+  }
+  if (!toDownload.empty())
+  {
+    vector<bool> compSessionErrors;
+    vector<GenericRecordPtr> downloaded = readWaveformsFromRecordStream(
+        _recordStreamURL, toDownload, &compSessionErrors);
+    for (size_t i = 0; i < downloaded.size(); i++)
     {
-      storeInCache(tw, networkCode, stationCode, locationCode, channelCode,
-                   trace);
+      const StreamRequest &req = toDownload[i];
+      if (!downloaded[i])
+      {
+        if (sessionError && compSessionErrors[i]) *sessionError = true;
+        string msg = stringify("Unable to load component %s (%s)",
+                               req.channelCode.c_str(), wfDesc.c_str());
+        throw runtime_error(msg);
+      }
+      _counters_wf_downloaded++;
+      compTraces[toDownloadComps[i]] = downloaded[i];
+      if (_doCaching && !_cacheProcessed)
+      {
+        storeInCache(tw, req.networkCode, req.stationCode, req.locationCode,
+                     req.channelCode, downloaded[i]);
+      }
     }
-    return trace;
-  };
-  GenericRecordCPtr tr1 =
-      loadWaveform(ph.networkCode, ph.stationCode, ph.locationCode,
-                   tc.comps[ThreeComponents::Vertical]->code(), tw);
-  GenericRecordCPtr tr2 =
-      loadWaveform(ph.networkCode, ph.stationCode, ph.locationCode,
-                   tc.comps[ThreeComponents::FirstHorizontal]->code(), tw);
-  GenericRecordCPtr tr3 =
-      loadWaveform(ph.networkCode, ph.stationCode, ph.locationCode,
-                   tc.comps[ThreeComponents::SecondHorizontal]->code(), tw);
+  }
 
   // The wrapper will direct 3 codes into the right slots using the
   // Stream configuration class and will finally use the transformation
@@ -812,9 +1441,7 @@ GenericRecordPtr Loader::readAndProjectWaveform(const Core::TimeWindow &tw,
   // op.setStoreFunc(boost::bind(&RecordSequence::feed, seq, _1));
   op.setStoreFunc(boost::bind(&DataStorer::store, projectedData, _1));
 
-  op.feed(tr1.get());
-  op.feed(tr2.get());
-  op.feed(tr3.get());
+  for (const GenericRecordCPtr &trace : compTraces) op.feed(trace.get());
 
   std::shared_ptr<RecordSequence> seq = projectedData._seq;
 
@@ -854,50 +1481,131 @@ GenericRecordCPtr Loader::get(const Core::TimeWindow &tw,
                               const std::string &filterStr,
                               double resampleFreq)
 {
-  GenericRecordCPtr trace;
-  bool isProcessed;
-  bool isCached;
+  return get(vector<Request>{{tw, &ph, &ev}}, demeaning, filterStr,
+             resampleFreq)
+      .front();
+}
+
+std::vector<GenericRecordCPtr> Loader::get(const vector<Request> &requests,
+                                           bool demeaning,
+                                           const std::string &filterStr,
+                                           double resampleFreq)
+{
+  vector<GenericRecordCPtr> traces(requests.size());
+  vector<size_t> toLoad;
 
   if (_doCaching)
   {
-    trace = getFromCache(tw, ph.networkCode, ph.stationCode, ph.locationCode,
-                         ph.channelCode);
-    if (trace)
+    for (size_t i = 0; i < requests.size(); i++)
     {
-      isCached    = true;
-      isProcessed = _cacheProcessed;
-      _counters_wf_cached++;
+      const Request &req = requests[i];
+      traces[i] = getFromCache(req.tw, req.ph->networkCode, req.ph->stationCode,
+                               req.ph->locationCode, req.ph->channelCode);
+      if (traces[i])
+      {
+        _counters_wf_cached++;
+        traces[i] = processAndCache(traces[i], true, _cacheProcessed, req,
+                                    demeaning, filterStr, resampleFreq);
+      }
+      else
+        toLoad.push_back(i);
     }
   }
+  else
+  {
+    for (size_t i = 0; i < requests.size(); i++) toLoad.push_back(i);
+  }
+
+  if (toLoad.empty()) return traces;
 
-  // if the trace is not cached try loading it
-  if (!trace)
+  if (_auxLdr)
+  {
+    // Load traces from the auxiliary loader
+    vector<Request> auxRequests;
+    for (size_t i : toLoad) auxRequests.push_back(requests[i]);
+    vector<GenericRecordCPtr> auxTraces =
+        _auxLdr->get(auxRequests, demeaning, filterStr, resampleFreq);
+    for (size_t j = 0; j < toLoad.size(); j++)
+    {
+      const size_t i = toLoad[j];
+      if (!auxTraces[j]) continue;
+      traces[i] = processAndCache(auxTraces[j], false, true, requests[i],
+                                  demeaning, filterStr, resampleFreq);
+    }
+  }
+  else if (!_recordStreamURL.empty())
   {
-    isCached = false;
-    if (_auxLdr)
+    // Skip the traces known to be unavailable
+    vector<size_t> toDownload;
+    for (size_t i : toLoad)
     {
-      // Load trace from the auxiliary loader
-      trace = _auxLdr->get(tw, ph, ev, demeaning, filterStr, resampleFreq);
-      isProcessed = true;
+      if (isKnownUnavailable(requests[i]))
+        _counters_wf_no_avail++;
+      else
+        toDownload.push_back(i);
     }
-    else if (!_recordStreamURL.empty())
+
+    // Load traces from the configured record stream, all together
+    vector<StreamRequest> streamRequests;
+    for (size_t i : toDownload)
     {
-      // Load trace from the configured record stream
-      try
+      const Request &req = requests[i];
+      streamRequests.push_back({req.tw, req.ph->networkCode,
+                                req.ph->stationCode, req.ph->locationCode,
+                                req.ph->channelCode});
+    }
+    vector<bool> sessionErrors;
+    vector<GenericRecordPtr> downloaded = readWaveformsFromRecordStream(
+        _recordStreamURL, streamRequests, &sessionErrors);
+
+    // Retry once, all together, the requests whose session failed (e.g.
+    // connection refused or timeout)
+    vector<size_t> toRetry;
+    for (size_t j = 0; j < toDownload.size(); j++)
+      if (sessionErrors[j]) toRetry.push_back(j);
+    if (!toRetry.empty())
+    {
+      SEISCOMP_INFO("Retrying %zu waveform requests to %s", toRetry.size(),
+                    _recordStreamURL.c_str());
+      vector<StreamRequest> retryRequests;
+      for (size_t j : toRetry) retryRequests.push_back(streamRequests[j]);
+      vector<bool> retryErrors;
+      vector<GenericRecordPtr> retried = readWaveformsFromRecordStream(
+          _recordStreamURL, retryRequests, &retryErrors);
+      for (size_t k = 0; k < toRetry.size(); k++)
+      {
+        downloaded[toRetry[k]]    = retried[k];
+        sessionErrors[toRetry[k]] = retryErrors[k];
+      }
+    }
+
+    for (size_t j = 0; j < toDownload.size(); j++)
+    {
+      const size_t i     = toDownload[j];
+      const Request &req = requests[i];
+      GenericRecordCPtr trace;
+      bool isCached = false;
+      if (downloaded[j])
       {
-        trace = readWaveformFromRecordStream(_recordStreamURL, tw,
-                                             ph.networkCode, ph.stationCode,
-                                             ph.locationCode, ph.channelCode);
+        trace = downloaded[j];
         _counters_wf_downloaded++;
       }
-      catch (exception &e)
+      else if (sessionErrors[j])
       {
-        SEISCOMP_DEBUG("%s", e.what());
+        // the record stream is not reachable: the projection would only send
+        // more failing requests
+        _counters_wf_no_avail++;
+        continue;
+      }
+      else
+      {
+        bool projSessionError = false;
         try
         {
           // if the waveform is not available, possibly a projection
           // 123->ZNE or ZNE->ZRT is required
-          trace = readAndProjectWaveform(tw, ph, ev);
+          trace = readAndProjectWaveform(req.tw, *req.ph, *req.ev,
+                                         &projSessionError);
           // raw traces are cached by readAndProjectWaveform
           if (!_cacheProcessed) isCached = true;
         }
@@ -905,58 +1613,208 @@ GenericRecordCPtr Loader::get(const Core::TimeWindow &tw,
         {
           SEISCOMP_DEBUG("%s", e.what());
         }
+
+        if (!trace)
+        {
+          _counters_wf_no_avail++;
+          // remember it only if the record stream answered without data
+          if (!projSessionError) storeUnavailable(req);
+          continue;
+        }
       }
-      isProcessed = false;
-      if (!trace) _counters_wf_no_avail++;
+
+      traces[i] = processAndCache(trace, isCached, false, req, demeaning,
+                                  filterStr, resampleFreq);
     }
   }
 
-  if (trace)
+  return traces;
+}
+
+GenericRecordCPtr Loader::processAndCache(GenericRecordCPtr trace,
+                                          bool isCached,
+                                          bool isProcessed,
+                                          const Request &req,
+                                          bool demeaning,
+                                          const std::string &filterStr,
+                                          double resampleFreq)
+{
+  const Catalog::Phase &ph = *req.ph;
+
+  // cache unprocessed trace
+  if (_doCaching && !isCached && !_cacheProcessed && !isProcessed)
+  {
+    storeInCache(req.tw, ph.networkCode, ph.stationCode, ph.locationCode,
+                 ph.channelCode, trace);
+  }
+
+  // process trace
+  if (!isProcessed)
+  {
+    trace       = processedCopy(*trace, demeaning, filterStr, resampleFreq);
+    isProcessed = true;
+  }
+
+  // cache processed trace
+  if (_doCaching && !isCached && _cacheProcessed && isProcessed)
+  {
+    storeInCache(req.tw, ph.networkCode, ph.stationCode, ph.locationCode,
+                 ph.channelCode, trace);
+  }
+
+  // Debugging waveforms: first time we load a waveform dump it
+  if (!_wfDebugDir.empty() && _doCaching && !isCached && isProcessed)
+  {
+    string ext = (ph.procInfo.source == Catalog::Phase::Source::THEORETICAL)
+                     ? "theoretical"
+                     : (ph.isManual ? "manual" : "automatic");
+    writeTrace(trace, waveformDebugPath(_wfDebugDir, *req.ev, ph, ext));
+  }
+
+  return trace;
+}
+
+void DiskCachedLoader::enableProcessedCache(const std::string &cacheDir)
+{
+  if (_cacheProcessed)
+  {
+    throw runtime_error(
+        "The processed traces of a processed cache are already cached");
+  }
+  _processedCacheDir = cacheDir;
+  _processedArchive  = PackedArchive::open(cacheDir);
+}
+
+void DiskCachedLoader::enableUnavailableCache(const std::string &cacheDir,
+                                              double ttl)
+{
+  _unavailableArchive = PackedArchive::open(cacheDir);
+  _unavailableTTL     = ttl;
+  compactUnavailableCache();
+}
+
+void DiskCachedLoader::compactUnavailableCache()
+{
+  // each expired entry that is requested again is appended anew, so drop the
+  // expired entries and the superseded values
+  const double now = double(Core::Time::GMT());
+  auto notExpired  = [this, now](const string &, const string &data) {
+    double requested;
+    return Core::fromString(requested, data) &&
+           now - requested < _unavailableTTL;
+  };
+  const size_t removed = _unavailableArchive->compact(notExpired);
+  _unavailableWrites = 0;
+  if (removed > 0)
+  {
+    SEISCOMP_DEBUG("Removed %zu expired entries from the unavailable waveforms "
+                   "cache",
+                   removed);
+  }
+}
+
+bool DiskCachedLoader::isKnownUnavailable(const Request &req)
+{
+  if (!_unavailableArchive) return false;
+
+  // the value is the time (seconds since epoch) the waveform was requested
+  string data;
+  if (!_unavailableArchive->read(waveformId(*req.ph, req.tw), data))
+    return false;
+  double requested;
+  if (!Core::fromString(requested, data)) return false;
+  return double(Core::Time::GMT()) - requested < _unavailableTTL;
+}
+
+void DiskCachedLoader::storeUnavailable(const Request &req)
+{
+  if (!_unavailableArchive) return;
+  _unavailableArchive->write(waveformId(*req.ph, req.tw),
+                             stringify("%.f", double(Core::Time::GMT())));
+  const size_t writes = ++_unavailableWrites;
+  if (writes > std::max<size_t>(_unavailableArchive->size(), 1000))
+    compactUnavailableCache();
+}
+
+std::vector<GenericRecordCPtr>
+DiskCachedLoader::get(const vector<Request> &requests,
+                      bool demeaning,
+                      const std::string &filterStr,
+                      double resampleFreq)
+{
+  if (!_processedArchive)
+    return Loader::get(requests, demeaning, filterStr, resampleFreq);
+
+  vector<GenericRecordCPtr> traces(requests.size());
+
+  // Look for traces already processed with the same settings, the others
+  // are loaded from the raw traces cache (or downloaded) and processed
+  const string procId = processingId(demeaning, filterStr, resampleFreq);
+  vector<string> keys(requests.size());
+  vector<size_t> toLoadIdx;
+  vector<Request> toLoad;
+  for (size_t i = 0; i < requests.size(); i++)
   {
-    // cache unprocessed trace
-    if (_doCaching && !isCached && !_cacheProcessed && !isProcessed)
+    const Request &req = requests[i];
+    keys[i]            = waveformId(*req.ph, req.tw) + "." + procId;
+    string data;
+    if (_processedArchive->read(keys[i], data))
     {
-      storeInCache(tw, ph.networkCode, ph.stationCode, ph.locationCode,
-                   ph.channelCode, trace);
+      try
+      {
+        std::istringstream iss(data);
+        traces[i] = readTrace(iss);
+      }
+      catch (exception &e)
+      {
+        SEISCOMP_WARNING("Couldn't load waveform %s from %s: %s",
+                         keys[i].c_str(), _processedCacheDir.c_str(),
+                         e.what());
+      }
     }
-
-    // process trace
-    if (!isProcessed)
+    if (traces[i])
     {
-      GenericRecordPtr nonConstTrace(new GenericRecord(*trace));
-      filter(*nonConstTrace, demeaning, filterStr, resampleFreq);
-      isProcessed = true;
-      trace       = nonConstTrace;
+      _counters_wf_cached++;
+      continue;
     }
+    toLoadIdx.push_back(i);
+    toLoad.push_back(req);
+  }
+
+  if (toLoad.empty()) return traces;
 
-    // cache processed trace
-    if (_doCaching && !isCached && _cacheProcessed && isProcessed)
+  vector<GenericRecordCPtr> loaded =
+      Loader::get(toLoad, demeaning, filterStr, resampleFreq);
+
+  for (size_t j = 0; j < toLoad.size(); j++)
+  {
+    if (!loaded[j]) continue;
+    const size_t i = toLoadIdx[j];
+    traces[i]      = loaded[j];
+    try
     {
-      storeInCache(tw, ph.networkCode, ph.stationCode, ph.locationCode,
-                   ph.channelCode, trace);
+      std::ostringstream oss;
+      writeTrace(traces[i], oss);
+      if (!_processedArchive->insert(keys[i], oss.str()))
+      {
+        SEISCOMP_DEBUG("Couldn't write waveform %s to %s", keys[i].c_str(),
+                       _processedCacheDir.c_str());
+      }
     }
-
-    // Debugging waveforms: first time we load a waveform dump it
-    if (!_wfDebugDir.empty() && _doCaching && !isCached && isProcessed)
+    catch (exception &e)
     {
-      string ext = (ph.procInfo.source == Catalog::Phase::Source::THEORETICAL)
-                       ? "theoretical"
-                       : (ph.isManual ? "manual" : "automatic");
-      writeTrace(trace, waveformDebugPath(_wfDebugDir, ev, ph, ext));
+      SEISCOMP_WARNING("Couldn't write waveform %s to %s: %s", keys[i].c_str(),
+                       _processedCacheDir.c_str(), e.what());
     }
   }
-
-  return trace;
+  return traces;
 }
 
 bool DiskCachedLoader::isCached(const Core::TimeWindow &tw,
                                 const Catalog::Phase &ph,
                                 const Catalog::Event &ev)
 {
-  const std::string cacheFile =
-      waveformPath(_cacheDir, tw, ph.networkCode, ph.stationCode,
-                   ph.locationCode, ph.channelCode);
-  return Util::fileExists(cacheFile);
+  return _archive->has(waveformId(ph, tw));
 }
 
 GenericRecordCPtr
@@ -966,9 +1824,21 @@ DiskCachedLoader::getFromCache(const Core::TimeWindow &tw,
                                const std::string &locationCode,
                                const std::string &channelCode)
 {
-  const std::string cacheFile = waveformPath(
-      _cacheDir, tw, networkCode, stationCode, locationCode, channelCode);
-  return readTrace(cacheFile);
+  const string wfId =
+      waveformId(tw, networkCode, stationCode, locationCode, channelCode);
+  string data;
+  if (!_archive->read(wfId, data)) return nullptr;
+  try
+  {
+    std::istringstream iss(data);
+    return readTrace(iss);
+  }
+  catch (exception &e)
+  {
+    SEISCOMP_WARNING("Couldn't load waveform %s from %s: %s", wfId.c_str(),
+                     _cacheDir.c_str(), e.what());
+    return nullptr;
+  }
 }
 
 void DiskCachedLoader::storeInCache(const Core::TimeWindow &tw,
@@ -978,22 +1848,126 @@ void DiskCachedLoader::storeInCache(const Core::TimeWindow &tw,
                                     const std::string &channelCode,
                                     const GenericRecordCPtr &trace)
 {
-  const std::string cacheFile = waveformPath(
-      _cacheDir, tw, networkCode, stationCode, locationCode, channelCode);
-  writeTrace(trace, cacheFile);
+  const string wfId =
+      waveformId(tw, networkCode, stationCode, locationCode, channelCode);
+  try
+  {
+    std::ostringstream oss;
+    writeTrace(trace, oss);
+    if (!_archive->insert(wfId, oss.str()))
+    {
+      SEISCOMP_DEBUG("Couldn't write waveform %s to %s", wfId.c_str(),
+                     _cacheDir.c_str());
+    }
+  }
+  catch (exception &e)
+  {
+    SEISCOMP_WARNING("Couldn't write waveform %s to %s: %s", wfId.c_str(),
+                     _cacheDir.c_str(), e.what());
+  }
+}
+
+unsigned importTraceFiles(const std::string &cacheDir)
+{
+  std::shared_ptr<PackedArchive> archive = PackedArchive::open(cacheDir);
+  if (archive->readOnly())
+  {
+    string msg = "Cannot import traces, the archive is in use: " + cacheDir;
+    throw runtime_error(msg);
+  }
+
+  unsigned imported = 0;
+  for (const auto &entry : boost::make_iterator_range(
+           boost::filesystem::directory_iterator(cacheDir), {}))
+  {
+    const boost::filesystem::path &file = entry.path();
+    if (!boost::filesystem::is_regular_file(file) ||
+        file.extension() != ".mseed")
+      continue;
+
+    std::ifstream ifs(file.string(), std::ios::binary);
+    const string data((std::istreambuf_iterator<char>(ifs)),
+                      std::istreambuf_iterator<char>());
+    if (!ifs || !archive->insert(file.stem().string(), data))
+    {
+      SEISCOMP_WARNING("Couldn't import %s", file.string().c_str());
+      continue;
+    }
+    ifs.close();
+
+    boost::system::error_code ec;
+    boost::filesystem::remove(file, ec);
+    if (++imported % 10000 == 0)
+      SEISCOMP_INFO("Imported %u traces into %s", imported, cacheDir.c_str());
+  }
+  return imported;
+}
+
+namespace {
+std::shared_ptr<PackedArchive> openExistingArchive(const std::string &cacheDir)
+{
+  if (!Util::fileExists(
+          (boost::filesystem::path(cacheDir) / "index").string()))
+  {
+    string msg = "Not a waveform cache directory: " + cacheDir;
+    throw runtime_error(msg);
+  }
+  return PackedArchive::open(cacheDir);
+}
+} // namespace
+
+std::vector<std::string> listTraces(const std::string &cacheDir)
+{
+  std::vector<std::string> wfIds = openExistingArchive(cacheDir)->keys();
+  std::sort(wfIds.begin(), wfIds.end());
+  return wfIds;
+}
+
+unsigned exportTraceFiles(const std::string &cacheDir,
+                          const std::string &outputDir)
+{
+  std::shared_ptr<PackedArchive> archive = openExistingArchive(cacheDir);
+
+  if (!Util::pathExists(outputDir) && !Util::createPath(outputDir))
+  {
+    string msg = "Unable to create directory: " + outputDir;
+    throw runtime_error(msg);
+  }
+
+  unsigned exported = 0;
+  for (const string &wfId : archive->keys())
+  {
+    string data;
+    if (!archive->read(wfId, data)) continue;
+
+    const string file =
+        (boost::filesystem::path(outputDir) / (wfId + ".mseed")).string();
+    bool written = writeFileAtomically(file, [&data](std::ostream &os) {
+      os.write(data.data(), data.size());
+      return os.good();
+    });
+    if (!written)
+    {
+      SEISCOMP_WARNING("Couldn't export %s", file.c_str());
+      continue;
+    }
+    if (++exported % 10000 == 0)
+      SEISCOMP_INFO("Exported %u traces into %s", exported, outputDir.c_str());
+  }
+  return exported;
 }
 
-std::string DiskCachedLoader::waveformPath(const std::string &cacheDir,
-                                           const Core::TimeWindow &tw,
-                                           const std::string &networkCode,
-                                           const std::string &stationCode,
-                                           const std::string &locationCode,
-                                           const std::string &channelCode) const
+bool hasTraceFiles(const std::string &cacheDir)
 {
-  std::string cacheFile =
-      waveformId(tw, networkCode, stationCode, locationCode, channelCode) +
-      ".mseed";
-  return (boost::filesystem::path(cacheDir) / cacheFile).string();
+  if (!Util::pathExists(cacheDir)) return false;
+  for (const auto &entry : boost::make_iterator_range(
+           boost::filesystem::directory_iterator(cacheDir), {}))
+  {
+    if (boost::filesystem::is_regular_file(entry.path()) &&
+        entry.path().extension() == ".mseed")
+      return true;
+  }
+  return false;
 }
 
 bool MemCachedLoader::isCached(const Core::TimeWindow &tw,
@@ -1001,10 +1975,23 @@ bool MemCachedLoader::isCached(const Core::TimeWindow &tw,
                                const Catalog::Event &ev)
 {
   const string wfId = waveformId(ph, tw);
-  const auto it     = _waveforms.find(wfId);
+  std::lock_guard<std::mutex> lock(_waveformsMutex);
+  const auto it = _waveforms.find(wfId);
   return it != _waveforms.end();
 }
 
+size_t MemCachedLoader::cachedBytes() const
+{
+  std::lock_guard<std::mutex> lock(_waveformsMutex);
+  return _bytes;
+}
+
+size_t MemCachedLoader::cachedTraces() const
+{
+  std::lock_guard<std::mutex> lock(_waveformsMutex);
+  return _waveforms.size();
+}
+
 GenericRecordCPtr MemCachedLoader::getFromCache(const Core::TimeWindow &tw,
                                                 const std::string &networkCode,
                                                 const std::string &stationCode,
@@ -1013,8 +2000,16 @@ GenericRecordCPtr MemCachedLoader::getFromCache(const Core::TimeWindow &tw,
 {
   const string wfId =
       waveformId(tw, networkCode, stationCode, locationCode, channelCode);
+  std::lock_guard<std::mutex> lock(_waveformsMutex);
   const auto it = _waveforms.find(wfId);
-  return it != _waveforms.end() ? it->second : nullptr;
+  if (it == _waveforms.end())
+  {
+    _counters_mem_misses++;
+    return nullptr;
+  }
+  _counters_mem_hits++;
+  _lru.splice(_lru.begin(), _lru, it->second.lruPos);
+  return it->second.trace;
 }
 
 void MemCachedLoader::storeInCache(const Core::TimeWindow &tw,
@@ -1026,7 +2021,78 @@ void MemCachedLoader::storeInCache(const Core::TimeWindow &tw,
 {
   const string wfId =
       waveformId(tw, networkCode, stationCode, locationCode, channelCode);
-  _waveforms[wfId] = trace;
+  const size_t bytes = sizeof(GenericRecord) + wfId.size() +
+                       (trace->data() ? trace->data()->size() *
+                                            trace->data()->bytes()
+                                      : 0);
+
+  std::lock_guard<std::mutex> lock(_waveformsMutex);
+
+  auto it = _waveforms.find(wfId);
+  if (it != _waveforms.end())
+  {
+    _bytes -= it->second.bytes;
+    it->second.trace = trace;
+    it->second.bytes = bytes;
+    _lru.splice(_lru.begin(), _lru, it->second.lruPos);
+  }
+  else
+  {
+    _lru.push_front(wfId);
+    _waveforms.emplace(wfId, Entry{trace, bytes, _lru.begin()});
+  }
+  _bytes += bytes;
+
+  // evict the least recently used traces, but never the one just stored
+  while (_maxBytes > 0 && _bytes > _maxBytes && _lru.size() > 1)
+  {
+    const auto evicted = _waveforms.find(_lru.back());
+    _bytes -= evicted->second.bytes;
+    _waveforms.erase(evicted);
+    _lru.pop_back();
+    _counters_mem_evictions++;
+  }
+}
+
+void RecordBuffer::feed(const Record *rec)
+{
+  std::lock_guard<std::mutex> lock(_streamsMutex);
+  std::unique_ptr<TimeRingBuffer> &buffer = _streams[rec->streamID()];
+  if (!buffer) buffer.reset(new TimeRingBuffer(Core::TimeSpan(_length)));
+  buffer->feed(rec);
+}
+
+GenericRecordPtr RecordBuffer::get(const Core::TimeWindow &tw,
+                                   const std::string &networkCode,
+                                   const std::string &stationCode,
+                                   const std::string &locationCode,
+                                   const std::string &channelCode) const
+{
+  const string streamId =
+      networkCode + "." + stationCode + "." + locationCode + "." + channelCode;
+
+  // copy the records out of the buffer, which keeps growing meanwhile
+  TimeWindowBuffer seq(tw);
+  {
+    std::lock_guard<std::mutex> lock(_streamsMutex);
+    const auto it = _streams.find(streamId);
+    if (it == _streams.end()) return nullptr;
+    for (const RecordCPtr &rec : *it->second)
+    {
+      if (tw.overlaps(Core::TimeWindow(rec->startTime(), rec->endTime())))
+        seq.feed(rec.get());
+    }
+  }
+
+  try
+  {
+    return buildTrace(seq, tw, networkCode, stationCode, locationCode,
+                      channelCode);
+  }
+  catch (exception &e)
+  {
+    return nullptr;
+  }
 }
 
 Core::TimeWindow
@@ -1050,28 +2116,34 @@ ExtraLenLoader::traceTimeWindowToLoad(const Core::TimeWindow &neededTW,
   return twToLoad;
 }
 
-GenericRecordCPtr ExtraLenLoader::get(const Core::TimeWindow &tw,
-                                      const Catalog::Phase &ph,
-                                      const Catalog::Event &ev,
-                                      bool demeaning,
-                                      const std::string &filterStr,
-                                      double resampleFreq)
+std::vector<GenericRecordCPtr>
+ExtraLenLoader::get(const vector<Request> &requests,
+                    bool demeaning,
+                    const std::string &filterStr,
+                    double resampleFreq)
 {
-  const Core::TimeWindow twToLoad = traceTimeWindowToLoad(tw, ph.time);
-  GenericRecordCPtr trace =
-      Loader::get(twToLoad, ph, ev, demeaning, filterStr, resampleFreq);
-  if (trace && twToLoad != tw)
+  vector<Request> toLoad(requests);
+  for (Request &req : toLoad)
+    req.tw = traceTimeWindowToLoad(req.tw, req.ph->time);
+
+  vector<GenericRecordCPtr> traces =
+      Loader::get(toLoad, demeaning, filterStr, resampleFreq);
+
+  for (size_t i = 0; i < requests.size(); i++)
   {
-    GenericRecordPtr nonConstTrace(new GenericRecord(*trace));
-    if (!trim(*nonConstTrace, tw))
+    GenericRecordCPtr &trace = traces[i];
+    const Request &req       = requests[i];
+    if (trace && toLoad[i].tw != req.tw)
     {
-      SEISCOMP_DEBUG("Incomplete trace, not enough data (%s)",
-                     string(ph).c_str());
-      return nullptr;
+      trace = trimmedCopy(*trace, req.tw);
+      if (!trace)
+      {
+        SEISCOMP_DEBUG("Incomplete trace, not enough data (%s)",
+                       string(*req.ph).c_str());
+      }
     }
-    trace = nonConstTrace;
   }
-  return trace;
+  return traces;
 }
 
 Core::TimeWindow
@@ -1092,58 +2164,86 @@ bool SnrFilteredLoader::goodSnr(const GenericRecordCPtr &trace,
   return snr >= _snr.minSnr;
 }
 
-GenericRecordCPtr SnrFilteredLoader::get(const Core::TimeWindow &tw,
-                                         const Catalog::Phase &ph,
-                                         const Catalog::Event &ev,
-                                         bool demeaning,
-                                         const std::string &filterStr,
-                                         double resampleFreq)
+std::vector<GenericRecordCPtr>
+SnrFilteredLoader::get(const vector<Request> &requests,
+                       bool demeaning,
+                       const std::string &filterStr,
+                       double resampleFreq)
 {
-  const string wfId = waveformId(ph, tw);
+  vector<GenericRecordCPtr> traces(requests.size());
 
-  // Check if we have already excluded the trace SNR
-  if (_snrExcludedWfs.count(wfId) != 0)
+  // Skip the traces whose SNR we have already excluded
+  vector<size_t> toLoadIdx;
+  vector<Request> toLoad;
+  vector<string> wfIds(requests.size());
   {
-    return nullptr;
+    std::lock_guard<std::mutex> lock(_snrWfsMutex);
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+      const Request &req = requests[i];
+      wfIds[i]           = waveformId(*req.ph, req.tw);
+      if (_snrExcludedWfs.count(wfIds[i]) != 0) continue;
+      toLoadIdx.push_back(i);
+      toLoad.push_back({req.tw | snrTimeWindow(req.ph->time), req.ph, req.ev});
+    }
   }
 
-  const Core::TimeWindow twToLoad = tw | snrTimeWindow(ph.time);
-  GenericRecordCPtr trace =
-      Loader::get(twToLoad, ph, ev, demeaning, filterStr, resampleFreq);
-
-  if (!trace) return nullptr;
+  vector<GenericRecordCPtr> loaded =
+      Loader::get(toLoad, demeaning, filterStr, resampleFreq);
 
-  // Check if we have already validated the trace SNR, if not do it now
-  if (_snrGoodWfs.count(wfId) == 0)
+  for (size_t j = 0; j < toLoad.size(); j++)
   {
-    if (!goodSnr(trace, ph.time))
+    GenericRecordCPtr trace = loaded[j];
+    if (!trace) continue;
+
+    const size_t i             = toLoadIdx[j];
+    const string &wfId         = wfIds[i];
+    const Catalog::Phase &ph   = *requests[i].ph;
+    const Catalog::Event &ev   = *requests[i].ev;
+    const Core::TimeWindow &tw = requests[i].tw;
+
+    // Check if we have already validated the trace SNR, if not do it now
+    bool snrValidated;
     {
-      _snrExcludedWfs.insert(wfId);
-      SEISCOMP_DEBUG("Trace has too low SNR(%s)", string(ph).c_str());
-      // Debugging waveforms: dump snr low traces
-      if (!_wfDebugDir.empty())
+      std::lock_guard<std::mutex> lock(_snrWfsMutex);
+      snrValidated = _snrGoodWfs.count(wfId) != 0;
+    }
+    if (!snrValidated)
+    {
+      if (!goodSnr(trace, ph.time))
       {
-        writeTrace(trace,
-                   waveformDebugPath(_wfDebugDir, ev, ph, "snr-rejected"));
+        {
+          std::lock_guard<std::mutex> lock(_snrWfsMutex);
+          _snrExcludedWfs.insert(wfId);
+        }
+        SEISCOMP_DEBUG("Trace has too low SNR(%s)", string(ph).c_str());
+        // Debugging waveforms: dump snr low traces
+        if (!_wfDebugDir.empty())
+        {
+          writeTrace(trace,
+                     waveformDebugPath(_wfDebugDir, ev, ph, "snr-rejected"));
+        }
+        _counters_wf_snr_low++;
+        continue;
       }
-      _counters_wf_snr_low++;
-      return nullptr;
+      std::lock_guard<std::mutex> lock(_snrWfsMutex);
+      _snrGoodWfs.insert(wfId);
     }
-    _snrGoodWfs.insert(wfId);
-  }
-  if (twToLoad != tw)
-  {
-    GenericRecordPtr nonConstTrace(new GenericRecord(*trace));
-    if (!trim(*nonConstTrace, tw))
+    if (toLoad[j].tw != tw)
     {
-      SEISCOMP_DEBUG("Error when checking SNR, cannot trim data (%s)",
-                     string(ph).c_str());
-      return nullptr;
+      trace = trimmedCopy(*trace, tw);
+      if (!trace)
+      {
+        SEISCOMP_DEBUG("Error when checking SNR, cannot trim data (%s)",
+                       string(ph).c_str());
+        continue;
+      }
     }
-    trace = nonConstTrace;
+
+    traces[i] = trace;
   }
 
-  return trace;
+  return traces;
 }
 
 } // namespace Waveform
@@ -19,15 +19,22 @@
 #define __HDD_WAVEFORM_H__
 
 #include "catalog.h"
+#include "packedarchive.h"
 
 #include <seiscomp3/core/genericrecord.h>
 #include <seiscomp3/core/recordsequence.h>
 #include <seiscomp3/core/strings.h>
 #include <seiscomp3/datamodel/utils.h>
 
+#include <atomic>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 namespace Seiscomp {
 namespace HDD {
@@ -41,30 +48,144 @@ readWaveformFromRecordStream(const std::string &recordStreamURL,
                              const std::string &locationCode,
                              const std::string &channelCode);
 
+struct StreamRequest
+{
+  Core::TimeWindow tw;
+  std::string networkCode;
+  std::string stationCode;
+  std::string locationCode;
+  std::string channelCode;
+};
+
+/*
+ * Load many traces at once: the requests are sorted by stream and time, the
+ * overlapping time windows of the same stream are requested only once and
+ * the streams are fetched over a few RecordStream sessions, each one
+ * containing at most maxStreamsPerSession streams. The records are then
+ * demultiplexed into the requested traces. traces[i] is nullptr when
+ * requests[i] could not be loaded. If sessionErrors is given,
+ * (*sessionErrors)[i] tells whether requests[i] could not be loaded because
+ * its session failed (e.g. the record stream was not reachable) rather than
+ * because the data is not available
+ */
+std::vector<GenericRecordPtr>
+readWaveformsFromRecordStream(const std::string &recordStreamURL,
+                              const std::vector<StreamRequest> &requests,
+                              std::vector<bool> *sessionErrors = nullptr,
+                              unsigned maxStreamsPerSession    = 500);
+
 bool merge(GenericRecord &trace, const RecordSequence &seq);
 bool trim(GenericRecord &trace, const Core::TimeWindow &tw);
 
+// Like trim on a copy of the trace, but only the samples within tw are
+// copied. Return nullptr if the trace doesn't contain tw
+GenericRecordPtr trimmedCopy(const GenericRecord &trace,
+                             const Core::TimeWindow &tw);
+
+/*
+ * Non-owning view of the samples of a trace (of type double), e.g. a window
+ * of a cached trace: the trace must outlive the view
+ */
+struct TraceView
+{
+  const GenericRecord *trace = nullptr;
+  int offset                 = 0; // first sample of the view
+  int size                   = 0; // number of samples
+  Core::Time startTime;
+
+  TraceView() = default;
+
+  // the whole trace
+  explicit TraceView(const GenericRecord &tr);
+
+  const double *data() const;
+  double samplingFrequency() const { return trace->samplingFrequency(); }
+};
+
+// Like trim, but only the view is narrowed and no data is copied
+bool trim(TraceView &view, const Core::TimeWindow &tw);
+
 void filter(GenericRecord &trace,
             bool demeaning               = true,
             const std::string &filterStr = "",
             double resampleFreq          = 0);
+
+// Like filter on a copy of the trace, but the copy, the demeaning and the
+// resampling are performed in a single pass over the data
+GenericRecordPtr processedCopy(const GenericRecord &trace,
+                               bool demeaning               = true,
+                               const std::string &filterStr = "",
+                               double resampleFreq          = 0);
+// average is only used when the two sampling frequencies are not in a
+// rational ratio (see Resampler)
 void resample(GenericRecord &trace, double sf, bool average);
 
 void writeTrace(GenericRecordCPtr trace, const std::string &file);
 GenericRecordPtr readTrace(const std::string &file);
 
+// miniSEED (de)serialization, throw on errors
+void writeTrace(const GenericRecordCPtr &trace, std::ostream &os);
+GenericRecordPtr readTrace(std::istream &is);
+
 double computeSnr(const GenericRecordCPtr &tr,
                   const Core::Time &pickTime,
                   double noiseOffsetStart,
                   double noiseOffsetEnd,
                   double signalOffsetStart,
                   double signalOffsetEnd);
+
+/*
+ * Cross-correlation implementation: DIRECT is the time-domain loop, FFT
+ * computes the correlation series in the frequency domain and AUTO selects
+ * the cheapest of the two given the trace length and the max delay
+ */
+enum class XCorrEngine
+{
+  AUTO,
+  DIRECT,
+  FFT
+};
+
 bool xcorr(const GenericRecordCPtr &tr1,
            const GenericRecordCPtr &tr2,
            double maxDelay,
            bool qualityCheck,
            double &delayOut,
-           double &coeffOut);
+           double &coeffOut,
+           XCorrEngine engine = XCorrEngine::AUTO);
+
+bool xcorr(const TraceView &tr1,
+           const TraceView &tr2,
+           double maxDelay,
+           bool qualityCheck,
+           double &delayOut,
+           double &coeffOut,
+           XCorrEngine engine = XCorrEngine::AUTO);
+
+struct XCorrResult
+{
+  bool performed;
+  double delay;
+  double coeff;
+};
+
+/*
+ * Cross-correlate ref against many traces: results[i] is equivalent to
+ * xcorr(ref, others[i], ...). The reference energy and spectrum are computed
+ * once and reused for every trace of the same length
+ */
+std::vector<XCorrResult> xcorr(const GenericRecordCPtr &ref,
+                               const std::vector<GenericRecordCPtr> &others,
+                               double maxDelay,
+                               bool qualityCheck,
+                               XCorrEngine engine = XCorrEngine::AUTO);
+
+// others[i].trace can be nullptr, in which case results[i] is not performed
+std::vector<XCorrResult> xcorr(const TraceView &ref,
+                               const std::vector<TraceView> &others,
+                               double maxDelay,
+                               bool qualityCheck,
+                               XCorrEngine engine = XCorrEngine::AUTO);
 
 std::string getBandAndInstrumentCodes(const std::string &channelCode);
 std::string getOrientationCode(const std::string &channelCode);
@@ -77,6 +198,11 @@ std::string waveformId(const Core::TimeWindow &tw,
 std::string waveformId(const HDD::Catalog::Phase &ph,
                        const Core::TimeWindow &tw);
 
+// identifier of the processing applied to the traces by Loader::get
+std::string processingId(bool demeaning,
+                         const std::string &filterStr,
+                         double resampleFreq);
+
 DEFINE_SMARTPOINTER(Loader);
 
 class Loader : public Core::BaseObject
@@ -90,12 +216,32 @@ public:
 
   virtual ~Loader() {}
 
-  virtual GenericRecordCPtr get(const Core::TimeWindow &tw,
-                                const Catalog::Phase &ph,
-                                const Catalog::Event &ev,
-                                bool demeaning               = false,
-                                const std::string &filterStr = "",
-                                double resampleFreq          = 0);
+  // the phase and the event must outlive the request
+  struct Request
+  {
+    Core::TimeWindow tw;
+    const Catalog::Phase *ph;
+    const Catalog::Event *ev;
+  };
+
+  GenericRecordCPtr get(const Core::TimeWindow &tw,
+                        const Catalog::Phase &ph,
+                        const Catalog::Event &ev,
+                        bool demeaning               = false,
+                        const std::string &filterStr = "",
+                        double resampleFreq          = 0);
+
+  /*
+   * Load many waveforms at once, traces[i] is the waveform for requests[i]
+   * or nullptr if it is not available. The waveforms that are not cached are
+   * fetched from the record stream together (see
+   * readWaveformsFromRecordStream)
+   */
+  virtual std::vector<GenericRecordCPtr>
+  get(const std::vector<Request> &requests,
+      bool demeaning               = false,
+      const std::string &filterStr = "",
+      double resampleFreq          = 0);
 
   virtual bool isCached(const Core::TimeWindow &tw,
                         const Catalog::Phase &ph,
@@ -111,9 +257,9 @@ public:
   }
 
   // counters
-  unsigned _counters_wf_no_avail   = 0;
-  unsigned _counters_wf_cached     = 0;
-  unsigned _counters_wf_downloaded = 0;
+  std::atomic<unsigned> _counters_wf_no_avail{0};
+  std::atomic<unsigned> _counters_wf_cached{0};
+  std::atomic<unsigned> _counters_wf_downloaded{0};
 
 protected:
   Loader(const std::string &recordStream, bool doCaching, bool cacheProcessed)
@@ -148,9 +294,28 @@ protected:
                             const GenericRecordCPtr &trace)
   {}
 
+  // The requests known not to be available from the record stream are not
+  // sent to it (see DiskCachedLoader::enableUnavailableCache)
+  virtual bool isKnownUnavailable(const Request &req) { return false; }
+
+  // To be called only when the record stream answered without data, not on
+  // transient failures
+  virtual void storeUnavailable(const Request &req) {}
+
+  // *sessionError is set when a component could not be loaded because the
+  // record stream failed, rather than because the data is not available
   GenericRecordPtr readAndProjectWaveform(const Core::TimeWindow &tw,
                                           const Catalog::Phase &ph,
-                                          const Catalog::Event &ev);
+                                          const Catalog::Event &ev,
+                                          bool *sessionError = nullptr);
+
+  GenericRecordCPtr processAndCache(GenericRecordCPtr trace,
+                                    bool isCached,
+                                    bool isProcessed,
+                                    const Request &req,
+                                    bool demeaning,
+                                    const std::string &filterStr,
+                                    double resampleFreq);
 
   LoaderPtr _auxLdr;
   const std::string _recordStreamURL;
@@ -168,17 +333,45 @@ public:
   DiskCachedLoader(const std::string &recordStream,
                    bool cacheProcessed,
                    const std::string &cacheDir)
-      : Loader(recordStream, true, cacheProcessed), _cacheDir(cacheDir)
+      : Loader(recordStream, true, cacheProcessed), _cacheDir(cacheDir),
+        _archive(PackedArchive::open(cacheDir))
   {}
 
   DiskCachedLoader(LoaderPtr auxLdr,
                    bool cacheProcessed,
                    const std::string &cacheDir)
-      : Loader(auxLdr, true, cacheProcessed), _cacheDir(cacheDir)
+      : Loader(auxLdr, true, cacheProcessed), _cacheDir(cacheDir),
+        _archive(PackedArchive::open(cacheDir))
   {}
 
   virtual ~DiskCachedLoader() {}
 
+  /*
+   * Store the processed traces too, in a separate archive (cacheDir) and
+   * keyed by the processing settings (demeaning, filter, resampling), so
+   * that they are not processed again when requested with the same settings.
+   * Requests with different settings are processed from the raw traces.
+   * Only for caches of raw traces
+   */
+  void enableProcessedCache(const std::string &cacheDir);
+
+  /*
+   * Remember the waveforms that couldn't be loaded from the record stream,
+   * in an archive (cacheDir), and don't request them again for ttl seconds.
+   * This spares the requests of data missing from the record stream archive
+   * across restarts. The expired entries are removed when the cache is
+   * enabled and whenever the archive has grown to twice the live entries
+   */
+  void enableUnavailableCache(const std::string &cacheDir, double ttl);
+
+  using Loader::get;
+
+  virtual std::vector<GenericRecordCPtr>
+  get(const std::vector<Request> &requests,
+      bool demeaning               = false,
+      const std::string &filterStr = "",
+      double resampleFreq          = 0);
+
   virtual bool isCached(const Core::TimeWindow &tw,
                         const Catalog::Phase &ph,
                         const Catalog::Event &ev);
@@ -197,28 +390,60 @@ protected:
                             const std::string &channelCode,
                             const GenericRecordCPtr &trace);
 
-  std::string waveformPath(const std::string &cacheDir,
-                           const Core::TimeWindow &tw,
-                           const std::string &networkCode,
-                           const std::string &stationCode,
-                           const std::string &locationCode,
-                           const std::string &channelCode) const;
+  virtual bool isKnownUnavailable(const Request &req);
+
+  virtual void storeUnavailable(const Request &req);
 
   std::string _cacheDir;
+  std::shared_ptr<PackedArchive> _archive;
+  std::string _processedCacheDir;
+  std::shared_ptr<PackedArchive> _processedArchive;
+  std::shared_ptr<PackedArchive> _unavailableArchive;
+  double _unavailableTTL = 0;
+  // entries written since the last compaction of _unavailableArchive
+  std::atomic<size_t> _unavailableWrites{0};
+
+  void compactUnavailableCache();
 };
 
+/*
+ * Move the traces of a disk cache directory in the old format (one
+ * waveformId.mseed file per trace) into the packed archive of the same
+ * directory. Return the number of imported traces
+ */
+unsigned importTraceFiles(const std::string &cacheDir);
+
+/*
+ * The reverse of importTraceFiles: copy the traces of the packed archive of
+ * cacheDir into outputDir, one waveformId.mseed file per trace. Return the
+ * number of exported traces
+ */
+unsigned exportTraceFiles(const std::string &cacheDir,
+                          const std::string &outputDir);
+
+// the waveform ids stored in the packed archive of cacheDir, sorted
+std::vector<std::string> listTraces(const std::string &cacheDir);
+
+// true if cacheDir contains trace files in the old format, not imported yet
+bool hasTraceFiles(const std::string &cacheDir);
+
 DEFINE_SMARTPOINTER(MemCachedLoader);
 
 class MemCachedLoader : public Loader
 {
 
 public:
-  MemCachedLoader(const std::string &recordStream, bool cacheProcessed)
-      : Loader(recordStream, true, cacheProcessed)
+  // maxBytes limits the memory used by the cached traces (0 = no limit): the
+  // least recently used traces are evicted when the limit is exceeded and
+  // they will be loaded again from the auxiliary loader (e.g. a disk cache)
+  MemCachedLoader(const std::string &recordStream,
+                  bool cacheProcessed,
+                  size_t maxBytes = 0)
+      : Loader(recordStream, true, cacheProcessed), _maxBytes(maxBytes)
   {}
 
-  MemCachedLoader(LoaderPtr auxLdr, bool cacheProcessed)
-      : Loader(auxLdr, true, cacheProcessed)
+  MemCachedLoader(LoaderPtr auxLdr, bool cacheProcessed, size_t maxBytes = 0)
+      : Loader(auxLdr, true, cacheProcessed), _maxBytes(maxBytes)
   {}
 
   virtual ~MemCachedLoader() {}
@@ -227,6 +452,15 @@ public:
                         const Catalog::Phase &ph,
                         const Catalog::Event &ev);
 
+  size_t maxBytes() const { return _maxBytes; }
+  size_t cachedBytes() const;
+  size_t cachedTraces() const;
+
+  // counters
+  std::atomic<unsigned> _counters_mem_hits{0};
+  std::atomic<unsigned> _counters_mem_misses{0};
+  std::atomic<unsigned> _counters_mem_evictions{0};
+
 protected:
   virtual GenericRecordCPtr getFromCache(const Core::TimeWindow &tw,
                                          const std::string &networkCode,
@@ -241,7 +475,77 @@ protected:
                             const std::string &channelCode,
                             const GenericRecordCPtr &trace);
 
-  std::unordered_map<std::string, GenericRecordCPtr> _waveforms;
+  struct Entry
+  {
+    GenericRecordCPtr trace;
+    size_t bytes;
+    std::list<std::string>::iterator lruPos;
+  };
+
+  const size_t _maxBytes;
+  size_t _bytes = 0;
+  std::unordered_map<std::string, Entry> _waveforms;
+  std::list<std::string> _lru; // waveform ids, most recently used first
+  mutable std::mutex _waveformsMutex;
+};
+
+DEFINE_SMARTPOINTER(RecordBuffer);
+
+/*
+ * Keep the last "length" seconds of records of each stream fed to it, e.g.
+ * by the real-time record acquisition
+ */
+class RecordBuffer : public Core::BaseObject
+{
+public:
+  RecordBuffer(double length) : _length(length) {}
+
+  virtual ~RecordBuffer() {}
+
+  void feed(const Record *rec);
+
+  // return nullptr if the buffer doesn't contain the whole time window
+  GenericRecordPtr get(const Core::TimeWindow &tw,
+                       const std::string &networkCode,
+                       const std::string &stationCode,
+                       const std::string &locationCode,
+                       const std::string &channelCode) const;
+
+  double length() const { return _length; }
+
+private:
+  const double _length;
+  std::unordered_map<std::string, std::unique_ptr<TimeRingBuffer>> _streams;
+  mutable std::mutex _streamsMutex;
+};
+
+DEFINE_SMARTPOINTER(RecordBufferLoader);
+
+/*
+ * Load the raw traces from a RecordBuffer, the ones not in the buffer are
+ * loaded from the record stream
+ */
+class RecordBufferLoader : public Loader
+{
+public:
+  RecordBufferLoader(const std::string &recordStream, RecordBufferPtr buffer)
+      : Loader(recordStream, true, false), _buffer(buffer)
+  {}
+
+  virtual ~RecordBufferLoader() {}
+
+protected:
+  virtual GenericRecordCPtr getFromCache(const Core::TimeWindow &tw,
+                                         const std::string &networkCode,
+                                         const std::string &stationCode,
+                                         const std::string &locationCode,
+                                         const std::string &channelCode)
+  {
+    return _buffer->get(tw, networkCode, stationCode, locationCode,
+                        channelCode);
+  }
+
+  RecordBufferPtr _buffer;
 };
 
 DEFINE_SMARTPOINTER(ExtraLenLoader);
@@ -259,12 +563,13 @@ public:
 
   virtual ~ExtraLenLoader() {}
 
-  virtual GenericRecordCPtr get(const Core::TimeWindow &tw,
-                                const Catalog::Phase &ph,
-                                const Catalog::Event &ev,
-                                bool demeaning               = false,
-                                const std::string &filterStr = "",
-                                double resampleFreq          = 0);
+  using Loader::get;
+
+  virtual std::vector<GenericRecordCPtr>
+  get(const std::vector<Request> &requests,
+      bool demeaning               = false,
+      const std::string &filterStr = "",
+      double resampleFreq          = 0);
 
   Core::TimeWindow traceTimeWindowToLoad(const Core::TimeWindow &neededTW,
                                          const Core::Time &pickTime) const;
@@ -301,12 +606,13 @@ public:
 
   virtual ~SnrFilteredLoader() {}
 
-  GenericRecordCPtr get(const Core::TimeWindow &tw,
-                        const Catalog::Phase &ph,
-                        const Catalog::Event &ev,
-                        bool demeaning               = false,
-                        const std::string &filterStr = "",
-                        double resampleFreq          = 0);
+  using Loader::get;
+
+  virtual std::vector<GenericRecordCPtr>
+  get(const std::vector<Request> &requests,
+      bool demeaning               = false,
+      const std::string &filterStr = "",
+      double resampleFreq          = 0);
 
   Core::TimeWindow snrTimeWindow(const Core::Time &pickTime) const;
 
@@ -314,7 +620,7 @@ public:
                const Core::Time &pickTime) const;
 
   // counters
-  unsigned _counters_wf_snr_low = 0;
+  std::atomic<unsigned> _counters_wf_snr_low{0};
 
 protected:
   struct
@@ -328,6 +634,7 @@ protected:
 
   std::unordered_set<std::string> _snrGoodWfs;
   std::unordered_set<std::string> _snrExcludedWfs;
+  std::mutex _snrWfsMutex;
 };
 
 } // namespace Waveform
@@ -20,11 +20,21 @@
 
 #include "catalog.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
 #include <unordered_map>
+#include <vector>
 
 namespace Seiscomp {
 namespace HDD {
 
+/*
+ * The cross-correlation results are looked up once per double-difference
+ * observation in every solver iteration, so the keys are packed integers
+ * (event id, interned station index, phase type) and the peers of an entry
+ * are kept in flat vectors sorted by event id
+ */
 class XCorrCache {
 
 public:
@@ -40,16 +50,39 @@ public:
         struct PeerInfo {
             double coeff, lag, lowerUncertainty, upperUncertainty;
         };
-        std::unordered_map<unsigned,const PeerInfo> peers;
-
-        std::string peersStr; // debug
+        std::vector<unsigned> peerIds; // sorted
+        std::vector<PeerInfo> peers;   // same order as peerIds
 
         void update(const Catalog::Event& event, const Catalog::Phase& phase,
                     double coeff, double lag)
         {
+            auto it = std::lower_bound(peerIds.begin(), peerIds.end(), event.id);
+            if ( it != peerIds.end() && *it == event.id ) return;
             PeerInfo pi= {coeff, lag, phase.lowerUncertainty, phase.upperUncertainty};
-            peers.insert( std::pair<unsigned,const PeerInfo>(event.id, pi) );
-            peersStr   += std::string(event) + " ";
+            peers.insert(peers.begin() + (it - peerIds.begin()), pi);
+            peerIds.insert(it, event.id);
+        }
+
+        bool hasPeer(unsigned evId) const
+        {
+            return std::binary_search(peerIds.begin(), peerIds.end(), evId);
+        }
+
+        const PeerInfo& getPeer(unsigned evId) const
+        {
+            auto it = std::lower_bound(peerIds.begin(), peerIds.end(), evId);
+            if ( it == peerIds.end() || *it != evId )
+                throw std::out_of_range("XCorrCache: unknown peer event");
+            return peers[it - peerIds.begin()];
+        }
+
+        // debug: built only when needed (e.g. in the log messages arguments,
+        // which are evaluated only if the log level is enabled)
+        std::string peersStr() const
+        {
+            std::string str;
+            for ( unsigned evId : peerIds ) str += std::to_string(evId) + " ";
+            return str;
         }
 
         void computeStats()
@@ -59,9 +92,8 @@ public:
             mean_lag   = 0;
             min_lag    = 0;
             max_lag    = 0;
-            for ( auto& pair : peers )
+            for ( const PeerInfo& data : peers )
             {
-                const PeerInfo& data = pair.second;
                 mean_coeff += std::abs(data.coeff);
                 mean_lag   += data.lag;
                 min_lag    += data.lag - data.lowerUncertainty;
@@ -77,15 +109,15 @@ public:
     Entry& getForUpdate(unsigned evId, const std::string& stationId,
                                   const Catalog::Phase::Type& type)
     {
-        std::string key = make_key(evId, stationId, type);
-        return resultsByPhase[key];
+        return resultsByPhase[make_key(evId, internStation(stationId), type)];
     }
 
     void remove(unsigned evId, const std::string& stationId,
                 const Catalog::Phase::Type& type)
     {
-        std::string key = make_key(evId, stationId, type);
-        resultsByPhase.erase(key);
+        uint32_t staIdx;
+        if ( findStation(stationId, staIdx) )
+            resultsByPhase.erase(make_key(evId, staIdx, type));
     }
 
     void computeStats()
@@ -95,43 +127,76 @@ public:
 
     bool has(unsigned evId, const std::string& stationId, const Catalog::Phase::Type& type ) const
     {
-        std::string key = make_key(evId, stationId, type);
-        return resultsByPhase.count(key) != 0;
+        return find(evId, stationId, type) != nullptr;
     }
 
     const Entry& get(unsigned evId, const std::string& stationId,
                      const Catalog::Phase::Type& type ) const
     {
-        std::string key = make_key(evId, stationId, type);
-        return resultsByPhase.at(key);
+        const Entry* entry = find(evId, stationId, type);
+        if ( !entry )
+            throw std::out_of_range("XCorrCache: unknown event/station/phase");
+        return *entry;
     }
 
     bool has(unsigned evId1, unsigned evId2, const std::string& stationId,
              const Catalog::Phase::Type& type ) const
     {
-        return has(evId1, stationId, type) && (get(evId1, stationId, type).peers.count(evId2) != 0);
+        const Entry* entry = find(evId1, stationId, type);
+        return entry && entry->hasPeer(evId2);
     }
 
     const Entry::PeerInfo& get(unsigned evId1, unsigned evId2,
                                const std::string& stationId,
                                const Catalog::Phase::Type& type ) const
     {
-        return get(evId1, stationId, type).peers.at(evId2);
+        return get(evId1, stationId, type).getPeer(evId2);
     } 
 
 private:
-    static std::string make_key(unsigned evId, const std::string& stationId,
-                                const Catalog::Phase::Type& type )
+    // event id (32 bits) | station index (24 bits) | phase type (8 bits)
+    static uint64_t make_key(unsigned evId, uint32_t staIdx,
+                             const Catalog::Phase::Type& type )
     {
-        return std::to_string(evId) + "." + stationId + "." + static_cast<char>(type);
+        return (uint64_t(evId) << 32) | (uint64_t(staIdx) << 8) |
+               static_cast<unsigned char>(type);
     }
 
+    uint32_t internStation(const std::string& stationId)
+    {
+        auto it = stationIndex.find(stationId);
+        if ( it != stationIndex.end() ) return it->second;
+        if ( stationIndex.size() >= (1u << 24) )
+            throw std::runtime_error("XCorrCache: too many stations");
+        uint32_t staIdx = stationIndex.size();
+        stationIndex.emplace(stationId, staIdx);
+        return staIdx;
+    }
+
+    bool findStation(const std::string& stationId, uint32_t& staIdx) const
+    {
+        auto it = stationIndex.find(stationId);
+        if ( it == stationIndex.end() ) return false;
+        staIdx = it->second;
+        return true;
+    }
+
+    const Entry* find(unsigned evId, const std::string& stationId,
+                      const Catalog::Phase::Type& type ) const
+    {
+        uint32_t staIdx;
+        if ( !findStation(stationId, staIdx) ) return nullptr;
+        auto it = resultsByPhase.find(make_key(evId, staIdx, type));
+        return it != resultsByPhase.end() ? &it->second : nullptr;
+    }
+
+    std::unordered_map<std::string, uint32_t> stationIndex;
+
     // cache of computed xcorr
-    std::unordered_map<std::string, Entry> resultsByPhase;
+    std::unordered_map<uint64_t, Entry> resultsByPhase;
 
 };
 
-
 }
 }
 
@@ -0,0 +1,232 @@
+/***************************************************************************
+ *   Copyright (C) by ETHZ/SED                                             *
+ *                                                                         *
+ * This program is free software: you can redistribute it and/or modify    *
+ * it under the terms of the GNU Affero General Public License as published*
+ * by the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                     *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ * GNU Affero General Public License for more details.                     *
+ *                                                                         *
+ *                                                                         *
+ *   Developed by Luca Scarabello <luca.scarabello@sed.ethz.ch>            *
+ ***************************************************************************/
+
+#include "xcorrkernel.h"
+
+#include <stdexcept>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HDD_XCORRKERNEL_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace Seiscomp {
+namespace HDD {
+namespace XCorrKernel {
+
+namespace {
+
+void numeratorsScalar(const double *s,
+                      int sSize,
+                      const double *seg,
+                      int firstDelay,
+                      int numDelays,
+                      double *out)
+{
+  for (int d = firstDelay; d < numDelays; d++)
+  {
+    double numer = 0;
+    for (int i = 0; i < sSize; i++) numer += s[i] * seg[i + d];
+    out[d] = numer;
+  }
+}
+
+#ifdef HDD_XCORRKERNEL_X86
+
+/*
+ * The SIMD kernels vectorize over the delays: every lane of an accumulator is
+ * a different delay, the short trace sample is broadcast to all lanes and the
+ * long trace segment is loaded (unaligned) starting at the first delay of the
+ * block. Four independent accumulators per block hide the add latency. The
+ * delays that do not fill a whole block are left to the scalar loop
+ */
+
+__attribute__((target("sse2"))) void numeratorsSse2(const double *s,
+                                                    int sSize,
+                                                    const double *seg,
+                                                    int numDelays,
+                                                    double *out)
+{
+  const int block = 4 * 2;
+  int d           = 0;
+  for (; d + block <= numDelays; d += block)
+  {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    __m128d acc2 = _mm_setzero_pd();
+    __m128d acc3 = _mm_setzero_pd();
+    const double *l = seg + d;
+    for (int i = 0; i < sSize; i++)
+    {
+      const __m128d si = _mm_set1_pd(s[i]);
+      acc0 = _mm_add_pd(acc0, _mm_mul_pd(si, _mm_loadu_pd(l + i)));
+      acc1 = _mm_add_pd(acc1, _mm_mul_pd(si, _mm_loadu_pd(l + i + 2)));
+      acc2 = _mm_add_pd(acc2, _mm_mul_pd(si, _mm_loadu_pd(l + i + 4)));
+      acc3 = _mm_add_pd(acc3, _mm_mul_pd(si, _mm_loadu_pd(l + i + 6)));
+    }
+    _mm_storeu_pd(out + d, acc0);
+    _mm_storeu_pd(out + d + 2, acc1);
+    _mm_storeu_pd(out + d + 4, acc2);
+    _mm_storeu_pd(out + d + 6, acc3);
+  }
+  numeratorsScalar(s, sSize, seg, d, numDelays, out);
+}
+
+__attribute__((target("avx2"))) void numeratorsAvx2(const double *s,
+                                                    int sSize,
+                                                    const double *seg,
+                                                    int numDelays,
+                                                    double *out)
+{
+  const int block = 4 * 4;
+  int d           = 0;
+  for (; d + block <= numDelays; d += block)
+  {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    __m256d acc2 = _mm256_setzero_pd();
+    __m256d acc3 = _mm256_setzero_pd();
+    const double *l = seg + d;
+    for (int i = 0; i < sSize; i++)
+    {
+      const __m256d si = _mm256_set1_pd(s[i]);
+      acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(si, _mm256_loadu_pd(l + i)));
+      acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(si, _mm256_loadu_pd(l + i + 4)));
+      acc2 = _mm256_add_pd(acc2, _mm256_mul_pd(si, _mm256_loadu_pd(l + i + 8)));
+      acc3 =
+          _mm256_add_pd(acc3, _mm256_mul_pd(si, _mm256_loadu_pd(l + i + 12)));
+    }
+    _mm256_storeu_pd(out + d, acc0);
+    _mm256_storeu_pd(out + d + 4, acc1);
+    _mm256_storeu_pd(out + d + 8, acc2);
+    _mm256_storeu_pd(out + d + 12, acc3);
+  }
+  numeratorsSse2(s, sSize, seg + d, numDelays - d, out + d);
+}
+
+__attribute__((target("avx512f"))) void numeratorsAvx512(const double *s,
+                                                         int sSize,
+                                                         const double *seg,
+                                                         int numDelays,
+                                                         double *out)
+{
+  const int block = 4 * 8;
+  int d           = 0;
+  for (; d + block <= numDelays; d += block)
+  {
+    __m512d acc0 = _mm512_setzero_pd();
+    __m512d acc1 = _mm512_setzero_pd();
+    __m512d acc2 = _mm512_setzero_pd();
+    __m512d acc3 = _mm512_setzero_pd();
+    const double *l = seg + d;
+    for (int i = 0; i < sSize; i++)
+    {
+      const __m512d si = _mm512_set1_pd(s[i]);
+      acc0 = _mm512_add_pd(acc0, _mm512_mul_pd(si, _mm512_loadu_pd(l + i)));
+      acc1 = _mm512_add_pd(acc1, _mm512_mul_pd(si, _mm512_loadu_pd(l + i + 8)));
+      acc2 =
+          _mm512_add_pd(acc2, _mm512_mul_pd(si, _mm512_loadu_pd(l + i + 16)));
+      acc3 =
+          _mm512_add_pd(acc3, _mm512_mul_pd(si, _mm512_loadu_pd(l + i + 24)));
+    }
+    _mm512_storeu_pd(out + d, acc0);
+    _mm512_storeu_pd(out + d + 8, acc1);
+    _mm512_storeu_pd(out + d + 16, acc2);
+    _mm512_storeu_pd(out + d + 24, acc3);
+  }
+  numeratorsAvx2(s, sSize, seg + d, numDelays - d, out + d);
+}
+
+#endif
+
+bool isaSupported(Isa isa)
+{
+  switch (isa)
+  {
+  case Isa::SCALAR: return true;
+#ifdef HDD_XCORRKERNEL_X86
+  case Isa::SSE2: return __builtin_cpu_supports("sse2");
+  case Isa::AVX2:
+    return __builtin_cpu_supports("avx2") && isaSupported(Isa::SSE2);
+  case Isa::AVX512:
+    return __builtin_cpu_supports("avx512f") && isaSupported(Isa::AVX2);
+#endif
+  default: return false;
+  }
+}
+
+} // namespace
+
+Isa detectIsa()
+{
+  // the CPU doesn't change while we are running
+  static const Isa best = [] {
+    for (Isa isa : {Isa::AVX512, Isa::AVX2, Isa::SSE2})
+      if (isaSupported(isa)) return isa;
+    return Isa::SCALAR;
+  }();
+  return best;
+}
+
+string isaName(Isa isa)
+{
+  switch (isa)
+  {
+  case Isa::SCALAR: return "scalar";
+  case Isa::SSE2: return "SSE2";
+  case Isa::AVX2: return "AVX2";
+  case Isa::AVX512: return "AVX-512";
+  }
+  return "unknown";
+}
+
+void numerators(const double *s,
+                int sSize,
+                const double *seg,
+                int numDelays,
+                double *out)
+{
+  numerators(s, sSize, seg, numDelays, out, detectIsa());
+}
+
+void numerators(const double *s,
+                int sSize,
+                const double *seg,
+                int numDelays,
+                double *out,
+                Isa isa)
+{
+  if (!isaSupported(isa))
+    throw runtime_error("Cross-correlation kernel: " + isaName(isa) +
+                        " is not supported on this machine");
+
+  switch (isa)
+  {
+#ifdef HDD_XCORRKERNEL_X86
+  case Isa::AVX512: numeratorsAvx512(s, sSize, seg, numDelays, out); return;
+  case Isa::AVX2: numeratorsAvx2(s, sSize, seg, numDelays, out); return;
+  case Isa::SSE2: numeratorsSse2(s, sSize, seg, numDelays, out); return;
+#endif
+  default: numeratorsScalar(s, sSize, seg, 0, numDelays, out); return;
+  }
+}
+
+} // namespace XCorrKernel
+} // namespace HDD
+} // namespace Seiscomp
@@ -0,0 +1,76 @@
+/***************************************************************************
+ *   Copyright (C) by ETHZ/SED                                             *
+ *                                                                         *
+ * This program is free software: you can redistribute it and/or modify    *
+ * it under the terms of the GNU Affero General Public License as published*
+ * by the Free Software Foundation, either version 3 of the License, or    *
+ * (at your option) any later version.                                     *
+ *                                                                         *
+ * This program is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ * GNU Affero General Public License for more details.                     *
+ *                                                                         *
+ *                                                                         *
+ *   Developed by Luca Scarabello <luca.scarabello@sed.ethz.ch>            *
+ ***************************************************************************/
+
+#ifndef __HDD_XCORRKERNEL_H__
+#define __HDD_XCORRKERNEL_H__
+
+#include <string>
+
+namespace Seiscomp {
+namespace HDD {
+namespace XCorrKernel {
+
+/*
+ * Instruction sets the direct cross-correlation kernel can use. The best one
+ * supported by the CPU is selected at runtime
+ */
+enum class Isa
+{
+  SCALAR,
+  SSE2,
+  AVX2,
+  AVX512
+};
+
+// best instruction set supported by both the build and the running CPU
+Isa detectIsa();
+
+std::string isaName(Isa isa);
+
+/*
+ * Time-domain correlation numerators of a short trace against a segment of
+ * the long trace that is already zero padded, so that no bounds checks are
+ * needed in the hot loop:
+ *
+ *   out[d] = sum_{i=0}^{sSize-1} s[i] * seg[i+d]    for d in [0, numDelays)
+ *
+ * seg must contain at least sSize + numDelays - 1 samples. Each SIMD lane
+ * accumulates a different delay in the same order as the scalar loop, so all
+ * instruction sets return the same result as the scalar reference up to
+ * rounding
+ */
+void numerators(const double *s,
+                int sSize,
+                const double *seg,
+                int numDelays,
+                double *out);
+
+// same as above, but with an explicit instruction set. Isa::SCALAR is the
+// reference implementation used for validation. Throws if the instruction
+// set is not supported
+void numerators(const double *s,
+                int sSize,
+                const double *seg,
+                int numDelays,
+                double *out,
+                Isa isa);
+
+} // namespace XCorrKernel
+} // namespace HDD
+} // namespace Seiscomp
+
+#endif
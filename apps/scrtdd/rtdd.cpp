@@ -240,6 +240,8 @@ RTDD::Config::Config()
   allowManualOrigin   = false;
   profileTimeAlive    = -1;
   cacheWaveforms      = false;
+  workerThreads       = 1;
+  prefetchRequests    = 4;
   cacheAllWaveforms   = false;
   debugWaveforms      = false;
 
@@ -250,6 +252,8 @@ RTDD::Config::Config()
 
   wakeupInterval = 1; // sec
   logCrontab     = true;
+
+  recordBufferExtraLength = 300;
 }
 
 RTDD::RTDD(int argc, char **argv) : Application(argc, argv)
@@ -280,8 +284,13 @@ RTDD::RTDD(int argc, char **argv) : Application(argc, argv)
   NEW_OPT(_config.logCrontab, "cron.logging");
   NEW_OPT(_config.delayTimes, "cron.delayTimes");
 
+  NEW_OPT(_config.recordBufferStreams, "recordBuffer.streams");
+  NEW_OPT(_config.recordBufferExtraLength, "recordBuffer.extraLength");
+
   NEW_OPT(_config.profileTimeAlive, "performance.profileTimeAlive");
   NEW_OPT(_config.cacheWaveforms, "performance.cacheWaveforms");
+  NEW_OPT(_config.workerThreads, "performance.threads");
+  NEW_OPT(_config.prefetchRequests, "performance.prefetchRequests");
 
   NEW_OPT_CLI(_config.loadProfile, "Mode", "load-profile-wf",
               "Load catalog waveforms from the configured recordstream and "
@@ -295,6 +304,23 @@ RTDD::RTDD(int argc, char **argv) : Application(argc, argv)
   NEW_OPT_CLI(_config.evalXCorr, "Mode", "eval-xcorr",
               "Evaluate cross-correlation settings for the given profile",
               true);
+  NEW_OPT_CLI(_config.precomputeXCorr, "Mode", "precompute-xcorr",
+              "Cross-correlate the catalog events of the given profile and "
+              "store the results into the profile working directory, so that "
+              "they are not computed again",
+              true);
+  NEW_OPT_CLI(_config.importWfCache, "Mode", "import-wf-cache",
+              "Move the waveforms of a cache directory in the old format (one "
+              "file per waveform, e.g. workingDirectory/profileName/wfcache) "
+              "into the packed cache format of the same directory",
+              true);
+  NEW_OPT_CLI(_config.exportWfCache, "Mode", "export-wf-cache",
+              "Copy the waveforms of a packed cache directory into a directory "
+              "in the old format, one file per waveform. Arguments: "
+              "cacheDirectory,outputDirectory",
+              true);
+  NEW_OPT_CLI(_config.listWfCache, "Mode", "list-wf-cache",
+              "Print the waveforms stored in a packed cache directory", true);
   NEW_OPT_CLI(_config.fExpiry, "Mode", "expiry,x",
               "Time span in hours after which objects expire", true);
 
@@ -374,7 +400,9 @@ bool RTDD::validateParameters()
   if (!_config.eventXML.empty() || !_config.dumpCatalog.empty() ||
       !_config.mergeCatalogs.empty() || !_config.dumpCatalogXML.empty() ||
       !_config.loadProfile.empty() || !_config.evalXCorr.empty() ||
-      !_config.relocateProfile.empty() ||
+      !_config.precomputeXCorr.empty() || !_config.relocateProfile.empty() ||
+      !_config.importWfCache.empty() || !_config.exportWfCache.empty() ||
+      !_config.listWfCache.empty() ||
       (!_config.originIDs.empty() && _config.testMode))
   {
     SEISCOMP_INFO("Disable messaging");
@@ -382,9 +410,26 @@ bool RTDD::validateParameters()
     _config.testMode = true; // we won't send any message
   }
 
+  // The real-time record buffer is fed by the application record stream,
+  // which has to be enabled before init() opens it
+  if (!_config.recordBufferStreams.empty() && isMessagingEnabled() &&
+      _config.originIDs.empty())
+  {
+    setRecordStreamEnabled(true);
+    setRecordDatatype(Array::DOUBLE);
+    setRecordInputHint(Record::DATA_ONLY);
+  }
+
   _config.workingDirectory =
       env->absolutePath(configGetPath("workingDirectory"));
 
+  if (_config.workerThreads < 0)
+  {
+    SEISCOMP_ERROR("performance.threads: invalid value %d (0 = all CPUs)",
+                   _config.workerThreads);
+    return false;
+  }
+
   bool profilesOK = true;
 
   for (vector<string>::iterator it = _config.activeProfiles.begin();
@@ -785,6 +830,30 @@ bool RTDD::validateParameters()
     {
       prof->ddcfg.ddObservations2.xcorrMaxInterEvDist = -1;
     }
+    string xcorrEngine;
+    try
+    {
+      makeUpper(xcorrEngine, configGetString(prefix + "engine"));
+    }
+    catch (...)
+    {
+      xcorrEngine = "AUTO";
+    }
+    if (xcorrEngine == "AUTO")
+      prof->ddcfg.ddObservations2.xcorrEngine =
+          HDD::Waveform::XCorrEngine::AUTO;
+    else if (xcorrEngine == "DIRECT")
+      prof->ddcfg.ddObservations2.xcorrEngine =
+          HDD::Waveform::XCorrEngine::DIRECT;
+    else if (xcorrEngine == "FFT")
+      prof->ddcfg.ddObservations2.xcorrEngine = HDD::Waveform::XCorrEngine::FFT;
+    else
+    {
+      SEISCOMP_ERROR("%sengine: invalid cross-correlation engine: %s",
+                     prefix.c_str(), xcorrEngine.c_str());
+      profilesOK = false;
+      continue;
+    }
 
     try
     {
@@ -867,6 +936,46 @@ bool RTDD::validateParameters()
       prof->ddcfg.snr.signalEnd = 0.350;
     }
 
+    prefix = string("profile.") + *it +
+             ".doubleDifferenceObservations.waveformCache.";
+    try
+    {
+      const double memoryBudget = configGetDouble(prefix + "memoryBudget");
+      prof->ddcfg.wfCache.memoryBudget =
+          memoryBudget > 0 ? size_t(memoryBudget * 1048576) : 0;
+    }
+    catch (...)
+    {
+      prof->ddcfg.wfCache.memoryBudget = 0;
+    }
+    try
+    {
+      prof->ddcfg.wfCache.storeProcessed =
+          configGetBool(prefix + "storeProcessed");
+    }
+    catch (...)
+    {
+      prof->ddcfg.wfCache.storeProcessed = false;
+    }
+    try
+    {
+      prof->ddcfg.wfCache.unavailableTTL =
+          configGetDouble(prefix + "unavailableTTL") * 3600;
+    }
+    catch (...)
+    {
+      prof->ddcfg.wfCache.unavailableTTL = 0;
+    }
+    try
+    {
+      prof->ddcfg.wfCache.storeCatalogXCorr =
+          configGetBool(prefix + "storeCatalogXCorr");
+    }
+    catch (...)
+    {
+      prof->ddcfg.wfCache.storeCatalogXCorr = false;
+    }
+
     prefix = string("profile.") + *it + ".solver.";
     try
     {
@@ -887,6 +996,60 @@ bool RTDD::validateParameters()
       prof->ddcfg.ttt.model = "iasp91";
     }
     try
+    {
+      prof->ddcfg.ttt.useGrids =
+          configGetBool(prefix + "travelTimeTable.grid.enable");
+    }
+    catch (...)
+    {
+      prof->ddcfg.ttt.useGrids = false;
+    }
+    try
+    {
+      prof->ddcfg.ttt.precomputeGrids =
+          configGetBool(prefix + "travelTimeTable.grid.precompute");
+    }
+    catch (...)
+    {
+      prof->ddcfg.ttt.precomputeGrids = false;
+    }
+    try
+    {
+      prof->ddcfg.ttt.gridDepthStep =
+          configGetDouble(prefix + "travelTimeTable.grid.depthStep");
+    }
+    catch (...)
+    {
+      prof->ddcfg.ttt.gridDepthStep = 1;
+    }
+    try
+    {
+      prof->ddcfg.ttt.gridMaxDepth =
+          configGetDouble(prefix + "travelTimeTable.grid.maxDepth");
+    }
+    catch (...)
+    {
+      prof->ddcfg.ttt.gridMaxDepth = 40;
+    }
+    try
+    {
+      prof->ddcfg.ttt.gridDistanceStep =
+          configGetDouble(prefix + "travelTimeTable.grid.distanceStep");
+    }
+    catch (...)
+    {
+      prof->ddcfg.ttt.gridDistanceStep = 2;
+    }
+    try
+    {
+      prof->ddcfg.ttt.gridMaxDistance =
+          configGetDouble(prefix + "travelTimeTable.grid.maxDistance");
+    }
+    catch (...)
+    {
+      prof->ddcfg.ttt.gridMaxDistance = 300;
+    }
+    try
     {
       prof->ddcfg.solver.type = configGetString(prefix + "solverType");
     }
@@ -989,6 +1152,51 @@ bool RTDD::validateParameters()
     {
       prof->ddcfg.solver.xcorrObsWeight = 1.0;
     }
+    try
+    {
+      prof->ddcfg.solver.multiThreaded =
+          configGetBool(prefix + "multiThreaded");
+    }
+    catch (...)
+    {
+      prof->ddcfg.solver.multiThreaded = false;
+    }
+    try
+    {
+      prof->ddcfg.solver.blockJacobi =
+          configGetBool(prefix + "blockJacobiPreconditioner");
+    }
+    catch (...)
+    {
+      prof->ddcfg.solver.blockJacobi = false;
+    }
+    try
+    {
+      prof->ddcfg.solver.convergenceLocChange =
+          configGetDouble(prefix + "convergence.locationChange");
+    }
+    catch (...)
+    {
+      prof->ddcfg.solver.convergenceLocChange = 0;
+    }
+    try
+    {
+      prof->ddcfg.solver.convergenceTimeChange =
+          configGetDouble(prefix + "convergence.timeChange");
+    }
+    catch (...)
+    {
+      prof->ddcfg.solver.convergenceTimeChange = 0;
+    }
+    try
+    {
+      prof->ddcfg.solver.convergenceRmsChange =
+          configGetDouble(prefix + "convergence.rmsChange");
+    }
+    catch (...)
+    {
+      prof->ddcfg.solver.convergenceRmsChange = 0;
+    }
 
     // no reason to make those configurable
     prof->ddcfg.ddObservations1.minWeight = 0;
@@ -996,6 +1204,10 @@ bool RTDD::validateParameters()
     prof->ddcfg.solver.L2normalization    = true;
     prof->ddcfg.solver.solverIterations   = 0;
 
+    prof->ddcfg.workerThreads = _config.workerThreads;
+    prof->ddcfg.wfPrefetchRequests =
+        _config.prefetchRequests > 0 ? _config.prefetchRequests : 1;
+
     _profiles.push_back(prof);
   }
 
@@ -1088,6 +1300,67 @@ bool RTDD::run()
     }
   }
 
+  // import a waveform cache directory in the old format and exit
+  if (!_config.importWfCache.empty())
+  {
+    try
+    {
+      unsigned imported =
+          HDD::Waveform::importTraceFiles(_config.importWfCache);
+      SEISCOMP_INFO("Imported %u waveforms into %s", imported,
+                    _config.importWfCache.c_str());
+    }
+    catch (exception &e)
+    {
+      SEISCOMP_ERROR("%s", e.what());
+      return false;
+    }
+    return true;
+  }
+
+  // export a packed waveform cache directory into the old format and exit
+  if (!_config.exportWfCache.empty())
+  {
+    std::vector<std::string> tokens;
+    boost::split(tokens, _config.exportWfCache, boost::is_any_of(","),
+                 boost::token_compress_on);
+    if (tokens.size() != 2)
+    {
+      SEISCOMP_ERROR("--export-wf-cache: expected "
+                     "cacheDirectory,outputDirectory");
+      return false;
+    }
+    try
+    {
+      unsigned exported = HDD::Waveform::exportTraceFiles(tokens[0], tokens[1]);
+      SEISCOMP_INFO("Exported %u waveforms into %s", exported,
+                    tokens[1].c_str());
+    }
+    catch (exception &e)
+    {
+      SEISCOMP_ERROR("%s", e.what());
+      return false;
+    }
+    return true;
+  }
+
+  // list the waveforms of a packed waveform cache directory and exit
+  if (!_config.listWfCache.empty())
+  {
+    try
+    {
+      for (const string &wfId :
+           HDD::Waveform::listTraces(_config.listWfCache))
+        cout << wfId << endl;
+    }
+    catch (exception &e)
+    {
+      SEISCOMP_ERROR("%s", e.what());
+      return false;
+    }
+    return true;
+  }
+
   // evaluate cross-correlation settings and exit
   if (!_config.evalXCorr.empty())
   {
@@ -1107,6 +1380,26 @@ bool RTDD::run()
     return true;
   }
 
+  // compute the catalog cross-correlations, store them and exit
+  if (!_config.precomputeXCorr.empty())
+  {
+    for (ProfilePtr profile : _profiles)
+    {
+      if (profile->name == _config.precomputeXCorr)
+      {
+        profile->ddcfg.wfCache.storeCatalogXCorr = true;
+        profile->load(query(), &_cache, _eventParameters.get(),
+                      _config.workingDirectory, !_config.saveProcessingFiles,
+                      true, _config.cacheAllWaveforms, _config.dumpWaveforms,
+                      false);
+        profile->precomputeXCorr();
+        profile->unload();
+        break;
+      }
+    }
+    return true;
+  }
+
   // load catalog waveforms and exit
   if (!_config.loadProfile.empty())
   {
@@ -1325,11 +1618,85 @@ bool RTDD::run()
   }
 
   //
-  // real time processing (no other command line options)
+  // real time processing (no other command line options). The record buffer
+  // streams are added before Application::run() starts the acquisition
   //
+  if (!initRecordBuffer()) return false;
+
   return Application::run();
 }
 
+/*
+ * Subscribe to the configured streams and keep their latest records in
+ * memory, so that the waveforms of the events to relocate don't have to be
+ * fetched from the recordstream, which might not have them yet
+ */
+bool RTDD::initRecordBuffer()
+{
+  if (_config.recordBufferStreams.empty()) return true;
+
+  if (!recordStream())
+  {
+    SEISCOMP_ERROR("recordBuffer: no recordstream available");
+    return false;
+  }
+
+  // The buffer must contain the xcorr and SNR windows of the picks at the
+  // time of the last scheduled relocation
+  double windowLength = 0;
+  for (const ProfilePtr &prof : _profiles)
+  {
+    double beforePick = 0, afterPick = 0;
+    for (const auto &kv : prof->ddcfg.xcorr)
+    {
+      beforePick =
+          std::max(beforePick, kv.second.maxDelay - kv.second.startOffset);
+      afterPick = std::max(afterPick, kv.second.maxDelay + kv.second.endOffset);
+    }
+    if (prof->ddcfg.snr.minSnr > 0)
+    {
+      beforePick = std::max({beforePick, -prof->ddcfg.snr.noiseStart,
+                             -prof->ddcfg.snr.signalStart});
+      afterPick  = std::max(afterPick, prof->ddcfg.snr.signalEnd);
+    }
+    windowLength = std::max(windowLength, beforePick + afterPick);
+  }
+  double length = windowLength + std::max(_config.recordBufferExtraLength, 0);
+  if (!_config.delayTimes.empty())
+    length += *std::max_element(_config.delayTimes.begin(),
+                                _config.delayTimes.end());
+
+  for (const string &streamID : _config.recordBufferStreams)
+  {
+    vector<string> codes;
+    boost::split(codes, streamID, boost::is_any_of("."));
+    if (codes.size() != 4)
+    {
+      SEISCOMP_ERROR("recordBuffer.streams: invalid stream '%s', expected "
+                     "NET.STA.LOC.CHA",
+                     streamID.c_str());
+      return false;
+    }
+    if (!recordStream()->addStream(codes[0], codes[1], codes[2], codes[3]))
+    {
+      SEISCOMP_ERROR("recordBuffer.streams: cannot subscribe to stream %s",
+                     streamID.c_str());
+      return false;
+    }
+  }
+
+  _recordBuffer = new HDD::Waveform::RecordBuffer(length);
+  for (ProfilePtr &prof : _profiles) prof->recordBuffer = _recordBuffer;
+
+  SEISCOMP_INFO("Keeping the last %.f seconds of %zu streams in memory",
+                length, _config.recordBufferStreams.size());
+
+  // The acquisition is not started here: the application record stream,
+  // enabled in validateParameters, is started by Application::run() with the
+  // streams added above, so there is a single start path
+  return true;
+}
+
 void RTDD::done()
 {
   Application::done();
@@ -2315,6 +2682,7 @@ void RTDD::Profile::load(DatabaseQuery *query,
   hypodd->setUseCatalogWaveformDiskCache(cacheWaveforms);
   hypodd->setWaveformCacheAll(cacheAllWaveforms);
   hypodd->setWaveformDebug(debugWaveforms);
+  hypodd->setRecordBuffer(recordBuffer);
   loaded    = true;
   lastUsage = Core::Time::GMT();
 
@@ -2386,6 +2754,19 @@ void RTDD::Profile::evalXCorr()
   hypodd->evalXCorr();
 }
 
+void RTDD::Profile::precomputeXCorr()
+{
+  if (!loaded)
+  {
+    string msg = Core::stringify(
+        "Cannot compute cross-correlations, profile %s not initialized",
+        name.c_str());
+    throw runtime_error(msg.c_str());
+  }
+  lastUsage = Core::Time::GMT();
+  hypodd->precomputeCatalogXCorr();
+}
+
 // End Profile class
 
 } // namespace Seiscomp
@@ -74,7 +74,8 @@ protected:
   void addObject(const std::string &, DataModel::Object *object);
   void updateObject(const std::string &, DataModel::Object *object);
   void handleRecord(Record *rec)
-  { /* we don't really need this */
+  {
+    if (_recordBuffer) _recordBuffer->feed(rec);
   }
 
   void handleTimeout();
@@ -82,6 +83,8 @@ protected:
   void runNewJobs();
 
 private:
+  bool initRecordBuffer();
+
   DEFINE_SMARTPOINTER(Process);
   DEFINE_SMARTPOINTER(Profile);
   DEFINE_SMARTPOINTER(Cronjob);
@@ -131,6 +134,8 @@ private:
     bool allowManualOrigin;
     int profileTimeAlive; // seconds
     bool cacheWaveforms;
+    int workerThreads; // 0 = all CPUs
+    int prefetchRequests;
     bool cacheAllWaveforms;
     bool debugWaveforms;
 
@@ -148,11 +153,19 @@ private:
     std::string dumpCatalogXML;
     std::string loadProfile;
     std::string evalXCorr;
+    std::string precomputeXCorr;
+    std::string importWfCache;
+    std::string exportWfCache;
+    std::string listWfCache;
 
     // cron
     int wakeupInterval;
     bool logCrontab;
     std::vector<int> delayTimes;
+
+    // real-time record buffer
+    std::vector<std::string> recordBufferStreams;
+    int recordBufferExtraLength; // seconds
   };
 
   class Profile : public Core::BaseObject
@@ -174,6 +187,7 @@ private:
     HDD::CatalogPtr relocateSingleEvent(DataModel::Origin *org);
     HDD::CatalogPtr relocateCatalog();
     void evalXCorr();
+    void precomputeXCorr();
 
     std::string name;
     std::string earthModelID;
@@ -186,6 +200,7 @@ private:
     HDD::Config ddcfg;
     bool useTheoreticalAuto;
     bool useTheoreticalManual;
+    HDD::Waveform::RecordBufferPtr recordBuffer;
 
   private:
     bool loaded;
@@ -225,6 +240,8 @@ private:
 
   DataModel::EventParametersPtr _eventParameters;
 
+  HDD::Waveform::RecordBufferPtr _recordBuffer;
+
   ObjectLog *_inputEvts;
   ObjectLog *_inputOrgs;
   ObjectLog *_outputOrgs;